@@ -9,6 +9,7 @@
 #include <netinet/if_ether.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
 #include <sched.h>
 #include <unistd.h>
 #include <errno.h>
@@ -18,6 +19,12 @@
 #include <string.h>
 #include <time.h>
 #include <endian.h>
+#include "shm_ring.h"
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 
 #ifndef sendmmsg
 # define sendmmsg(sockfd,msgvec,vlen,flags) syscall(SYS_sendmmsg,sockfd,msgvec,vlen,flags)
@@ -47,102 +54,517 @@ static uint8_t mac_group[6]; int group_on = 0;
 static int udp_filter=-1;
 static int batch_sz =16;
 
+/* addr1|addr2|addr3[0..3] as one 16-byte pattern/mask: the BSSID, dest and
+ * group checks collapse into a single compare of bytes 4..19 of the header */
+static uint8_t filt_pat[16], filt_mask[16];
+static int     filt_never=0;                        /* --dest-mac ≠ --group-ip */
+
+static void filt_build(void){
+    memset(filt_pat,0,16); memset(filt_mask,0,16);
+    memcpy(filt_pat+6,mac_bssid,6); memset(filt_mask+6,0xff,6);
+    if(dest_on){ memcpy(filt_pat,mac_dest,6); memset(filt_mask,0xff,6); }
+    if(group_on){
+        if(dest_on && memcmp(mac_dest,mac_group,6)) filt_never=1;
+        memcpy(filt_pat,mac_group,6); memset(filt_mask,0xff,6);
+    }
+}
+static inline int filt_match(const uint8_t *a){      /* a = &hdr[4], 16 bytes */
+    if(filt_never) return 0;                         /* baseline: addr1 can't be both */
+#if defined(__SSE2__)
+    __m128i v=_mm_loadu_si128((const __m128i*)a);
+    __m128i x=_mm_and_si128(_mm_xor_si128(v,_mm_loadu_si128((const __m128i*)filt_pat)),
+                            _mm_loadu_si128((const __m128i*)filt_mask));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x,_mm_setzero_si128()))==0xffff;
+#elif defined(__ARM_NEON)
+    uint8x16_t x=vandq_u8(veorq_u8(vld1q_u8(a),vld1q_u8(filt_pat)),vld1q_u8(filt_mask));
+    uint64x2_t w=vreinterpretq_u64_u8(x);
+    return (vgetq_lane_u64(w,0)|vgetq_lane_u64(w,1))==0;
+#else
+    uint64_t v[2],pt[2],mk[2];
+    memcpy(v,a,16); memcpy(pt,filt_pat,16); memcpy(mk,filt_mask,16);
+    return (((v[0]^pt[0])&mk[0])|((v[1]^pt[1])&mk[1]))==0;
+#endif
+}
+
 /* -------------------- stats (per-second) ------------------------------- */
 static uint64_t stat_recv=0, stat_fwd=0, stat_badfcs=0;
+static uint64_t stat_mpdu=0, stat_retry=0, stat_dup=0;
+static uint64_t stat_amsdu=0, stat_defrag=0;
+static int64_t  stat_lost=0;                        /* gaps − late fills */
 static struct timespec t_prev;
 
+/* -------------------- 802.11 seq / retry tracking ---------------------- */
+/* One sliding bitmap per <RA,TA,TID> (the 802.11 seq-counter scope), same
+ * idea as rtp_merge's dedup_seen() but over the 12-bit sequence space.
+ * Non-QoS data (tid 16) shares its counter with the TA's management frames,
+ * which are not seen here: gaps there are not losses, so that scope only
+ * dedups.  A gap is counted per slot (gap bitmap) and only a late frame
+ * filling such a slot takes it back – never one from before a reset.      */
+#define MAX_SRC   8
+#define SEQ_WIN   1024                              /* < 4096/2 */
+#define SEQ_WMASK (SEQ_WIN-1)
+#define FC_MOREFRAG 0x0400
+#define FC_RETRY  0x0800
+#define QOS_AMSDU 0x80
+struct seq_src{
+    uint8_t  key[12];                               /* addr1|addr2 */
+    uint8_t  tid, used;
+    uint16_t hi;                                    /* highest seq seen */
+    uint64_t bm[SEQ_WIN/64];
+    uint64_t gap[SEQ_WIN/64];                       /* slots counted in stat_lost */
+};
+static struct seq_src src_tab[MAX_SRC];
+static int src_next=0;
+
+static inline int seq12_diff(uint16_t a,uint16_t b){
+    int d=(a-b)&0xfff; return d>=2048? d-4096 : d;
+}
+static void seq_reset(struct seq_src *s,uint16_t seq){
+    memset(s->bm,0,sizeof(s->bm)); memset(s->gap,0,sizeof(s->gap)); s->hi=seq;
+    s->bm[(seq&SEQ_WMASK)>>6]|=1ULL<<(seq&63);
+}
+static struct seq_src *seq_lookup(const uint8_t *key,uint8_t tid,uint16_t seq){
+    for(int i=0;i<MAX_SRC;i++)
+        if(src_tab[i].used && src_tab[i].tid==tid && !memcmp(src_tab[i].key,key,12))
+            return &src_tab[i];
+    struct seq_src *s=&src_tab[src_next]; src_next=(src_next+1)%MAX_SRC;
+    memcpy(s->key,key,12); s->tid=tid; s->used=1; seq_reset(s,seq);
+    return NULL;                                    /* new source: nothing to compare */
+}
+/* returns 1 if (seq) was already seen in the window */
+static int seq_seen(struct seq_src *s,uint16_t seq){
+    int d=seq12_diff(seq,s->hi), gaps=s->tid<16;
+    if(d>=SEQ_WIN||d<=-SEQ_WIN){                    /* restart / long outage */
+        if(d>0 && gaps) stat_lost+=d-1;
+        seq_reset(s,seq); return 0;
+    }
+    if(d>0){                                        /* slide: clear entered slots */
+        for(uint16_t q=s->hi+1;d--;q++){
+            q&=0xfff;
+            uint64_t m=1ULL<<(q&63); int k=(q&SEQ_WMASK)>>6;
+            s->bm[k]&=~m;
+            if(gaps && q!=seq){ s->gap[k]|=m; stat_lost++; }
+            else s->gap[k]&=~m;
+        }
+        s->hi=seq;
+    }
+    int k=(seq&SEQ_WMASK)>>6; uint64_t m=1ULL<<(seq&63);
+    if(s->bm[k]&m) return 1;
+    s->bm[k]|=m;
+    if(s->gap[k]&m){ s->gap[k]&=~m; stat_lost--; }  /* late frame fills a gap */
+    return 0;
+}
+
 /* -------------------- TX batching -------------------------------------- */
 static int out_sock=-1, tx_cnt=0;
 static uint8_t  tx_buf[MAX_BATCH][MAX_PKT];
 static struct iovec  tx_iov[MAX_BATCH];
 static struct mmsghdr tx_msg[MAX_BATCH];
+static struct sockaddr_in tx_dst[MAX_BATCH];       /* --keep-port only */
+
+/* -------------------- output backends ---------------------------------- */
+enum { OUT_UDP, OUT_UNIX, OUT_SHM };
+static int out_mode=OUT_UDP;
+static int out_raw=0;                               /* keep inner UDP header */
+static int keep_port=0;                             /* dst port = inner src port */
+static struct shm_ring out_ring;
+static uint64_t stat_txdrop=0;
+static struct sockaddr_un out_ua={.sun_family=AF_UNIX};
+static time_t out_retry=0;                          /* next reconnect attempt, s */
 static void tx_flush(void);                         /* fwd-decl */
 
+/* AF_UNIX SOCK_SEQPACKET: consumer listens, we connect; no msg_name */
+static int out_unix_connect(void){
+    int fd=socket(AF_UNIX,SOCK_SEQPACKET,0);
+    if(fd<0) return -1;
+    if(connect(fd,(struct sockaddr*)&out_ua,sizeof(out_ua))<0){ close(fd); return -1; }
+    return fd;
+}
+/* consumer went away: drop the socket, retry at most once a second */
+static int out_unix_reopen(void){
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC_COARSE,&t);
+    if(out_sock>=0){ close(out_sock); out_sock=-1; }
+    if(t.tv_sec<out_retry) return -1;
+    out_retry=t.tv_sec+1;
+    if((out_sock=out_unix_connect())>=0)
+        fprintf(stderr,"%s: reconnected\n",out_ua.sun_path);
+    return out_sock;
+}
+
 /* -------------------- radiotap ----------------------------------------- */
+#define RTAP_F_FCS    0x10
 #define RTAP_F_BADFCS 0x40
 struct radiotap_header{ uint8_t v,p; uint16_t len; uint32_t present[]; } __attribute__((packed));
 
+/* -------------------- header walker ------------------------------------ */
+#define ET_IPV4 0x0800
+#define ET_IPV6 0x86dd
+#define ET_VLAN 0x8100
+#define ET_QINQ 0x88a8
+#define IPPROTO_UDP_ 17
+#define MAX_EXT 8
+
+/* LLC/SNAP (RFC 1042 or 802.1H) → [VLAN…] → IPv4/IPv6 (+ext hdrs) → UDP.
+ * Returns the UDP header offset in m, 0 if this is not an unfragmented UDP
+ * datagram with a full 8-byte header inside len.                          */
+static size_t udp_locate(const uint8_t *m,size_t len){
+    if(len<8 || m[0]!=0xaa || m[1]!=0xaa || m[2]!=0x03) return 0;
+    if(m[3]|m[4]) return 0;
+    if(m[5]!=0x00 && m[5]!=0xf8) return 0;         /* RFC 1042 / bridge tunnel */
+    size_t off=6;
+    uint16_t et=(m[off]<<8)|m[off+1]; off+=2;
+    while(et==ET_VLAN || et==ET_QINQ){              /* TCI(2) + inner ethertype(2) */
+        if(off+4>len) return 0;
+        et=(m[off+2]<<8)|m[off+3]; off+=4;
+    }
+
+    const uint8_t *ip=m+off;
+    if(et==ET_IPV4){
+        if(off+20>len || (ip[0]>>4)!=4) return 0;
+        size_t ihl=(ip[0]&0x0f)*4; if(ihl<20) return 0;
+        if(ip[9]!=IPPROTO_UDP_) return 0;
+        if(((ip[6]&0x3f)|ip[7])!=0) return 0;       /* MF or frag offset */
+        off+=ihl;
+    }else if(et==ET_IPV6){
+        if(off+40>len || (ip[0]>>4)!=6) return 0;
+        uint8_t nh=ip[6]; off+=40;
+        for(int n=0;nh!=IPPROTO_UDP_;n++){
+            if(n==MAX_EXT || off+8>len) return 0;
+            const uint8_t *x=m+off;
+            switch(nh){
+            case 0: case 43: case 60:                /* hop-by-hop, routing, dst opts */
+                nh=x[0]; off+=(x[1]+1)*8; break;
+            case 44:                                 /* fragment */
+                if(((x[2]<<8)|x[3])!=0) return 0;   /* offset or M set */
+                nh=x[0]; off+=8; break;
+            case 51:                                 /* AH */
+                nh=x[0]; off+=(x[1]+2)*4; break;
+            default: return 0;                       /* ESP, no-next, TCP, … */
+            }
+        }
+    }else return 0;
+
+    if(off+8>len) return 0;
+    return off;
+}
+
+/* -------------------- MSDU → UDP payload ------------------------------- */
+/* m points at the LLC/SNAP header of one MSDU, len is what is valid there */
+static void handle_msdu(const uint8_t *m,size_t len){
+    size_t udp_off=udp_locate(m,len);
+    if(!udp_off) return;
+    const uint8_t *udp=m+udp_off;
+    uint16_t udp_dst=(udp[2]<<8)|udp[3], udp_len=(udp[4]<<8)|udp[5];
+
+    if(udp_filter!=-1 && udp_dst!=udp_filter) return;
+    if(udp_len<8 || udp_len-(out_raw?0:8)>MAX_PKT || udp_off+udp_len>len) return;
+
+    /* enqueue payload only (strip inner UDP header unless --raw) */
+    size_t pay_len = out_raw? udp_len : udp_len - 8;
+    if(!pay_len) return;                            /* a 0-byte SEQPACKET reads as EOF */
+    stat_recv++;
+    memcpy(tx_buf[tx_cnt], out_raw? udp : udp+8, pay_len);
+    if(keep_port) memcpy(&tx_dst[tx_cnt].sin_port,udp,2);
+    tx_iov[tx_cnt].iov_base=tx_buf[tx_cnt];
+    tx_iov[tx_cnt].iov_len =pay_len;
+    tx_msg[tx_cnt].msg_hdr.msg_iov=&tx_iov[tx_cnt];
+    tx_msg[tx_cnt].msg_hdr.msg_iovlen=1;
+    tx_cnt++; if(tx_cnt==batch_sz) tx_flush();
+}
+
+/* -------------------- A-MSDU ------------------------------------------- */
+/* subframe = DA(6) SA(6) LEN(2, BE) MSDU, padded to 4 bytes except last */
+static void handle_amsdu(const uint8_t *b,size_t len){
+    size_t o=0;
+    while(o+14<=len){
+        size_t sl=(b[o+12]<<8)|b[o+13];
+        if(o+14+sl>len) return;
+        stat_amsdu++;
+        handle_msdu(b+o+14,sl);
+        o+=(14+sl+3)&~(size_t)3;
+    }
+}
+
+/* -------------------- fragment reassembly ------------------------------ */
+#define MAX_FRAG  4
+#define MAX_MSDU  2304
+struct frag_slot{
+    uint8_t  key[12], tid, used, amsdu, next;
+    uint16_t seq;
+    size_t   len;
+    uint8_t  buf[MAX_MSDU];
+};
+static struct frag_slot frag_tab[MAX_FRAG];
+static int frag_next=0;
+
+/* returns the completed MSDU slot, or NULL while more fragments are due */
+static struct frag_slot *defrag(const uint8_t *key,uint8_t tid,uint16_t seq,
+                                uint8_t fn,int more,int amsdu,
+                                const uint8_t *b,size_t len){
+    struct frag_slot *f=NULL;
+    for(int i=0;i<MAX_FRAG;i++)
+        if(frag_tab[i].used && frag_tab[i].tid==tid && !memcmp(frag_tab[i].key,key,12)){
+            f=&frag_tab[i]; break; }
+    if(fn==0){
+        if(!f){ f=&frag_tab[frag_next]; frag_next=(frag_next+1)%MAX_FRAG; }
+        memcpy(f->key,key,12); f->tid=tid; f->used=1; f->amsdu=amsdu;
+        f->seq=seq; f->len=0; f->next=0;
+    }else if(!f || f->seq!=seq){ return NULL; }     /* head lost */
+    if(fn<f->next){ stat_dup++; return NULL; }     /* retransmitted fragment */
+    if(fn>f->next || f->len+len>MAX_MSDU){ f->used=0; return NULL; }
+    memcpy(f->buf+f->len,b,len); f->len+=len; f->next++;
+    if(more) return NULL;
+    f->used=0; stat_defrag++;
+    return f;
+}
+
 /* -------------------- per-packet handler ------------------------------- */
 static void handle_pkt(const struct pcap_pkthdr *h,const uint8_t *p){
     if(h->caplen<sizeof(struct radiotap_header)) return;
     const struct radiotap_header *rh=(const void*)p;
     uint16_t rtlen=le16toh(rh->len); if(rtlen>h->caplen) return;
-    uint32_t pres=rh->present[0];
+    uint32_t pres0=rh->present[0], pres=pres0;
 
-    /* bad FCS? */
-    if(pres&(1<<1)){
-        size_t o=sizeof(struct radiotap_header);
-        while(pres&0x80000000){ if(o+4>h->caplen) return;
+    /* radiotap flags: bad FCS? trailing FCS? (TSFT, if present, comes first) */
+    uint8_t rt_flags=0;
+    if(pres0&(1<<1)){
+        size_t o=sizeof(struct radiotap_header)+4;    /* past present[0] */
+        while(pres&0x80000000){ if(o+4>rtlen) return;
             pres=((uint32_t*)p)[o/4]; o+=4; }
-        if(p[o]&RTAP_F_BADFCS){ stat_badfcs++; return; }
+        if(pres0&1){ o=(o+7)&~(size_t)7; o+=8; }
+        if(o>=rtlen) return;
+        rt_flags=p[o];
+        if(rt_flags&RTAP_F_BADFCS){ stat_badfcs++; return; }
     }
     size_t off=rtlen;
+    size_t end=h->caplen;
+    if(rt_flags&RTAP_F_FCS){ if(end<off+4) return; end-=4; }
 
     /* 802.11 header */
-    if(off+24>h->caplen) return;
+    if(off+24>end) return;
     const uint8_t *fc=p+off;
     uint16_t fc16=fc[0]|(fc[1]<<8);
 
-    /* accept STA→AP or AP→STA */
+    /* data frames with a body only; accept STA→AP or AP→STA */
+    if((fc16&0x0c)!=0x08 || (fc16&0x40)) return;   /* mgmt/ctl, null-data */
     int tods=(fc16>>8)&1, fromds=(fc16>>9)&1;
     if(tods==fromds) return;                       /* ignore IBSS/WDS */
 
-    const uint8_t *addr2=p+off+10; if(memcmp(addr2,mac_bssid,6)!=0) return;
+    /* BSSID(addr2) + dest/group(addr1) in one 16-byte compare */
     const uint8_t *addr1=p+off+4;
-    if(dest_on && memcmp(addr1,mac_dest ,6)!=0) return;
-    if(group_on&& memcmp(addr1,mac_group,6)!=0) return;
-
-    int qos=((fc16>>7)&1)&&((fc16&0x0c)==0x08);
-    off+=24+(qos?2:0); if(off+8>h->caplen) return; off+=8;
-
-    /* UDP header */
-    const uint8_t *ip=p+off; uint8_t ver=ip[0]>>4;
-    uint16_t udp_dst, udp_len; size_t udp_off;
-    if(ver==4){
-        uint8_t ihl=(ip[0]&0x0f)*4; if(ihl<20||off+ihl+8>h->caplen) return;
-        const uint8_t *udp=ip+ihl;
-        udp_dst=(udp[2]<<8)|udp[3]; udp_len=(udp[4]<<8)|udp[5];
-        udp_off=off+ihl;
-    }else if(ver==6){
-        if(off+40+8>h->caplen) return;
-        const uint8_t *udp=ip+40;
-        udp_dst=(udp[2]<<8)|udp[3]; udp_len=(udp[4]<<8)|udp[5];
-        udp_off=off+40;
-    }else return;
+    if(!filt_match(addr1)) return;
 
-    if(udp_filter!=-1 && udp_dst!=udp_filter) return;
-    if(udp_len<8 || udp_len-8>MAX_PKT) return;
+    int qos=(fc16>>7)&1;
+    if(qos && off+26>end) return;
 
-    /* enqueue payload only (strip inner UDP header) */
-    size_t pay_len = udp_len - 8;
-    stat_recv++;
-    memcpy(tx_buf[tx_cnt], p+udp_off+8, pay_len);
-    tx_iov[tx_cnt].iov_base=tx_buf[tx_cnt];
-    tx_iov[tx_cnt].iov_len =pay_len;
-    tx_msg[tx_cnt].msg_hdr.msg_iov=&tx_iov[tx_cnt];
-    tx_msg[tx_cnt].msg_hdr.msg_iovlen=1;
-    tx_cnt++; if(tx_cnt==batch_sz) tx_flush();
+    /* sequence control: count retries, gaps; drop retransmitted dupes.
+     * Only the first fragment takes part – later ones are checked by defrag() */
+    uint16_t sc=fc[22]|(fc[23]<<8), seq=sc>>4;
+    uint8_t  fn=sc&0x0f;
+    uint8_t  tid=qos? (fc[24]&0x0f) : 16;
+    int retry=(fc16&FC_RETRY)!=0, more=(fc16&FC_MOREFRAG)!=0;
+    int amsdu=qos && (fc[24]&QOS_AMSDU);
+    stat_mpdu++; if(retry) stat_retry++;
+    if(fn==0){
+        struct seq_src *ss=seq_lookup(addr1,tid,seq);
+        if(ss && seq_seen(ss,seq) && retry){ stat_dup++; return; }
+    }
+
+    off+=24+(qos?2:0);
+    const uint8_t *body=p+off; size_t blen=end-off;
+    if(fn||more){
+        struct frag_slot *f=defrag(addr1,tid,seq,fn,more,amsdu,body,blen);
+        if(!f) return;
+        body=f->buf; blen=f->len; amsdu=f->amsdu;
+    }
+    if(amsdu) handle_amsdu(body,blen);
+    else      handle_msdu(body,blen);
 }
 
 /* -------------------- batch flush -------------------------------------- */
+static int dry_run=0;                               /* --dry: count, don't send */
 static void tx_flush(void){
     if(tx_cnt==0) return;
-    int sent=sendmmsg(out_sock,tx_msg,tx_cnt,0);
-    if(sent<0) perror("sendmmsg"); else stat_fwd+=sent;
+    if(dry_run){ stat_fwd+=tx_cnt; tx_cnt=0; return; }
+    if(out_mode==OUT_SHM){
+        for(int i=0;i<tx_cnt;i++)
+            if(shm_ring_push(&out_ring,tx_buf[i],tx_iov[i].iov_len)==0) stat_fwd++;
+            else stat_txdrop++;
+        tx_cnt=0; return;
+    }
+    if(out_mode==OUT_UNIX && out_sock<0 && out_unix_reopen()<0){
+        stat_txdrop+=tx_cnt; tx_cnt=0; return; }
+    /* never block capture on a slow local consumer, nor die when it restarts */
+    int sent=sendmmsg(out_sock,tx_msg,tx_cnt,out_mode==OUT_UNIX? MSG_DONTWAIT|MSG_NOSIGNAL : 0);
+    if(sent<0){
+        if(out_mode==OUT_UNIX && (errno==EPIPE||errno==ECONNREFUSED||errno==ECONNRESET||errno==ENOTCONN))
+            out_unix_reopen();
+        else if(errno!=EAGAIN) perror("sendmmsg");
+        stat_txdrop+=tx_cnt;
+    }
+    else{ stat_fwd+=sent; stat_txdrop+=tx_cnt-sent; }
     tx_cnt=0;
 }
 
+/* -------------------- stats line --------------------------------------- */
+static void stats_print(const struct timespec *now){
+    tx_flush();
+    double ts=now->tv_sec+now->tv_nsec/1e9;
+    double rpct=stat_mpdu? 100.0*stat_retry/stat_mpdu : 0.0;
+    printf("%.3f:recv=%"PRIu64":fwd=%"PRIu64":badfcs=%"PRIu64
+           ":mpdu=%"PRIu64":retry=%"PRIu64":retry_pct=%.1f"
+           ":dup=%"PRIu64":lost=%"PRId64
+           ":amsdu=%"PRIu64":defrag=%"PRIu64":txdrop=%"PRIu64"\n",
+           ts,stat_recv,stat_fwd,stat_badfcs,
+           stat_mpdu,stat_retry,rpct,stat_dup,stat_lost,
+           stat_amsdu,stat_defrag,stat_txdrop);
+    fflush(stdout);
+    stat_recv=stat_fwd=stat_badfcs=0;
+    stat_mpdu=stat_retry=stat_dup=0; stat_lost=0;
+    stat_amsdu=stat_defrag=stat_txdrop=0;
+    t_prev=*now;
+}
+static void stats_tick(void){
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    double dt=(now.tv_sec-t_prev.tv_sec)+(now.tv_nsec-t_prev.tv_nsec)/1e9;
+    if(dt>=1.0) stats_print(&now);
+}
+
+/* -------------------- benchmark helpers -------------------------------- */
+static inline uint64_t ns_now(void){
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC,&t);
+    return (uint64_t)t.tv_sec*1000000000ull+t.tv_nsec;
+}
+static void bench_report(const char *what,uint64_t frames,uint64_t busy_ns,uint64_t wall_ns){
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    stats_print(&now);
+    printf("bench:%s:frames=%"PRIu64":wall_s=%.3f:busy_s=%.3f:fps=%.0f:ns_per_frame=%.1f\n",
+           what,frames,wall_ns/1e9,busy_ns/1e9,
+           busy_ns? frames*1e9/busy_ns : 0.0,
+           frames? (double)busy_ns/frames : 0.0);
+    fflush(stdout);
+}
+
+/* -------------------- replay (pcap / pcapng) --------------------------- */
+/* speed 0 = as fast as possible, 1 = original timing, N = N× faster        */
+static int run_replay(const char *file,double speed){
+    char err[PCAP_ERRBUF_SIZE];
+    pcap_t *pc=pcap_open_offline(file,err);
+    if(!pc){fprintf(stderr,"%s\n",err);return 1;}
+    if(pcap_datalink(pc)!=DLT_IEEE802_11_RADIO){
+        fprintf(stderr,"%s: not a radiotap capture\n",file); pcap_close(pc); return 1;
+    }
+    uint64_t frames=0, busy=0, t0=ns_now(), cap0=0;
+    const uint8_t *pkt; struct pcap_pkthdr *hdr; int rc;
+    while((rc=pcap_next_ex(pc,&hdr,&pkt))==1){
+        uint64_t cap=(uint64_t)hdr->ts.tv_sec*1000000000ull+hdr->ts.tv_usec*1000ull;
+        if(!frames) cap0=cap;
+        if(speed>0 && cap>cap0){
+            uint64_t due=t0+(uint64_t)((cap-cap0)/speed);
+            struct timespec ts={.tv_sec=due/1000000000ull,.tv_nsec=due%1000000000ull};
+            while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+        }
+        uint64_t a=ns_now();
+        handle_pkt(hdr,pkt); frames++;
+        busy+=ns_now()-a;
+        stats_tick();
+    }
+    if(rc==-1) fprintf(stderr,"pcap err: %s\n",pcap_geterr(pc));
+    pcap_close(pc);
+    bench_report("replay",frames,busy,ns_now()-t0);
+    return 0;
+}
+
+/* -------------------- synthetic radiotap generator ---------------------- */
+/* Mixed QoS / non-QoS, IPv4 / IPv6 (some with a hop-by-hop ext header),
+ * 1-in-16 bad FCS, 1-in-8 foreign BSSID, 1-in-32 TCP, 200..1400 B payloads. */
+#define SYN_TPL 256
+struct syn_frame{ struct pcap_pkthdr h; uint8_t qos, foreign; uint8_t d[MAX_PKT+128]; };
+
+static void syn_build(struct syn_frame *f,int i,int port){
+    uint8_t *d=f->d; size_t o=0;
+    int qos=(i&1), v6=(i%3==0), hbh=v6&&(i%5==0), bad=(i%16==15);
+    int foreign=(i%8==7), tcp=(i%32==5);
+    size_t pay=200+(i*37)%1201;
+
+    /* radiotap: flags + rate */
+    d[o++]=0; d[o++]=0; d[o++]=10; d[o++]=0;
+    d[o++]=0x06; d[o++]=0; d[o++]=0; d[o++]=0;
+    d[o++]=bad? RTAP_F_BADFCS : 0; d[o++]=0x0c;
+
+    /* 802.11 data, FromDS: addr1=RA addr2=BSSID addr3=SA */
+    d[o++]=qos? 0x88 : 0x08; d[o++]=0x02; d[o++]=0; d[o++]=0;
+    const uint8_t bcast[6]={0xff,0xff,0xff,0xff,0xff,0xff};
+    memcpy(d+o,dest_on? mac_dest : group_on? mac_group : bcast,6); o+=6;
+    memcpy(d+o,mac_bssid,6); if(foreign) d[o+5]^=0x01; o+=6;
+    memcpy(d+o,mac_bssid,6); o+=6;
+    d[o++]=0; d[o++]=0;                             /* seq ctrl, patched per run */
+    if(qos){ d[o++]=5; d[o++]=0; }
+
+    /* LLC/SNAP */
+    static const uint8_t snap[6]={0xaa,0xaa,0x03,0,0,0};
+    memcpy(d+o,snap,6); o+=6;
+    d[o++]=v6? 0x86 : 0x08; d[o++]=v6? 0xdd : 0x00;
+
+    size_t ulen=8+pay;
+    if(v6){
+        size_t plen=ulen+(hbh?8:0);
+        memset(d+o,0,40); d[o]=0x60;
+        d[o+4]=plen>>8; d[o+5]=plen&0xff; d[o+6]=hbh? 0 : tcp? 6 : 17; d[o+7]=64;
+        d[o+23]=1; d[o+39]=2; o+=40;
+        if(hbh){ memset(d+o,0,8); d[o]=tcp? 6 : 17; d[o+2]=1; d[o+3]=4; o+=8; }  /* PadN */
+    }else{
+        memset(d+o,0,20); d[o]=0x45;
+        d[o+2]=(20+ulen)>>8; d[o+3]=(20+ulen)&0xff; d[o+8]=64; d[o+9]=tcp? 6 : 17;
+        d[o+12]=192; d[o+13]=168; d[o+15]=1; d[o+16]=192; d[o+17]=168; d[o+19]=2;
+        o+=20;
+    }
+    d[o++]=5600>>8; d[o++]=5600&0xff; d[o++]=port>>8; d[o++]=port&0xff;
+    d[o++]=ulen>>8; d[o++]=ulen&0xff; d[o++]=0; d[o++]=0;
+    for(size_t k=0;k<pay;k++) d[o++]=(uint8_t)(i+k);
+
+    f->qos=qos; f->foreign=foreign;
+    f->h.caplen=f->h.len=o;
+}
+static int run_synth(uint64_t n){
+    static struct syn_frame tpl[SYN_TPL];
+    int port=udp_filter!=-1? udp_filter : 5600;
+    for(int i=0;i<SYN_TPL;i++) syn_build(&tpl[i],i,port);
+
+    uint16_t seq[2]={0,0};
+    uint64_t t0=ns_now();
+    for(uint64_t i=0;i<n;i++){
+        struct syn_frame *f=&tpl[i%SYN_TPL];
+        uint16_t sc=(seq[f->qos]&0xfff)<<4;
+        if(!f->foreign) seq[f->qos]++;
+        f->d[10+22]=sc&0xff; f->d[10+23]=sc>>8;
+        handle_pkt(&f->h,f->d);
+        if(!(i&1023)) stats_tick();
+    }
+    uint64_t dt=ns_now()-t0;
+    bench_report("synth",n,dt,dt);
+    return 0;
+}
+
 /* -------------------- main --------------------------------------------- */
 int main(int argc,char **argv){
     if(argc<5){
         fprintf(stderr,
 "usage: %s IFACE BSSID DEST_IP DEST_PORT "
-"[--udp-port N] [--dest-mac XX:..] [--group-ip A.B.C.D] [--batch N] [--cpu N]\n", argv[0]);
+"[--udp-port N] [--dest-mac XX:..] [--group-ip A.B.C.D] [--batch N] [--cpu N]\n"
+"       [--replay FILE.pcap[ng]] [--speed X (0=max, 1=orig)] [--synth N] [--dry]\n"
+"       [--out udp|unix:/PATH|shm:/NAME] [--raw] [--keep-port]\n"
+"  --raw        forward the inner UDP header too, for custom consumers that\n"
+"               demux by port; rtp_merge expects bare RTP, don't use it there\n"
+"  --keep-port  UDP out: send to DEST_IP:<inner source port> instead of DEST_PORT\n"
+"  with --replay/--synth IFACE is ignored (use '-')\n", argv[0]);
         return 1;
     }
     const char *iface=argv[1];
     if(!mac_aton(argv[2],mac_bssid)){fprintf(stderr,"bad BSSID\n");return 1;}
     const char *dst_ip=argv[3]; int dst_port=atoi(argv[4]);
+    const char *replay=NULL; double speed=1.0; uint64_t synth=0;
+    const char *out_spec=NULL;
 
     for(int i=5;i<argc;i++){
         if(!strcmp(argv[i],"--udp-port")&&i+1<argc){ udp_filter=atoi(argv[++i]); continue; }
@@ -160,10 +582,45 @@ int main(int argc,char **argv){
         }
         if(!strcmp(argv[i],"--batch")&&i+1<argc){ batch_sz=atoi(argv[++i]); continue; }
         if(!strcmp(argv[i],"--cpu")&&i+1<argc){ pin_cpu(atoi(argv[++i])); continue; }
+        if(!strcmp(argv[i],"--replay")&&i+1<argc){ replay=argv[++i]; continue; }
+        if(!strcmp(argv[i],"--speed")&&i+1<argc){ speed=strtod(argv[++i],NULL); continue; }
+        if(!strcmp(argv[i],"--synth")&&i+1<argc){ synth=strtoull(argv[++i],NULL,0); continue; }
+        if(!strcmp(argv[i],"--dry")){ dry_run=1; continue; }
+        if(!strcmp(argv[i],"--out")&&i+1<argc){ out_spec=argv[++i]; continue; }
+        if(!strcmp(argv[i],"--raw")){ out_raw=1; continue; }
+        if(!strcmp(argv[i],"--keep-port")){ keep_port=1; continue; }
         fprintf(stderr,"unknown option %s\n",argv[i]); return 1;
     }
     if(batch_sz<1) batch_sz=1; 
     if(batch_sz>MAX_BATCH) batch_sz=MAX_BATCH;
+    filt_build();
+    if(filt_never) fprintf(stderr,"warning: --dest-mac and --group-ip differ, nothing will match\n");
+
+    if(out_spec && !strncmp(out_spec,"unix:",5)){
+        snprintf(out_ua.sun_path,sizeof(out_ua.sun_path),"%s",out_spec+5);
+        if((out_sock=out_unix_connect())<0){ perror(out_spec); return 1; }
+        out_mode=OUT_UNIX; keep_port=0;
+    }else if(out_spec && !strncmp(out_spec,"shm:",4)){
+        if(shm_ring_open(&out_ring,out_spec+4,1)<0){ perror(out_spec); return 1; }
+        out_mode=OUT_SHM; keep_port=0;
+    }else if(out_spec && strcmp(out_spec,"udp")){
+        fprintf(stderr,"bad --out %s\n",out_spec); return 1;
+    }else{
+        /* UDP out (unconnected) */
+        out_sock=socket(AF_INET,SOCK_DGRAM,0);
+        struct sockaddr_in dst={.sin_family=AF_INET,.sin_port=htons(dst_port)};
+        inet_pton(AF_INET,dst_ip,&dst.sin_addr);
+        for(int i=0;i<MAX_BATCH;i++){
+            tx_dst[i]=dst;
+            tx_msg[i].msg_hdr.msg_name=&tx_dst[i];
+            tx_msg[i].msg_hdr.msg_namelen=sizeof(tx_dst[i]);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&t_prev);
+
+    if(synth)  return run_synth(synth);
+    if(replay) return run_replay(replay,speed);
 
     /* pcap */
     char err[PCAP_ERRBUF_SIZE];
@@ -175,35 +632,13 @@ int main(int argc,char **argv){
     pcap_set_timeout(pc,100);
     if(pcap_activate(pc)!=0){fprintf(stderr,"pcap activate failed\n");return 1;}
 
-    /* UDP out (unconnected) */
-    out_sock=socket(AF_INET,SOCK_DGRAM,0);
-    struct sockaddr_in dst={.sin_family=AF_INET,.sin_port=htons(dst_port)};
-    inet_pton(AF_INET,dst_ip,&dst.sin_addr);
-    for(int i=0;i<MAX_BATCH;i++){
-        tx_msg[i].msg_hdr.msg_name=&dst;
-        tx_msg[i].msg_hdr.msg_namelen=sizeof(dst);
-    }
-
-    clock_gettime(CLOCK_MONOTONIC,&t_prev);
-
     /* loop */
     while(1){
         const uint8_t *pkt; struct pcap_pkthdr *hdr;
         int rc=pcap_next_ex(pc,&hdr,&pkt);
         if(rc==1) handle_pkt(hdr,pkt);
         else if(rc==-1){ fprintf(stderr,"pcap err: %s\n",pcap_geterr(pc)); break; }
-
-        struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
-        double dt=(now.tv_sec-t_prev.tv_sec)+(now.tv_nsec-t_prev.tv_nsec)/1e9;
-        if(dt>=1.0){
-            tx_flush();
-            double ts=now.tv_sec+now.tv_nsec/1e9;
-            printf("%.3f:recv=%"PRIu64":fwd=%"PRIu64":badfcs=%"PRIu64"\n",
-                   ts,stat_recv,stat_fwd,stat_badfcs);
-            fflush(stdout);
-            stat_recv=stat_fwd=stat_badfcs=0;
-            t_prev=now;
-        }
+        stats_tick();
     }
     return 0;
 }
@@ -1,4 +1,4 @@
-/* linkmgrd.c — master-only fail-over daemon (INI-file RSSI polling)
+/* linkmgrd.c — fail-over daemon (INI-file RSSI polling), optional standby peer
  * ---------------------------------------------------------------
  * Build:  gcc -O2 -Wall -o linkmgrd linkmgrd.c
  *
@@ -7,10 +7,32 @@
  *               - Global `[general]` option `sta_poll_file`
  *                 points to a simple key=value file that is
  *                 refreshed by an external process.
+ * 2026-10-18  —  ICMP probing is asynchronous: one persistent socket,
+ *               echoes to all STAs in parallel, replies matched in the
+ *               main loop; per-STA RTT in /status.
+ *             —  [score] section: links are ranked by a pluggable scorer,
+ *               by default RSSI, retry, RTT percentile and loss combined.
+ *             —  default route via rtnetlink, verified only when an
+ *               RTNLGRP_IPV4_ROUTE event reports a change; the global
+ *               neighbour flush became an update of the new gateway.
+ *             —  make-before-break: `transition_ms` keeps a multipath
+ *               route over old and new gateway before committing;
+ *               `transition_cmd` hook for sender-side duplication.
+ *             —  RSSI samples arrive by inotify on sta_poll_file or as
+ *               datagrams on `sta_listen`; a failing active link is
+ *               evaluated at once and a dead one left without hysteresis.
+ *             —  HTTP: per-poll history ring, /history?since= and
+ *               /metrics (Prometheus); clients are served non-blocking.
+ *             —  [ha]: UDP heartbeat / state sync with a second instance,
+ *               priority election with epochs; the standby runs warm.
+ *             —  [predict]: score trend per STA; the active link is left
+ *               for a healthy one before its predicted floor crossing.
  */
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -23,14 +45,27 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <libgen.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
 
 #define MAX_STA   16
 #define BUF_SZ    4096
+#define OUT_MAX   (4 << 20)        /* largest HTTP response */
+#define HIST_LEN  600              /* per-poll samples kept (5 min at 500 ms) */
+#define MAX_CONN  8
+#define CONN_TO_MS 5000            /* a client gets this long to send + drain */
+#define RTT_WIN   32               /* RTT samples kept per STA */
+#define TREND_MAX 64               /* score samples the trend can span */
 #define LN_SZ     256
 #define CFG_DEF   "/etc/linkmgrd.conf"
 #define EFFECTIVE_RSSI(sta, cfg) \
@@ -38,6 +73,8 @@
 
 static volatile int g_run = 1;
 static int  g_verbose    = 0;
+enum { HA_STANDBY, HA_MASTER };
+static int  g_role       = HA_MASTER;     /* only the master touches routes */
 
 /* ───────────────────────── data structures ───────────────────────────── */
 struct gcfg {
@@ -49,14 +86,57 @@ struct gcfg {
     char html[PATH_MAX];
     char master_if[32];
     char sta_poll_file[PATH_MAX];   /* ← new: external RSSI source */
+    int  sta_watch;                 /* inotify on sta_poll_file */
+    char sta_listen[PATH_MAX];      /* "udp:IP:PORT" | "unix:/path" | "" */
     char switch_cmd[PATH_MAX];             /* NEW: external hook */
+    char route_backend[16];                /* netlink | shell */
+    int  transition_ms;                    /* make-before-break window, 0 = off; needs transition_cmd */
+    char transition_cmd[PATH_MAX];         /* hook: begin|commit OLD NEW */
+
+    /* [ha] two-node heartbeat / state sync */
+    int    ha_node, ha_prio;       /* node_id, priority (higher wins) */
+    int    ha_hb_ms, ha_dead_ms;   /* heartbeat period, peer-silent timeout */
+    int    ha_preempt;             /* higher priority takes over a live master */
+    char   ha_bind[64], ha_peer[64];   /* IP:PORT */
+
+    /* [score] link ranking */
+    char   score_model[16];        /* rssi | weighted */
+    double ewma_alpha;             /* weight of a new sample */
+    double w_rssi, w_retry, w_rtt, w_loss;
+    int    rtt_pct;                /* RTT percentile that is scored */
+
+    /* [predict] handover ahead of a floor crossing */
+    int    horizon_ms;             /* 0 = reactive only */
+    int    trend_n;                /* score samples in the regression */
 };
 struct sta {
     char ip[64];
     char rssi_key[32];
+    char mac[18];          /* optional: pins the neighbour entry on switch */
     int  rssi;
     int  retry;            /* NEW */
     uint8_t fail, succ;
+
+    /* ICMP prober state */
+    struct in_addr addr;
+    uint16_t seq;          /* sequence of the outstanding echo */
+    int   inflight;
+    long  sent_us;
+    int   rtt_us, srtt_us; /* last / smoothed (1/8), -1 = none yet */
+
+    /* scoring inputs */
+    double rssi_s, retry_s;  /* EWMA, -10000 / -1 = no sample */
+    double loss_s;           /* EWMA of probe outcome, 0..1 */
+    int   rtt_win[RTT_WIN], rtt_n, rtt_i;
+    int   rtt_p_us;          /* rtt_pct percentile of rtt_win, -1 = none */
+    int   score;             /* last decide() ranking value */
+
+    /* score trend: least squares over the last trend_n samples */
+    long  tr_t[TREND_MAX];   /* ms, monotonic */
+    float tr_v[TREND_MAX];
+    int   tr_n, tr_i;
+    double slope;            /* score units per second */
+    long  cross_ms;          /* predicted time to floor_db, -1 = not heading there */
 };
 struct cfg {
     struct gcfg g;
@@ -80,6 +160,12 @@ static long ms_now(void)
     struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
     return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
+static long us_mono(void)
+{
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+static long ms_mono(void) { return us_mono() / 1000; }   /* deadlines, not timestamps */
 static void sig_hdl(int s) { (void)s; g_run = 0; }
 static void trim(char *s)
 {
@@ -96,9 +182,16 @@ static int ini_load(const char *fn, struct cfg *C)
     if (!f) { perror(fn); return -1; }
 
     char sec[32] = "", ln[LN_SZ];
+    int cur = -1;                                  /* STA slot of this [staN] */
     while (fgets(ln, sizeof ln, f)) {
         trim(ln); if (!*ln) continue;
-        if (*ln == '[') { sscanf(ln, "[%31[^]]", sec); continue; }
+        if (*ln == '[') {
+            sscanf(ln, "[%31[^]]", sec);
+            cur = !strncmp(sec, "sta", 3) && C->nsta < MAX_STA ? C->nsta : -1;
+            if (cur >= 0)                          /* drop an incomplete previous one */
+                C->s[cur].ip[0] = C->s[cur].rssi_key[0] = C->s[cur].mac[0] = 0;
+            continue;
+        }
 
         char *eq = strchr(ln, '=');
         if (!eq) continue;
@@ -116,15 +209,43 @@ static int ini_load(const char *fn, struct cfg *C)
             else if (!strcmp(k, "ping_succ_min"))      C->g.ping_succ_min = atoi(v);
             else if (!strcmp(k, "master_iface"))       strncpy(C->g.master_if, v, 31);
             else if (!strcmp(k, "sta_poll_file"))      strncpy(C->g.sta_poll_file, v, PATH_MAX - 1);
+            else if (!strcmp(k, "sta_watch"))          C->g.sta_watch = atoi(v);
+            else if (!strcmp(k, "sta_listen"))         strncpy(C->g.sta_listen, v, PATH_MAX - 1);
             else if (!strcmp(k, "switch_cmd"))         strncpy(C->g.switch_cmd, v, PATH_MAX - 1);
+            else if (!strcmp(k, "route_backend"))      strncpy(C->g.route_backend, v, 15);
+            else if (!strcmp(k, "transition_ms"))      C->g.transition_ms = atoi(v);
+            else if (!strcmp(k, "transition_cmd"))     strncpy(C->g.transition_cmd, v, PATH_MAX - 1);
+
+        } else if (!strcmp(sec, "ha")) {
+            if      (!strcmp(k, "node_id"))            C->g.ha_node = atoi(v);
+            else if (!strcmp(k, "priority"))           C->g.ha_prio = atoi(v);
+            else if (!strcmp(k, "heartbeat_ms"))       C->g.ha_hb_ms = atoi(v);
+            else if (!strcmp(k, "dead_ms"))            C->g.ha_dead_ms = atoi(v);
+            else if (!strcmp(k, "preempt"))            C->g.ha_preempt = atoi(v);
+            else if (!strcmp(k, "bind"))               strncpy(C->g.ha_bind, v, 63);
+            else if (!strcmp(k, "peer"))               strncpy(C->g.ha_peer, v, 63);
+
+        } else if (!strcmp(sec, "score")) {
+            if      (!strcmp(k, "model"))              strncpy(C->g.score_model, v, 15);
+            else if (!strcmp(k, "ewma_alpha"))         C->g.ewma_alpha = atof(v);
+            else if (!strcmp(k, "w_rssi"))             C->g.w_rssi  = atof(v);
+            else if (!strcmp(k, "w_retry"))            C->g.w_retry = atof(v);
+            else if (!strcmp(k, "w_rtt"))              C->g.w_rtt   = atof(v);
+            else if (!strcmp(k, "w_loss"))             C->g.w_loss  = atof(v);
+            else if (!strcmp(k, "rtt_percentile"))     C->g.rtt_pct = atoi(v);
+
+        } else if (!strcmp(sec, "predict")) {
+            if      (!strcmp(k, "horizon_ms"))         C->g.horizon_ms = atoi(v);
+            else if (!strcmp(k, "trend_samples"))      C->g.trend_n = atoi(v);
 
         } else if (!strncmp(sec, "sta", 3)) {
-            int i = C->nsta; if (i >= MAX_STA) continue;
+            int i = cur; if (i < 0) continue;
 
             if      (!strcmp(k, "ip"))        strncpy(C->s[i].ip, v, 63);
             else if (!strcmp(k, "rssi_key"))  strncpy(C->s[i].rssi_key, v, 31);
+            else if (!strcmp(k, "mac"))       strncpy(C->s[i].mac, v, 17);
 
-            if (*C->s[i].ip && *C->s[i].rssi_key) C->nsta = i + 1;
+            if (*C->s[i].ip && *C->s[i].rssi_key && C->nsta == i) C->nsta = i + 1;
         }
     }
     fclose(f);
@@ -133,6 +254,57 @@ static int ini_load(const char *fn, struct cfg *C)
 }
 
 /* ───────────────── RSSI polling from external INI file ──────────────── */
+static unsigned g_rssi_done;               /* samples parsed, polled by main() */
+
+/* one sample in sta_monitor's key=value format, from the file or a datagram */
+static void rssi_parse(struct cfg *C, char *buf)
+{
+    /* reset per-sample defaults */
+    for (int i = 0; i < C->nsta; i++) {
+        C->s[i].rssi  = -10000;
+        C->s[i].retry = -1;
+    }
+    C->txpwr = C->cck_fail = C->ofdm_fail = C->fa = -1;
+
+    /* key=value lines; non-numeric values (staX_mcs=…) are skipped */
+    for (char *ln = buf, *nl; ln && *ln; ln = nl) {
+        nl = strchr(ln, '\n'); if (nl) *nl++ = 0;
+        char *eq = strchr(ln, '='), *end;
+        if (!eq) continue;
+        *eq = 0;
+        int val = (int)strtol(eq + 1, &end, 10);
+        if (end == eq + 1) continue;
+        const char *key = ln;
+
+        /* staX_rssi / staX_retry */
+        if (!strncmp(key, "sta", 3) && (key[4] == '_' || key[5] == '_')) {
+            int id = atoi(key + 3);              /* sta0_rssi → 0 */
+            if (id >= 0 && id < C->nsta) {
+                if (strstr(key, "_rssi"))  C->s[id].rssi  = val;
+                if (strstr(key, "_retry")) C->s[id].retry = val;
+            }
+        }
+        /* module-wide counters */
+        else if (!strcmp(key, "txpwr"))                    C->txpwr     = val;
+        else if (!strcmp(key, "rxinfo_cnt_cck_fail"))      C->cck_fail  = val;
+        else if (!strcmp(key, "rxinfo_cnt_ofdm_fail"))     C->ofdm_fail = val;
+        else if (!strcmp(key, "rxinfo_false_alarm"))       C->fa        = val;
+    }
+
+    g_rssi_done++;
+
+    /* scoring windows; a STA missing from the sample starts over */
+    double a = C->g.ewma_alpha;
+    for (int i = 0; i < C->nsta; i++) {
+        struct sta *s = &C->s[i];
+        if (s->rssi <= -1000)      s->rssi_s = -10000;
+        else if (s->rssi_s <= -1000) s->rssi_s = s->rssi;
+        else                       s->rssi_s += a * (s->rssi - s->rssi_s);
+        if (s->retry < 0)          s->retry_s = -1;
+        else if (s->retry_s < 0)   s->retry_s = s->retry;
+        else                       s->retry_s += a * (s->retry - s->retry_s);
+    }
+}
 static void rssi_poll_from_file(struct cfg *C)
 {
     if (!*C->g.sta_poll_file) return;
@@ -145,41 +317,104 @@ static void rssi_poll_from_file(struct cfg *C)
     close(fd);
     if (n <= 0) return;
     buf[n] = '\0';
+    rssi_parse(C, buf);
+}
 
-    /* reset per-poll defaults */
-    for (int i = 0; i < C->nsta; i++) {
-        C->s[i].rssi  = -10000;
-        C->s[i].retry = -1;
-    }
-    C->txpwr = C->cck_fail = C->ofdm_fail = C->fa = -1;
+/* ───────────────────────── RSSI events ───────────────────────────────────
+ * Instead of re-reading sta_poll_file every poll: inotify on its directory
+ * (sta_monitor renames the file into place) and/or sta_listen, a datagram
+ * socket sta_monitor pushes each sample to (push_to=).  Either one feeds
+ * the sample straight to the scorer, and a bad active link is acted on
+ * in the same loop iteration.
+ */
+static int  g_ino = -1, g_stasock = -1;
+static char g_sta_base[NAME_MAX + 1];
 
-    /* parse key=value lines */
-    char *ln = strtok(buf, "\n");
-    while (ln) {
-        trim(ln);
-
-        char key[64]; int val;
-        if (sscanf(ln, "%63[^=]=%d", key, &val) == 1 + 1) {
-
-            /* staX_rssi / staX_retry */
-            if (!strncmp(key, "sta", 3) && (key[4] == '_' || key[5] == '_')) {
-                int id = atoi(key + 3);          /* sta0_rssi → 0 */
-                if (id >= 0 && id < C->nsta) {
-                    if (strstr(key, "_rssi"))  C->s[id].rssi  = val;
-                    if (strstr(key, "_retry")) C->s[id].retry = val;
-                }
-            }
-            /* module-wide counters */
-            else if (!strcmp(key, "txpwr"))                    C->txpwr     = val;
-            else if (!strcmp(key, "rxinfo_cnt_cck_fail"))      C->cck_fail  = val;
-            else if (!strcmp(key, "rxinfo_cnt_ofdm_fail"))     C->ofdm_fail = val;
-            else if (!strcmp(key, "rxinfo_false_alarm"))       C->fa        = val;
+static int sta_listen_open(const char *spec)
+{
+    if (!strncmp(spec, "unix:", 5)) {
+        struct sockaddr_un ua = { .sun_family = AF_UNIX };
+        size_t pl = strlen(spec + 5);
+        if (pl >= sizeof ua.sun_path) { errno = ENAMETOOLONG; return -1; }
+        memcpy(ua.sun_path, spec + 5, pl);
+        int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        unlink(ua.sun_path);
+        if (bind(fd, (struct sockaddr *)&ua, sizeof ua) < 0) { close(fd); return -1; }
+        return fd;
+    }
+    if (!strncmp(spec, "udp:", 4)) {
+        const char *hp = spec + 4, *colon = strrchr(hp, ':');
+        if (!colon) { errno = EINVAL; return -1; }
+        char ip[64]; size_t il = colon - hp;
+        if (il >= sizeof ip) { errno = EINVAL; return -1; }
+        memcpy(ip, hp, il); ip[il] = 0;
+        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(atoi(colon + 1)) };
+        if (!il || !inet_aton(ip, &sa.sin_addr)) sa.sin_addr.s_addr = INADDR_ANY;
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0) { close(fd); return -1; }
+        return fd;
+    }
+    errno = EINVAL; return -1;
+}
+static void sta_events_open(struct cfg *C)
+{
+    if (C->g.sta_watch && *C->g.sta_poll_file) {
+        char dir[PATH_MAX], base[PATH_MAX];
+        strcpy(dir, C->g.sta_poll_file); strcpy(base, C->g.sta_poll_file);
+        strncpy(g_sta_base, basename(base), NAME_MAX);
+        g_ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (g_ino >= 0 && inotify_add_watch(g_ino, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            fprintf(stderr, "[rssi] inotify %s: %s, polling\n", C->g.sta_poll_file, strerror(errno));
+            close(g_ino); g_ino = -1;
         }
-        ln = strtok(NULL, "\n");
     }
+    if (*C->g.sta_listen) {
+        g_stasock = sta_listen_open(C->g.sta_listen);
+        if (g_stasock < 0) fprintf(stderr, "[rssi] sta_listen %s: %s\n", C->g.sta_listen, strerror(errno));
+    }
+}
+/* drain inotify; 1 if the poll file was (re)written */
+static int sta_watch_fired(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int hit = 0; ssize_t rd;
+    while ((rd = read(g_ino, buf, sizeof buf)) > 0)
+        for (char *p = buf; p < buf + rd; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, g_sta_base)) hit = 1;
+            p += sizeof *ev + ev->len;
+        }
+    return hit;
+}
+/* drain the socket; only the newest sample is scored */
+static int sta_sock_read(struct cfg *C)
+{
+    char buf[4096], last[4096]; ssize_t rd, n = -1;
+    while ((rd = recv(g_stasock, buf, sizeof buf - 1, 0)) > 0) {
+        memcpy(last, buf, rd); n = rd;
+    }
+    if (n <= 0) return 0;
+    last[n] = 0;
+    rssi_parse(C, last);
+    return 1;
 }
 
-/* ───────────────────────── tiny raw-socket ICMP ping ─────────────────── */
+/* ───────────────────────── ICMP prober ───────────────────────────────────
+ * One persistent non-blocking socket for all STAs.  Every poll sends an echo
+ * to each STA that has none outstanding; replies are matched by source
+ * address + sequence from the main select() loop, and an echo unanswered
+ * after ping_timeout_ms counts as a failure.  Detection time is therefore
+ * the timeout, whatever the number of STAs.
+ * Unprivileged SOCK_DGRAM ICMP is tried first (the kernel owns the id and
+ * strips the IP header), raw ICMP otherwise.
+ */
+static int      g_icmp = -1, g_icmp_raw = 0;
+static uint16_t g_icmp_id, g_icmp_seq;
+static unsigned g_ping_done;                /* results so far, polled by main() */
+static int      g_reprobe;                  /* active link lost an echo */
+
 static uint16_t csum16(const void *v, size_t len)
 {
     const uint16_t *p = v; uint32_t sum = 0;
@@ -189,83 +424,353 @@ static uint16_t csum16(const void *v, size_t len)
     sum += (sum >> 16);
     return (uint16_t)~sum;
 }
-static int ping_alive(const char *ip, int timeout_ms)
-{
-    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-    if (sock < 0) return 0;
-
-    struct timeval tv = { timeout_ms / 1000,
-                          (timeout_ms % 1000) * 1000 };
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
-
-    struct sockaddr_in dst = {0};
-    dst.sin_family = AF_INET; inet_aton(ip, &dst.sin_addr);
-
-    uint8_t pkt[64] = {0};
-    struct icmphdr *h = (struct icmphdr *)pkt;
-    h->type = ICMP_ECHO; h->code = 0;
-    h->un.echo.id = htons(getpid() & 0xffff);
-    h->un.echo.sequence = htons(1);
-    h->checksum = csum16(pkt, sizeof pkt);
-
-    int ok = sendto(sock, pkt, sizeof pkt, 0,
-                    (struct sockaddr *)&dst, sizeof dst) >= 0;
-
-    if (ok) {
-        uint8_t buf[128];
-        struct sockaddr_in sfrom; socklen_t sl = sizeof sfrom;
-        ok = 0;
-        if (recvfrom(sock, buf, sizeof buf, 0,
-                     (struct sockaddr *)&sfrom, &sl) >= (ssize_t)sizeof(struct ip))
-        {
-            struct icmphdr *rh = (struct icmphdr *)(buf + sizeof(struct ip));
-            if (rh->type == ICMP_ECHOREPLY &&
-                rh->un.echo.id == h->un.echo.id &&
-                sfrom.sin_addr.s_addr == dst.sin_addr.s_addr)
-                ok = 1;
+static int icmp_open(struct cfg *C)
+{
+    for (int i = 0; i < C->nsta; i++) {
+        if (!inet_aton(C->s[i].ip, &C->s[i].addr))
+            fprintf(stderr, "[ping] bad ip %s\n", C->s[i].ip);
+        C->s[i].rtt_us = C->s[i].srtt_us = C->s[i].rtt_p_us = -1;
+    }
+    g_icmp_raw = 0;
+    g_icmp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (g_icmp < 0) {
+        g_icmp_raw = 1;
+        g_icmp = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    }
+    if (g_icmp < 0) { perror("icmp socket"); return -1; }
+    g_icmp_id = htons(getpid() & 0xffff);
+    if (g_verbose) printf("[ping] %s ICMP socket\n", g_icmp_raw ? "raw" : "datagram");
+    return 0;
+}
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+static void ping_result(struct cfg *C, struct sta *s, int alive)
+{
+    s->inflight = 0;
+    s->loss_s += C->g.ewma_alpha * ((alive ? 0.0 : 1.0) - s->loss_s);
+    if (alive) {
+        s->rtt_win[s->rtt_i] = s->rtt_us;
+        s->rtt_i = (s->rtt_i + 1) % RTT_WIN;
+        if (s->rtt_n < RTT_WIN) s->rtt_n++;
+        int v[RTT_WIN]; memcpy(v, s->rtt_win, sizeof v);
+        qsort(v, s->rtt_n, sizeof v[0], cmp_int);
+        s->rtt_p_us = v[(s->rtt_n - 1) * C->g.rtt_pct / 100];
+    }
+    if (alive) { s->succ++; s->fail = 0; }
+    else       { s->fail++; s->succ = 0; }
+    g_ping_done++;
+    if (!alive && !strcmp(s->ip, C->via)) g_reprobe = 1;
+
+    if (s->fail > 255) s->fail = 255;
+    if (s->succ > 255) s->succ = 255;
+
+    if (g_verbose) {
+        int er = EFFECTIVE_RSSI(*s, *C);
+        printf("[ping] %s %s  rssi=%d  rtt=%.1fms  fail=%d succ=%d\n",
+               s->ip, alive ? "OK" : "timeout",
+               er, alive ? s->rtt_us / 1000.0 : -1.0, s->fail, s->succ);
+    }
+}
+/* fire one echo at every idle STA */
+static void ping_send(struct cfg *C)
+{
+    if (g_icmp < 0) return;
+    for (int i = 0; i < C->nsta; i++) {
+        struct sta *s = &C->s[i];
+        if (s->inflight || !s->addr.s_addr) continue;
+
+        uint8_t pkt[64] = {0};
+        struct icmphdr *h = (struct icmphdr *)pkt;
+        h->type = ICMP_ECHO; h->code = 0;
+        h->un.echo.id = g_icmp_id;
+        h->un.echo.sequence = htons(++g_icmp_seq);
+        h->checksum = csum16(pkt, sizeof pkt);
+
+        struct sockaddr_in dst = {0};
+        dst.sin_family = AF_INET; dst.sin_addr = s->addr;
+        s->seq = g_icmp_seq; s->sent_us = us_mono();
+        if (sendto(g_icmp, pkt, sizeof pkt, 0, (struct sockaddr *)&dst, sizeof dst) < 0)
+            ping_result(C, s, 0);            /* unreachable now: no need to wait */
+        else
+            s->inflight = 1;
+    }
+}
+/* drain replies; the socket is non-blocking */
+static void ping_recv(struct cfg *C)
+{
+    uint8_t buf[256];
+    struct sockaddr_in from; socklen_t fl = sizeof from;
+    ssize_t n;
+    while ((n = recvfrom(g_icmp, buf, sizeof buf, 0, (struct sockaddr *)&from, &fl)) > 0) {
+        fl = sizeof from;
+        size_t off = 0;
+        if (g_icmp_raw) {
+            off = (size_t)(((struct ip *)buf)->ip_hl) * 4;
+            if ((size_t)n < sizeof(struct ip) || (size_t)n < off + sizeof(struct icmphdr)) continue;
+        } else if ((size_t)n < sizeof(struct icmphdr)) continue;
+
+        struct icmphdr *rh = (struct icmphdr *)(buf + off);
+        if (rh->type != ICMP_ECHOREPLY) continue;
+        if (g_icmp_raw && rh->un.echo.id != g_icmp_id) continue;
+        uint16_t seq = ntohs(rh->un.echo.sequence);
+
+        for (int i = 0; i < C->nsta; i++) {
+            struct sta *s = &C->s[i];
+            if (!s->inflight || s->seq != seq || s->addr.s_addr != from.sin_addr.s_addr) continue;
+            s->rtt_us  = (int)(us_mono() - s->sent_us);
+            s->srtt_us = s->srtt_us < 0 ? s->rtt_us : s->srtt_us + (s->rtt_us - s->srtt_us) / 8;
+            ping_result(C, s, 1);
+            break;
         }
     }
-    close(sock);
-    return ok;
 }
-static void ping_poll(struct cfg *C)
+/* fail echoes older than the timeout; returns ms until the next expiry (or -1) */
+static long ping_expire(struct cfg *C)
 {
-    if (C->nsta == 0) return;                /* nothing to do */
-
-    long t_start = ms_now();
-
+    long now = us_mono(), to_us = C->g.ping_to_ms * 1000L, next = -1;
     for (int i = 0; i < C->nsta; i++) {
-        /* hard cap: never spend more than 1 s inside ping_poll() */
-        if (ms_now() - t_start > 1000) break;
-
         struct sta *s = &C->s[i];
-        int alive = ping_alive(s->ip, C->g.ping_to_ms);
+        if (!s->inflight) continue;
+        long left = s->sent_us + to_us - now;
+        if (left <= 0) { ping_result(C, s, 0); continue; }
+        left = (left + 999) / 1000;
+        if (next < 0 || left < next) next = left;
+    }
+    return next;
+}
 
-        if (alive) { s->succ++; s->fail = 0; }
-        else       { s->fail++; s->succ = 0; }
+/* ───────────────────────── rtnetlink ───────────────────────────────────
+ * g_rtnl carries requests (route replace/delete, neighbour update, route
+ * dump), each one ACKed.  g_rtmon listens on RTNLGRP_IPV4_ROUTE from the
+ * select loop: any default-route change marks the route dirty, and only
+ * then is it verified, instead of `ip route show` on every poll.
+ */
+static int      g_rtnl = -1, g_rtmon = -1;
+static uint32_t g_rtnl_seq;
+static int      g_route_dirty = 1;
+static long     g_switch_us = -1;          /* last master_route() duration */
+
+struct nlreq {
+    struct nlmsghdr n;
+    union { struct rtmsg r; struct ndmsg nd; };
+    char   attr[128];
+};
 
-        if (s->fail > 255) s->fail = 255;
-        if (s->succ > 255) s->succ = 255;
+static int rtnl_open(void)
+{
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+    g_rtnl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (g_rtnl < 0 || bind(g_rtnl, (struct sockaddr *)&sa, sizeof sa) < 0) {
+        perror("rtnetlink");
+        if (g_rtnl >= 0) close(g_rtnl);
+        g_rtnl = -1; return -1;
+    }
+    struct timeval tv = { 1, 0 };
+    setsockopt(g_rtnl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    int grp = RTNLGRP_IPV4_ROUTE;
+    g_rtmon = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (g_rtmon < 0 || bind(g_rtmon, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+        setsockopt(g_rtmon, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &grp, sizeof grp) < 0) {
+        perror("rtnetlink monitor");
+        if (g_rtmon >= 0) close(g_rtmon);
+        g_rtmon = -1;
+    }
+    return 0;
+}
+static void nl_add(struct nlmsghdr *n, int type, const void *d, int len)
+{
+    struct rtattr *a = (struct rtattr *)((char *)n + NLMSG_ALIGN(n->nlmsg_len));
+    a->rta_type = type; a->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(a), d, len);
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(a->rta_len);
+}
+/* send one request and wait for its ACK: 0 or -errno */
+static int rtnl_talk(struct nlmsghdr *n)
+{
+    n->nlmsg_seq = ++g_rtnl_seq;
+    n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    if (send(g_rtnl, n, n->nlmsg_len, 0) < 0) return -errno;
+    char buf[4096] __attribute__((aligned(4)));
+    for (;;) {
+        ssize_t r = recv(g_rtnl, buf, sizeof buf, 0);
+        if (r < 0) { if (errno == EINTR) continue; return -errno; }
+        for (struct nlmsghdr *h = (void *)buf; NLMSG_OK(h, (size_t)r); h = NLMSG_NEXT(h, r))
+            if (h->nlmsg_seq == n->nlmsg_seq && h->nlmsg_type == NLMSG_ERROR)
+                return ((struct nlmsgerr *)NLMSG_DATA(h))->error;
+    }
+}
+static int parse_mac(const char *s, uint8_t m[6])
+{
+    return sscanf(s, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                  &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) == 6;
+}
+static const struct sta *sta_by_ip(const struct cfg *C, const char *ip)
+{
+    for (int i = 0; i < C->nsta; i++)
+        if (!strcmp(C->s[i].ip, ip)) return &C->s[i];
+    return NULL;
+}
+/* the new gateway only: pinned to its configured MAC, else re-resolved */
+static int neigh_update_nl(struct cfg *C, const char *gw, int ifx)
+{
+    const struct sta *s = sta_by_ip(C, gw);
+    struct in_addr a; uint8_t mac[6];
+    if (!inet_aton(gw, &a)) return -EINVAL;
+    int pin = s && *s->mac && parse_mac(s->mac, mac);
+
+    struct nlreq q; memset(&q, 0, sizeof q);
+    q.n.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ndmsg));
+    q.n.nlmsg_type  = pin ? RTM_NEWNEIGH : RTM_DELNEIGH;
+    q.n.nlmsg_flags = pin ? NLM_F_CREATE | NLM_F_REPLACE : 0;
+    q.nd.ndm_family = AF_INET; q.nd.ndm_ifindex = ifx;
+    q.nd.ndm_state  = pin ? NUD_REACHABLE : 0;
+    nl_add(&q.n, NDA_DST, &a, 4);
+    if (pin) nl_add(&q.n, NDA_LLADDR, mac, 6);
+    int rc = rtnl_talk(&q.n);
+    return rc == -ENOENT ? 0 : rc;           /* nothing cached yet: fine */
+}
+static int master_route_nl(struct cfg *C, const char *gw, int neigh)
+{
+    int ifx = if_nametoindex(C->g.master_if);
+    if (!ifx) return -ENODEV;
+
+    struct nlreq q; memset(&q, 0, sizeof q);
+    q.n.nlmsg_len  = NLMSG_LENGTH(sizeof(struct rtmsg));
+    q.r.rtm_family = AF_INET; q.r.rtm_table = RT_TABLE_MAIN;
+    if (*gw) {
+        struct in_addr a; uint32_t metric = 0;
+        if (!inet_aton(gw, &a)) return -EINVAL;
+        q.n.nlmsg_type  = RTM_NEWROUTE;
+        q.n.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+        q.r.rtm_protocol = RTPROT_BOOT; q.r.rtm_scope = RT_SCOPE_UNIVERSE;
+        q.r.rtm_type = RTN_UNICAST;
+        nl_add(&q.n, RTA_GATEWAY, &a, 4);
+        nl_add(&q.n, RTA_OIF, &ifx, 4);
+        nl_add(&q.n, RTA_PRIORITY, &metric, 4);
+    } else {
+        q.n.nlmsg_type = RTM_DELROUTE;
+        q.r.rtm_scope = RT_SCOPE_NOWHERE;
+        nl_add(&q.n, RTA_OIF, &ifx, 4);
+    }
+    int rc = rtnl_talk(&q.n);
+    if (rc == 0 && *gw && neigh) rc = neigh_update_nl(C, gw, ifx);
+    else if (rc == -ESRCH && !*gw) rc = 0;   /* no default route: done */
+    return rc;
+}
+/* one default route over two nexthops: a (old) and b (new) */
+static int dual_route_nl(struct cfg *C, const char *a, const char *b)
+{
+    int ifx = if_nametoindex(C->g.master_if);
+    if (!ifx) return -ENODEV;
+
+    char mp[64] __attribute__((aligned(4))); int off = 0;
+    const char *gw[2] = { a, b };
+    for (int i = 0; i < 2; i++) {
+        struct rtnexthop *nh = (struct rtnexthop *)(mp + off);
+        struct rtattr *at = RTNH_DATA(nh);
+        struct in_addr ad;
+        if (!inet_aton(gw[i], &ad)) return -EINVAL;
+        nh->rtnh_len = sizeof *nh + RTA_LENGTH(4);
+        nh->rtnh_flags = 0; nh->rtnh_hops = 0; nh->rtnh_ifindex = ifx;
+        at->rta_type = RTA_GATEWAY; at->rta_len = RTA_LENGTH(4);
+        memcpy(RTA_DATA(at), &ad, 4);
+        off += RTNH_ALIGN(nh->rtnh_len);
+    }
 
-        if (g_verbose) {
-            int er = EFFECTIVE_RSSI(*s, *C);
-            printf("[ping] %s %s  rssi=%d  fail=%d succ=%d\n",
-                   s->ip, alive ? "OK" : "timeout",
-                   er, s->fail, s->succ);
+    struct nlreq q; memset(&q, 0, sizeof q);
+    uint32_t metric = 0;
+    q.n.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    q.n.nlmsg_type  = RTM_NEWROUTE;
+    q.n.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+    q.r.rtm_family  = AF_INET; q.r.rtm_table = RT_TABLE_MAIN;
+    q.r.rtm_protocol = RTPROT_BOOT; q.r.rtm_scope = RT_SCOPE_UNIVERSE;
+    q.r.rtm_type    = RTN_UNICAST;
+    nl_add(&q.n, RTA_PRIORITY, &metric, 4);
+    nl_add(&q.n, RTA_MULTIPATH, mp, off);
+    int rc = rtnl_talk(&q.n);
+    return rc ? rc : neigh_update_nl(C, b, ifx);
+}
+/* 1 if the main table has a default route via gw on master_if */
+static int route_is_ok_nl(struct cfg *C, const char *gw)
+{
+    int ifx = if_nametoindex(C->g.master_if);
+    struct in_addr a;
+    if (!ifx || !inet_aton(gw, &a)) return 0;
+
+    struct nlreq q; memset(&q, 0, sizeof q);
+    q.n.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+    q.n.nlmsg_type  = RTM_GETROUTE;
+    q.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    q.n.nlmsg_seq   = ++g_rtnl_seq;
+    q.r.rtm_family  = AF_INET;
+    if (send(g_rtnl, &q, q.n.nlmsg_len, 0) < 0) return 0;
+
+    char buf[16384] __attribute__((aligned(4)));
+    int ok = 0;
+    for (;;) {
+        ssize_t r = recv(g_rtnl, buf, sizeof buf, 0);
+        if (r < 0) { if (errno == EINTR) continue; return ok; }
+        for (struct nlmsghdr *h = (void *)buf; NLMSG_OK(h, (size_t)r); h = NLMSG_NEXT(h, r)) {
+            if (h->nlmsg_seq != q.n.nlmsg_seq) continue;
+            if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR) return ok;
+            if (h->nlmsg_type != RTM_NEWROUTE) continue;
+            struct rtmsg *rt = NLMSG_DATA(h);
+            if (rt->rtm_dst_len || rt->rtm_table != RT_TABLE_MAIN) continue;
+            int len = RTM_PAYLOAD(h), oif = 0; uint32_t via = 0;
+            for (struct rtattr *at = RTM_RTA(rt); RTA_OK(at, len); at = RTA_NEXT(at, len)) {
+                if (at->rta_type == RTA_OIF)     memcpy(&oif, RTA_DATA(at), 4);
+                if (at->rta_type == RTA_GATEWAY) memcpy(&via, RTA_DATA(at), 4);
+            }
+            if (oif == ifx && via == a.s_addr) ok = 1;
+        }
+    }
+}
+/* drain route notifications; returns 1 if a default route changed */
+static int rtmon_read(void)
+{
+    char buf[8192] __attribute__((aligned(4)));
+    int hit = 0;
+    for (;;) {
+        ssize_t r = recv(g_rtmon, buf, sizeof buf, 0);
+        if (r < 0) {
+            if (errno == ENOBUFS) { hit = 1; continue; }   /* overrun: assume the worst */
+            break;
+        }
+        for (struct nlmsghdr *h = (void *)buf; NLMSG_OK(h, (size_t)r); h = NLMSG_NEXT(h, r)) {
+            if (h->nlmsg_type != RTM_NEWROUTE && h->nlmsg_type != RTM_DELROUTE) continue;
+            struct rtmsg *rt = NLMSG_DATA(h);
+            if (rt->rtm_family == AF_INET && rt->rtm_dst_len == 0) hit = 1;
         }
     }
+    if (hit) g_route_dirty = 1;
+    return hit;
 }
 
 /* ───────── replace default route on the master ───────── */
-static void master_route(struct cfg *C, const char *gw)
+static void master_route_sh(struct cfg *C, const char *gw, int neigh)
 {
     char cmd[256];
 
-    if (*gw) {
+    if (*gw && !neigh) {
         snprintf(cmd, sizeof cmd,
-                 "ip route replace default via %s dev %s metric 0 && "
-                 "ip neigh flush all",
+                 "ip route replace default via %s dev %s metric 0",
                  gw, C->g.master_if);
+    } else if (*gw) {
+        const struct sta *s = sta_by_ip(C, gw);
+        if (s && *s->mac)
+            snprintf(cmd, sizeof cmd,
+                     "ip route replace default via %s dev %s metric 0 && "
+                     "ip neigh replace %s lladdr %s dev %s nud reachable",
+                     gw, C->g.master_if, gw, s->mac, C->g.master_if);
+        else
+            snprintf(cmd, sizeof cmd,
+                     "ip route replace default via %s dev %s metric 0 && "
+                     "{ ip neigh del %s dev %s 2>/dev/null; true; }",
+                     gw, C->g.master_if, gw, C->g.master_if);
     } else {
         snprintf(cmd, sizeof cmd,
                  "ip route del default dev %s 2>/dev/null",
@@ -273,7 +778,25 @@ static void master_route(struct cfg *C, const char *gw)
     }
     system(cmd);
 }
-static int route_is_ok(struct cfg *C, const char *gw)
+static void dual_route_sh(struct cfg *C, const char *a, const char *b)
+{
+    char cmd[384];
+    const struct sta *s = sta_by_ip(C, b);
+    int n = snprintf(cmd, sizeof cmd,
+                     "ip route replace default metric 0 "
+                     "nexthop via %s dev %s nexthop via %s dev %s && ",
+                     a, C->g.master_if, b, C->g.master_if);
+    if (s && *s->mac)
+        snprintf(cmd + n, sizeof cmd - n,
+                 "ip neigh replace %s lladdr %s dev %s nud reachable",
+                 b, s->mac, C->g.master_if);
+    else
+        snprintf(cmd + n, sizeof cmd - n,
+                 "{ ip neigh del %s dev %s 2>/dev/null; true; }",
+                 b, C->g.master_if);
+    system(cmd);
+}
+static int route_is_ok_sh(struct cfg *C, const char *gw)
 {
     FILE *p = popen("ip route show default", "r");
     if (!p) return 0;
@@ -282,6 +805,33 @@ static int route_is_ok(struct cfg *C, const char *gw)
         if (strstr(l, gw) && strstr(l, C->g.master_if)) { ok = 1; break; }
     pclose(p); return ok;
 }
+static int use_nl(struct cfg *C)
+{
+    return g_rtnl >= 0 && strcmp(C->g.route_backend, "shell");
+}
+/* neigh = 0 leaves gw's neighbour entry alone (already refreshed) */
+static void master_route(struct cfg *C, const char *gw, int neigh)
+{
+    long t0 = us_mono();
+    int rc = use_nl(C) ? master_route_nl(C, gw, neigh) : 1;
+    if (rc < 0) fprintf(stderr, "[route] netlink: %s, using ip\n", strerror(-rc));
+    if (rc) master_route_sh(C, gw, neigh);
+    g_switch_us = us_mono() - t0;
+    if (g_verbose) printf("[route] default via %s: %ld us\n", *gw ? gw : "-", g_switch_us);
+}
+static void dual_route(struct cfg *C, const char *a, const char *b)
+{
+    long t0 = us_mono();
+    int rc = use_nl(C) ? dual_route_nl(C, a, b) : 1;
+    if (rc < 0) fprintf(stderr, "[route] netlink: %s, using ip\n", strerror(-rc));
+    if (rc) dual_route_sh(C, a, b);
+    g_switch_us = us_mono() - t0;
+    if (g_verbose) printf("[route] default via %s + %s: %ld us\n", a, b, g_switch_us);
+}
+static int route_is_ok(struct cfg *C, const char *gw)
+{
+    return use_nl(C) ? route_is_ok_nl(C, gw) : route_is_ok_sh(C, gw);
+}
 
 
 /* run the user-defined hook asynchronously; returns immediately */
@@ -299,34 +849,226 @@ static void run_switch_cmd(struct cfg *C, const char *ip)
     /* parent ignores exit status (detached) */
 }
 
+/* ───────────────────────── make-before-break ─────────────────────────────
+ * With transition_ms > 0 and a transition_cmd, a switch away from a link
+ * that still answers is done in two steps.  First the default route
+ * becomes multipath over the old and the new gateway (new neighbour entry
+ * refreshed) and the hook runs as `CMD begin OLD NEW`, e.g. to put
+ * rtp_split into "both" mode (SIGTERM); after transition_ms the route is
+ * committed to the new gateway alone and `CMD commit OLD NEW` puts the
+ * sender back (SIGUSR1/SIGUSR2).  Multipath hashes each flow onto one
+ * nexthop and duplicates nothing, so without the hook the window would
+ * only keep the stream where it was: the switch is then one step.  A dead
+ * old link is left immediately.
+ */
+static char g_trans_from[64];
+static long g_trans_end;                   /* ms_mono() deadline, 0 = none */
+static unsigned long g_switches;           /* switch_to() calls that moved via */
+static unsigned long g_predicted;          /* of those, ahead of a predicted crossing */
+
+static void run_transition_cmd(struct cfg *C, const char *ph, const char *a, const char *b)
+{
+    if (!*C->g.transition_cmd) return;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c",
+              "exec \"$0\" \"$1\" \"$2\" \"$3\"",
+              C->g.transition_cmd, ph, a, b, (char *)NULL);
+        _exit(127);
+    }
+}
+static int sta_alive(struct cfg *C, const char *ip)
+{
+    const struct sta *s = sta_by_ip(C, ip);
+    return s && s->fail < C->g.ping_fail_max;
+}
+/* move the default route (and C->via) to gw */
+static void switch_to(struct cfg *C, const char *gw)
+{
+    if (strcmp(C->via, gw)) g_switches++;
+    if (g_trans_end) {                         /* close the open window first */
+        g_trans_end = 0;
+        run_transition_cmd(C, "commit", g_trans_from, C->via);
+    }
+    if (C->g.transition_ms <= 0 || !*C->g.transition_cmd || !*C->via || !strcmp(C->via, gw) ||
+        !sta_alive(C, C->via)) {
+        g_trans_end = 0;
+        strcpy(C->via, gw);
+        master_route(C, gw, 1);
+        run_switch_cmd(C, gw);
+        return;
+    }
+    strcpy(g_trans_from, C->via); strcpy(C->via, gw);
+    dual_route(C, g_trans_from, gw);
+    run_transition_cmd(C, "begin", g_trans_from, gw);
+    g_trans_end = ms_mono() + C->g.transition_ms;
+    if (g_verbose) printf("[switch] %s -> %s: overlap %d ms\n", g_trans_from, gw, C->g.transition_ms);
+}
+/* end the window: the new gateway alone, and the hook told so */
+static void transition_commit(struct cfg *C)
+{
+    if (!g_trans_end) return;
+    g_trans_end = 0;
+    master_route(C, C->via, 0);
+    run_switch_cmd(C, C->via);
+    run_transition_cmd(C, "commit", g_trans_from, C->via);
+}
+/* commit once the window is over or the old link died; returns ms left (-1 = none) */
+static long transition_poll(struct cfg *C)
+{
+    if (!g_trans_end) return -1;
+    long left = g_trans_end - ms_mono();
+    if (left > 0 && sta_alive(C, g_trans_from)) return left;
+    transition_commit(C);
+    return -1;
+}
+
 static void route_watchdog(struct cfg *C)
 {
-    if (!*C->via) return;
+    if (!*C->via || g_trans_end) return;       /* multipath during a transition */
+    if (g_role != HA_MASTER) return;
+    if (g_rtmon >= 0 && !g_route_dirty) return;   /* nothing changed since the last check */
+    g_route_dirty = 0;
     if (route_is_ok(C, C->via)) return;
     if (g_verbose) fprintf(stderr, "[route] watchdog: repairing table\n");
-    master_route(C, C->via);
+    master_route(C, C->via, 1);
     run_switch_cmd(C, C->via);
 }
 
 
 
+/* ───────────────────────── link scoring ──────────────────────────────────
+ * A scorer maps one STA to a ranking value in dB-like units, so
+ * hysteresis_db and switch_floor_db keep their meaning; -10000 = unusable.
+ *   rssi      raw RSSI (the original behaviour)
+ *   weighted  w_rssi·RSSI − w_retry·retry% − w_rtt·RTT_pNN(ms) − w_loss·loss%
+ *             over EWMA (ewma_alpha) windows; RTT is the rtt_percentile
+ *             of the last RTT_WIN replies
+ * Both declare a STA dead after ping_fail_max lost echoes.
+ */
+typedef double (*score_fn)(const struct cfg *, const struct sta *);
+
+static double score_rssi(const struct cfg *C, const struct sta *s)
+{
+    return EFFECTIVE_RSSI(*s, *C);
+}
+static double score_weighted(const struct cfg *C, const struct sta *s)
+{
+    const struct gcfg *g = &C->g;
+    if (s->fail >= g->ping_fail_max || s->rssi_s <= -1000) return -10000;
+    double sc = g->w_rssi * s->rssi_s;
+    if (s->retry_s >= 0)  sc -= g->w_retry * s->retry_s;
+    if (s->rtt_p_us >= 0) sc -= g->w_rtt * s->rtt_p_us / 1000.0;
+    sc -= g->w_loss * 100.0 * s->loss_s;
+    return sc < -9999 ? -9999 : sc;
+}
+static const struct { const char *name; score_fn fn; } scorers[] = {
+    { "rssi",     score_rssi     },
+    { "weighted", score_weighted },
+};
+static score_fn g_score = score_weighted;
+
+static void score_select(struct cfg *C)
+{
+    for (size_t i = 0; i < sizeof scorers / sizeof scorers[0]; i++)
+        if (!strcmp(C->g.score_model, scorers[i].name)) { g_score = scorers[i].fn; return; }
+    fprintf(stderr, "[score] unknown model '%s', using weighted\n", C->g.score_model);
+    strcpy(C->g.score_model, "weighted");
+    g_score = score_weighted;
+}
+static int sta_score(struct cfg *C, int i)
+{
+    double v = g_score(C, &C->s[i]);
+    return C->s[i].score = (int)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/* ───────────────────────── score trend ───────────────────────────────────
+ * Every RSSI sample appends each STA's score to a window of trend_n points;
+ * a least-squares line through it gives the slope and, when the link is
+ * heading down, the time until the fitted score reaches switch_floor_db.
+ * An unusable sample empties the window: the trend starts over.
+ */
+static void trend_push(struct cfg *C, struct sta *s, long t, double v)
+{
+    int n = C->g.trend_n;
+    s->slope = 0; s->cross_ms = -1;
+    if (v <= -1000) { s->tr_n = s->tr_i = 0; return; }
+    s->tr_t[s->tr_i] = t; s->tr_v[s->tr_i] = v;
+    s->tr_i = (s->tr_i + 1) % n;
+    if (s->tr_n < n) s->tr_n++;
+    if (s->tr_n < n) return;                   /* full window only: no early noise */
+
+    double mt = 0, mv = 0, sxy = 0, sxx = 0;
+    for (int k = 0; k < n; k++) { mt += s->tr_t[k] - t; mv += s->tr_v[k]; }
+    mt /= n; mv /= n;
+    for (int k = 0; k < n; k++) {
+        double dx = (s->tr_t[k] - t) - mt;
+        sxy += dx * (s->tr_v[k] - mv); sxx += dx * dx;
+    }
+    if (sxx <= 0) return;
+    s->slope = sxy / sxx * 1000.0;             /* per ms → per second */
+    double now_v = mv - s->slope / 1000.0 * mt;   /* fitted value at t */
+    if (now_v <= C->g.floor_db)  s->cross_ms = 0;
+    else if (s->slope < 0)       s->cross_ms = (long)((now_v - C->g.floor_db) / -s->slope * 1000.0);
+}
+static void trend_update(struct cfg *C)
+{
+    long t = us_mono() / 1000;
+    for (int i = 0; i < C->nsta; i++)
+        trend_push(C, &C->s[i], t, sta_score(C, i));
+}
+static int trend_crossing(struct cfg *C, const struct sta *s)
+{
+    return C->g.horizon_ms > 0 && s->cross_ms >= 0 && s->cross_ms <= C->g.horizon_ms;
+}
+/* a healthy link to move to before sta i crosses the floor, or -1 */
+static int predict_escape(struct cfg *C, int i)
+{
+    if (!trend_crossing(C, &C->s[i])) return -1;
+    int best = -1;
+    for (int j = 0; j < C->nsta; j++) {
+        const struct sta *o = &C->s[j];
+        if (j == i || o->score < C->g.floor_db || o->fail ||
+            o->succ < C->g.ping_succ_min || trend_crossing(C, o))
+            continue;
+        if (best < 0 || o->score > C->s[best].score) best = j;
+    }
+    return best;
+}
+
 /* ───────────────────────── decision engine ───────────────────────────── */
 static void decide(struct cfg *C)
 {
     static char last[64] = "";
     static long t0 = 0;
+    int dead = 0;
+
+    if (g_role != HA_MASTER) return;           /* the standby mirrors via */
 
     if (*C->via) {
-        for (int i = 0; i < C->nsta; i++)
-            if (!strcmp(C->via, C->s[i].ip) &&
-                EFFECTIVE_RSSI(C->s[i], *C) >= C->g.floor_db)
-                return;                        /* don’t switch */
+        for (int i = 0; i < C->nsta; i++) {
+            if (strcmp(C->via, C->s[i].ip)) continue;
+            if (sta_score(C, i) >= C->g.floor_db) {
+                int alt = predict_escape(C, i);
+                t0 = 0;
+                if (alt < 0) return;           /* don’t switch */
+                if (g_verbose)
+                    printf("[predict] %s reaches the floor in %ld ms (%.1f/s), moving to %s\n",
+                           C->via, C->s[i].cross_ms, C->s[i].slope, C->s[alt].ip);
+                strcpy(last, C->s[alt].ip);
+                g_predicted++;
+                switch_to(C, C->s[alt].ip);
+                return;
+            }
+            dead = C->s[i].fail >= C->g.ping_fail_max || C->s[i].score <= -1000;
+        }
     }
 
     /* find best usable link */
     int best = -10000; char best_ip[64] = "";
     for (int i = 0; i < C->nsta; i++) {
-        int er = EFFECTIVE_RSSI(C->s[i], *C);
+        int er = sta_score(C, i);
         if (er > best) { best = er; strcpy(best_ip, C->s[i].ip); }
     }
 
@@ -340,9 +1082,7 @@ static void decide(struct cfg *C)
             }
 
         if (best_idx >= 0 && strcmp(C->via, C->s[best_idx].ip)) {
-            strcpy(C->via, C->s[best_idx].ip);
-            master_route(C, C->via);
-            run_switch_cmd(C, C->via);
+            switch_to(C, C->s[best_idx].ip);
             if (g_verbose)
                 printf("[force] keeping worst link via %s (raw rssi %d)\n",
                        C->via, best_raw);
@@ -354,31 +1094,316 @@ static void decide(struct cfg *C)
     /* hysteresis window */
     char cand[64] = "";
     for (int i = 0; i < C->nsta; i++) {
-        int er = EFFECTIVE_RSSI(C->s[i], *C);
+        int er = C->s[i].score;
         if (best - er < C->g.hyst_db) {         /* first within window   */
             strcpy(cand, C->s[i].ip);
             break;                              /* ← stop overwriting    */
         }
     }
 
-    long now = ms_now();
+    long now = ms_mono();
 
     if (strcmp(cand, last)) {
         if (!t0) t0 = now;
-        if (now - t0 >= C->g.hyst_ms) {
-            strcpy(last, cand); strcpy(C->via, cand);
+        if (now - t0 >= C->g.hyst_ms || dead) {   /* no waiting on a dead link */
+            strcpy(last, cand);
             for (int i = 0; i < C->nsta; i++)
                 if (!strcmp(cand, C->s[i].ip))
                     C->s[i].fail = C->s[i].succ = 0;
-            master_route(C, cand);
-            run_switch_cmd(C, cand);
-            if (g_verbose) printf("[switch] via %s (rssi %d)\n", cand, best);
+            switch_to(C, cand);
+            if (g_verbose) printf("[switch] via %s (score %d)%s\n", cand, best, dead ? " escape" : "");
             t0 = 0;
         }
     }
 }
 
-/* ───────────────────────── minimal HTTP API ──────────────────────────── */
+/* active link under the floor or dead: decide now, not at the next tick */
+static int via_bad(struct cfg *C)
+{
+    for (int i = 0; i < C->nsta; i++)
+        if (!strcmp(C->via, C->s[i].ip))
+            return sta_score(C, i) < C->g.floor_db || trend_crossing(C, &C->s[i]);
+    return 0;
+}
+
+/* ───────────────────────── HA: heartbeat / state sync ───────────────────
+ * Two instances ([ha] bind / peer) exchange a datagram every heartbeat_ms
+ * with role, epoch, the active via and each STA's scoring state.  The
+ * standby keeps probing but mirrors the master's state, so it takes over
+ * warm.  Election:
+ *   - peer silent for dead_ms: become master, epoch + 1;
+ *   - both master (split brain healed): higher epoch, then priority, then
+ *     node_id stays master, the other steps down;
+ *   - both standby: higher priority, then node_id becomes master;
+ *   - same node_id and priority (misconfigured): logged, and the higher
+ *     address:port wins, so the pair still elects exactly one master;
+ *   - preempt = 1: a higher-priority standby takes over a live master once
+ *     it has been in sync for dead_ms.
+ * A node starting up stays standby for dead_ms to hear a running master.
+ * All HA timing is on the monotonic clock.
+ * Without [ha] peer the node is always master.
+ */
+#define HA_MAGIC 0x4c4d4841u               /* "LMHA" */
+#define HA_VER   1
+
+struct ha_sta {
+    uint32_t addr;                         /* network order, as sent */
+    int32_t  rssi_c, retry_c;              /* EWMA × 100 */
+    int32_t  loss_u;                       /* EWMA × 1e6 */
+    int32_t  rtt_p_us, srtt_us;
+    uint8_t  fail, succ; int16_t score;
+} __attribute__((packed));
+struct ha_msg {
+    uint32_t magic; uint8_t ver, role, nsta, _r;
+    uint32_t node, prio, epoch, seq;
+    uint32_t via;                          /* network order, 0 = none */
+    struct ha_sta s[MAX_STA];
+} __attribute__((packed));
+
+static int      g_ha = -1;
+static struct sockaddr_in g_ha_peer, g_ha_self;  /* self: bind, wildcard resolved */
+static uint32_t g_epoch, g_ha_seq;
+static long     g_ha_start, g_ha_next, g_ha_sync;  /* ms_mono(); sync: first heartbeat heard */
+static long     g_peer_seen;                       /* ms_mono() of the last heartbeat, 0 = never */
+static struct { int role; uint32_t node, prio, epoch; } g_peer;
+
+static int ha_addr(const char *spec, struct sockaddr_in *sa)
+{
+    const char *c = strrchr(spec, ':');
+    char ip[64]; size_t il = c ? (size_t)(c - spec) : 0;
+    if (!c || il >= sizeof ip) return -1;
+    memcpy(ip, spec, il); ip[il] = 0;
+    memset(sa, 0, sizeof *sa);
+    sa->sin_family = AF_INET; sa->sin_port = htons(atoi(c + 1));
+    if (!il) sa->sin_addr.s_addr = INADDR_ANY;
+    else if (!inet_aton(ip, &sa->sin_addr)) return -1;
+    return 0;
+}
+static void ha_open(struct cfg *C)
+{
+    if (!*C->g.ha_peer) return;                    /* stand-alone master */
+    struct sockaddr_in b;
+    if (ha_addr(C->g.ha_peer, &g_ha_peer) < 0 || ha_addr(C->g.ha_bind, &b) < 0) {
+        fprintf(stderr, "[ha] bad bind/peer address, running stand-alone\n");
+        return;
+    }
+    g_ha = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_ha < 0 || bind(g_ha, (struct sockaddr *)&b, sizeof b) < 0) {
+        perror("[ha] bind");
+        if (g_ha >= 0) close(g_ha);
+        g_ha = -1; return;
+    }
+    g_ha_self = b;
+    if (b.sin_addr.s_addr == INADDR_ANY) {         /* the source address the peer sees */
+        struct sockaddr_in l; socklen_t ll = sizeof l;
+        int t = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (t >= 0 && connect(t, (struct sockaddr *)&g_ha_peer, sizeof g_ha_peer) == 0 &&
+            getsockname(t, (struct sockaddr *)&l, &ll) == 0)
+            g_ha_self.sin_addr = l.sin_addr;
+        if (t >= 0) close(t);
+    }
+    g_role = HA_STANDBY;
+    g_ha_start = g_ha_next = ms_mono();
+}
+static void ha_send(struct cfg *C)
+{
+    struct ha_msg m; memset(&m, 0, sizeof m);
+    struct in_addr v = {0};
+    m.magic = htonl(HA_MAGIC); m.ver = HA_VER; m.role = g_role; m.nsta = C->nsta;
+    m.node  = htonl(C->g.ha_node); m.prio = htonl(C->g.ha_prio);
+    m.epoch = htonl(g_epoch);      m.seq  = htonl(++g_ha_seq);
+    if (*C->via) inet_aton(C->via, &v);
+    m.via = v.s_addr;
+    for (int i = 0; i < C->nsta; i++) {
+        const struct sta *s = &C->s[i];
+        struct ha_sta *h = &m.s[i];
+        h->addr     = s->addr.s_addr;
+        h->rssi_c   = htonl((int32_t)(s->rssi_s * 100));
+        h->retry_c  = htonl((int32_t)(s->retry_s * 100));
+        h->loss_u   = htonl((int32_t)(s->loss_s * 1e6));
+        h->rtt_p_us = htonl(s->rtt_p_us); h->srtt_us = htonl(s->srtt_us);
+        h->fail = s->fail; h->succ = s->succ;
+        h->score = htons((uint16_t)s->score);
+    }
+    size_t len = offsetof(struct ha_msg, s) + C->nsta * sizeof m.s[0];
+    sendto(g_ha, &m, len, 0, (struct sockaddr *)&g_ha_peer, sizeof g_ha_peer);
+}
+/* the master's view, adopted while standby */
+static void ha_mirror(struct cfg *C, const struct ha_msg *m)
+{
+    struct in_addr v = { m->via };
+    if (m->via) snprintf(C->via, sizeof C->via, "%s", inet_ntoa(v));
+    else        C->via[0] = 0;
+    for (int k = 0; k < m->nsta && k < MAX_STA; k++) {
+        const struct ha_sta *h = &m->s[k];
+        for (int i = 0; i < C->nsta; i++) {
+            struct sta *s = &C->s[i];
+            if (s->addr.s_addr != h->addr) continue;
+            s->rssi_s   = (int32_t)ntohl(h->rssi_c) / 100.0;
+            s->retry_s  = (int32_t)ntohl(h->retry_c) / 100.0;
+            s->loss_s   = (int32_t)ntohl(h->loss_u) / 1e6;
+            s->rtt_p_us = (int32_t)ntohl(h->rtt_p_us);
+            s->srtt_us  = (int32_t)ntohl(h->srtt_us);
+            s->fail = h->fail; s->succ = h->succ;
+            s->score = (int16_t)ntohs(h->score);
+        }
+    }
+}
+static void ha_recv(struct cfg *C)
+{
+    struct ha_msg m; ssize_t n;
+    struct sockaddr_in from; socklen_t fl = sizeof from;
+    while ((n = recvfrom(g_ha, &m, sizeof m, 0, (struct sockaddr *)&from, &fl)) > 0) {
+        fl = sizeof from;
+        if (from.sin_addr.s_addr != g_ha_peer.sin_addr.s_addr ||
+            from.sin_port != g_ha_peer.sin_port) continue;     /* election is two-party only */
+        if ((size_t)n < offsetof(struct ha_msg, s) || ntohl(m.magic) != HA_MAGIC || m.ver != HA_VER ||
+            (size_t)n < offsetof(struct ha_msg, s) + m.nsta * sizeof m.s[0] || m.nsta > MAX_STA)
+            continue;
+        long now = ms_mono();
+        if (!g_peer_seen || now - g_peer_seen >= C->g.ha_dead_ms) g_ha_sync = now;
+        g_peer_seen = now;
+        g_peer.role = m.role; g_peer.node = ntohl(m.node);
+        g_peer.prio = ntohl(m.prio); g_peer.epoch = ntohl(m.epoch);
+        static int warned;                         /* both sides run the defaults, say */
+        if (g_peer.node == (uint32_t)C->g.ha_node && g_peer.prio == (uint32_t)C->g.ha_prio && !warned++)
+            fprintf(stderr, "[ha] error: peer has the same node_id %d and priority %d; "
+                    "set a distinct node_id, breaking the tie by address\n", C->g.ha_node, C->g.ha_prio);
+        if (g_peer.epoch > g_epoch && m.role == HA_MASTER && g_role == HA_STANDBY)
+            g_epoch = g_peer.epoch;
+        if (m.role == HA_MASTER && g_role == HA_STANDBY) ha_mirror(C, &m);
+    }
+}
+static void ha_become(struct cfg *C, int role, const char *why)
+{
+    if (role == HA_STANDBY) transition_commit(C);  /* don't leave the sender in "both" */
+    g_role = role;
+    if (role == HA_MASTER) {
+        g_epoch = (g_peer.epoch > g_epoch ? g_peer.epoch : g_epoch) + 1;
+        if (*C->via) {                             /* take the route over as it stands */
+            master_route(C, C->via, 1);
+            run_switch_cmd(C, C->via);
+        }
+        g_route_dirty = 1;
+    }
+    g_ha_next = 0;                                 /* tell the peer now */
+    fprintf(stderr, "[ha] %s (epoch %u): %s\n", role == HA_MASTER ? "master" : "standby", g_epoch, why);
+}
+/* does this node outrank the peer?  epoch only counts between two masters */
+static int ha_outranks(struct cfg *C, int by_epoch)
+{
+    if (by_epoch && g_epoch != g_peer.epoch) return g_epoch > g_peer.epoch;
+    if ((uint32_t)C->g.ha_prio != g_peer.prio) return (uint32_t)C->g.ha_prio > g_peer.prio;
+    if ((uint32_t)C->g.ha_node != g_peer.node) return (uint32_t)C->g.ha_node > g_peer.node;
+    uint32_t a = ntohl(g_ha_self.sin_addr.s_addr), b = ntohl(g_ha_peer.sin_addr.s_addr);
+    if (a != b) return a > b;
+    return ntohs(g_ha_self.sin_port) > ntohs(g_ha_peer.sin_port);
+}
+/* election + heartbeat; returns ms until it needs to run again (-1 = HA off) */
+static long ha_tick(struct cfg *C)
+{
+    if (g_ha < 0) return -1;
+    long now = ms_mono(), dead = C->g.ha_dead_ms;
+    int alive = g_peer_seen && now - g_peer_seen < dead;
+
+    if (!alive) {
+        if (g_role == HA_STANDBY && now - g_ha_start >= dead)
+            ha_become(C, HA_MASTER, g_peer_seen ? "peer silent" : "no peer");
+    } else if (g_role == HA_MASTER && g_peer.role == HA_MASTER) {
+        if (!ha_outranks(C, 1)) ha_become(C, HA_STANDBY, "split brain, peer outranks");
+    } else if (g_role == HA_STANDBY && g_peer.role == HA_STANDBY) {
+        if (ha_outranks(C, 0)) ha_become(C, HA_MASTER, "elected");
+    } else if (g_role == HA_STANDBY && C->g.ha_preempt && ha_outranks(C, 0) &&
+               now - g_ha_sync >= dead) {
+        ha_become(C, HA_MASTER, "preempt");
+    }
+
+    if (now >= g_ha_next) {
+        ha_send(C);
+        g_ha_next = now + C->g.ha_hb_ms;
+    }
+    long left = g_ha_next - now;
+    if (alive && g_peer_seen + dead - now < left) left = g_peer_seen + dead - now;
+    if (g_role == HA_STANDBY && !alive && g_ha_start + dead - now < left) left = g_ha_start + dead - now;
+    return left < 0 ? 0 : left;
+}
+
+/* ───────────────────────── history ring ────────────────────────────────
+ * One sample per poll for every STA, HIST_LEN deep; /history and /metrics
+ * are served from it.
+ */
+struct hsample {
+    long   t_ms;
+    int    active;                       /* STA index, -1 = none */
+    struct { int16_t rssi, retry; int32_t rtt_us; uint8_t fail, succ; } s[MAX_STA];
+};
+static struct hsample g_hist[HIST_LEN];
+static unsigned long  g_hist_n;          /* samples ever recorded */
+
+static void hist_push(struct cfg *C)
+{
+    struct hsample *h = &g_hist[g_hist_n % HIST_LEN];
+    h->t_ms = ms_now(); h->active = -1;
+    for (int i = 0; i < C->nsta; i++) {
+        const struct sta *s = &C->s[i];
+        h->s[i].rssi   = s->rssi < -10000 ? -10000 : s->rssi > 10000 ? 10000 : s->rssi;
+        h->s[i].retry  = s->retry < -1 ? -1 : s->retry > 10000 ? 10000 : s->retry;
+        h->s[i].rtt_us = s->fail ? -1 : s->rtt_us;
+        h->s[i].fail   = s->fail; h->s[i].succ = s->succ;
+        if (!strcmp(C->via, s->ip)) h->active = i;
+    }
+    g_hist_n++;
+}
+
+/* ───────────────────────── response buffer ─────────────────────────────
+ * Grows as needed up to OUT_MAX; err is set instead of overrunning.
+ */
+struct obuf { char *b; size_t n, cap; int err; };
+
+static int ob_room(struct obuf *o, size_t need)
+{
+    if (o->err) return 0;
+    if (o->n + need < o->cap) return 1;
+    size_t nc = o->cap ? o->cap : 4096;
+    while (nc <= o->n + need) nc *= 2;
+    char *nb = nc > OUT_MAX ? NULL : realloc(o->b, nc);
+    if (!nb) { o->err = 1; return 0; }
+    o->b = nb; o->cap = nc;
+    return 1;
+}
+static void ob_put(struct obuf *o, const void *d, size_t len)
+{
+    if (!ob_room(o, len)) return;
+    memcpy(o->b + o->n, d, len); o->n += len; o->b[o->n] = 0;
+}
+static void __attribute__((format(printf, 2, 3))) ob_printf(struct obuf *o, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt); int k = vsnprintf(NULL, 0, fmt, ap); va_end(ap);
+    if (k < 0 || !ob_room(o, k)) { o->err = 1; return; }
+    va_start(ap, fmt); vsnprintf(o->b + o->n, o->cap - o->n, fmt, ap); va_end(ap);
+    o->n += k;
+}
+static void ob_free(struct obuf *o) { free(o->b); memset(o, 0, sizeof *o); }
+
+/* ───────────────────────── minimal HTTP API ────────────────────────────
+ * Up to MAX_CONN clients, all non-blocking: the request line is collected
+ * and the whole response queued, then drained as the socket allows.  A
+ * client that is not done after CONN_TO_MS is dropped, so a stuck browser
+ * never holds up the select() loop.
+ *   GET /                the html_path page
+ *   GET /status          current state (JSON)
+ *   GET /history?since=T ring samples newer than T (ms, as in "now")
+ *   GET /metrics         Prometheus text format
+ */
+struct conn {
+    int    fd;                           /* -1 = free slot */
+    long   t0;                           /* ms_mono() at accept, for CONN_TO_MS */
+    char   in[BUF_SZ]; int in_n;
+    struct obuf out; size_t off;         /* out.b != NULL: writing */
+};
+static struct conn g_conn[MAX_CONN];
+
 static int srv_init(int p)
 {
     int s = socket(AF_INET, SOCK_STREAM, 0);
@@ -388,89 +1413,244 @@ static int srv_init(int p)
     bind(s, (void *)&a, sizeof a); listen(s, 8);
     fcntl(s, F_SETFL, O_NONBLOCK); return s;
 }
-static void http_send(int fd, const char *typ, const char *b)
+static void http_send(struct conn *c, const char *st, const char *typ, struct obuf *body)
 {
-    char h[128];
-    int n = snprintf(h, sizeof h,
-        "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
-        typ, strlen(b));
-    send(fd, h, n, 0); send(fd, b, strlen(b), 0);
+    if (body->err) { ob_free(body); st = "500 Internal Server Error"; typ = "text/plain"; ob_put(body, "500\n", 4); }
+    ob_printf(&c->out,
+        "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        st, typ, body->n);
+    ob_put(&c->out, body->b, body->n);
+    ob_free(body);
+    c->off = 0;
 }
-static void json_status(struct cfg *C, char *out)
+static void json_status(struct cfg *C, struct obuf *o)
 {
-    int n = 0;
-    n += sprintf(out + n,
-                 "{\"role\":\"master\",\"active\":\"%s\",\"nodes\":[",
-                 *C->via ? C->via : "none");
+    ob_printf(o,
+              "{\"role\":\"%s\",\"active\":\"%s\",\"score_model\":\"%s\",\"nodes\":[",
+              g_role == HA_MASTER ? "master" : "standby",
+              *C->via ? C->via : "none", C->g.score_model);
 
     for (int i = 0; i < C->nsta; i++)
-        n += sprintf(out + n,
+        ob_printf(o,
             "%s{\"ip\":\"%s\",\"rssi\":%d,\"retry\":%d,"
-            "\"fail\":%d,\"succ\":%d}",
+            "\"fail\":%d,\"succ\":%d,\"rtt_ms\":%.1f,\"srtt_ms\":%.1f,"
+            "\"rtt_p_ms\":%.1f,\"loss_pct\":%.1f,\"score\":%d,"
+            "\"trend\":%.2f,\"cross_ms\":%ld}",
             i ? "," : "",
             C->s[i].ip,
             EFFECTIVE_RSSI(C->s[i], *C),
             C->s[i].retry,
             C->s[i].fail,
-            C->s[i].succ);
-
-    sprintf(out + n,
-        "],\"txpwr\":%d,\"cck_fail\":%d,"
+            C->s[i].succ,
+            C->s[i].rtt_us  < 0 ? -1.0 : C->s[i].rtt_us  / 1000.0,
+            C->s[i].srtt_us < 0 ? -1.0 : C->s[i].srtt_us / 1000.0,
+            C->s[i].rtt_p_us < 0 ? -1.0 : C->s[i].rtt_p_us / 1000.0,
+            100.0 * C->s[i].loss_s,
+            sta_score(C, i),
+            C->s[i].slope, C->s[i].cross_ms);
+
+    if (g_trans_end)
+        ob_printf(o, "],\"transition\":{\"from\":\"%s\",\"left_ms\":%ld}",
+                  g_trans_from, g_trans_end - ms_mono());
+    else
+        ob_printf(o, "],\"transition\":null");
+    if (g_ha >= 0)
+        ob_printf(o, ",\"ha\":{\"node\":%d,\"epoch\":%u,\"peer\":%s,\"peer_role\":\"%s\"}",
+                  C->g.ha_node, g_epoch,
+                  g_peer_seen && ms_mono() - g_peer_seen < C->g.ha_dead_ms ? "\"alive\"" : "\"dead\"",
+                  g_peer.role == HA_MASTER ? "master" : "standby");
+    ob_printf(o,
+        ",\"switch_us\":%ld,\"txpwr\":%d,\"cck_fail\":%d,"
         "\"ofdm_fail\":%d,\"false_alarm\":%d}\n",
-        C->txpwr, C->cck_fail, C->ofdm_fail, C->fa);
+        g_switch_us, C->txpwr, C->cck_fail, C->ofdm_fail, C->fa);
 }
-/* ───────────────────────── HTTP request handler ──────────────────────── */
-static void handle(int fd, struct cfg *C)
+/* columnar: one array per field, indexed like "sta" */
+static void json_history(struct cfg *C, struct obuf *o, long since)
 {
-    char req[BUF_SZ];
-    int  r = 0, n;
-
-    /* read up to (first-line + \n) or until the 1-second SO_RCVTIMEO fires */
-    while ((n = recv(fd, req + r, sizeof req - 1 - r, 0)) > 0) {
-        r += n;
-        if (memchr(req, '\n', r)) break;            /* have the request line */
+    ob_printf(o, "{\"now\":%ld,\"poll_ms\":%d,\"sta\":[", ms_now(), C->g.poll_ms);
+    for (int i = 0; i < C->nsta; i++) ob_printf(o, "%s\"%s\"", i ? "," : "", C->s[i].ip);
+    ob_printf(o, "],\"samples\":[");
+
+    unsigned long k = g_hist_n > HIST_LEN ? g_hist_n - HIST_LEN : 0;
+    int first = 1;
+    for (; k < g_hist_n && !o->err; k++) {
+        const struct hsample *h = &g_hist[k % HIST_LEN];
+        if (h->t_ms <= since) continue;
+        ob_printf(o, "%s{\"t\":%ld,\"active\":%d", first ? "" : ",", h->t_ms, h->active);
+        first = 0;
+#define HCOL(name, fmt, expr) do {                                        \
+            ob_printf(o, ",\"" name "\":[");                              \
+            for (int i = 0; i < C->nsta; i++)                             \
+                ob_printf(o, "%s" fmt, i ? "," : "", expr);               \
+            ob_printf(o, "]");                                            \
+        } while (0)
+        HCOL("rssi",   "%d",   h->s[i].rssi);
+        HCOL("retry",  "%d",   h->s[i].retry);
+        HCOL("rtt_ms", "%.1f", h->s[i].rtt_us < 0 ? -1.0 : h->s[i].rtt_us / 1000.0);
+        HCOL("fail",   "%d",   h->s[i].fail);
+        HCOL("succ",   "%d",   h->s[i].succ);
+#undef HCOL
+        ob_printf(o, "}");
     }
-    if (n <= 0) { close(fd); return; }              /* timeout / client quit */
-    req[r] = '\0';
+    ob_printf(o, "]}\n");
+}
+static void prom_head(struct obuf *o, const char *m, const char *type, const char *help)
+{
+    ob_printf(o, "# HELP linkmgrd_%s %s\n# TYPE linkmgrd_%s %s\n", m, help, m, type);
+}
+static void prom_sta(struct obuf *o, const char *m, const char *ip, int ok, double v)
+{
+    if (ok) ob_printf(o, "linkmgrd_%s{sta=\"%s\"} %g\n", m, ip, v);
+    else    ob_printf(o, "linkmgrd_%s{sta=\"%s\"} NaN\n", m, ip);
+}
+/* newest ring sample, plus the smoothed/derived values it does not hold */
+static void prom_metrics(struct cfg *C, struct obuf *o)
+{
+    const struct hsample *h = g_hist_n ? &g_hist[(g_hist_n - 1) % HIST_LEN] : NULL;
+    struct hsample z; memset(&z, 0, sizeof z); z.active = -1;
+    if (!h) h = &z;
+#define PSTA(m, type, help, ok, v) do {                                   \
+        prom_head(o, m, type, help);                                      \
+        for (int i = 0; i < C->nsta; i++)                                 \
+            prom_sta(o, m, C->s[i].ip, ok, v);                            \
+    } while (0)
+    PSTA("sta_rssi_dbm", "gauge", "Last RSSI sample.",
+         h->s[i].rssi > -1000, h->s[i].rssi);
+    PSTA("sta_retry_percent", "gauge", "Last retry ratio sample.",
+         h->s[i].retry >= 0, h->s[i].retry);
+    PSTA("sta_rtt_seconds", "gauge", "Last echo round trip; NaN after a loss.",
+         h->s[i].rtt_us >= 0, h->s[i].rtt_us / 1e6);
+    PSTA("sta_rtt_quantile_seconds", "gauge", "RTT percentile that is scored.",
+         C->s[i].rtt_p_us >= 0, C->s[i].rtt_p_us / 1e6);
+    PSTA("sta_loss_ratio", "gauge", "EWMA of lost echoes.", 1, C->s[i].loss_s);
+    PSTA("sta_ping_fail", "gauge", "Consecutive lost echoes.", 1, h->s[i].fail);
+    PSTA("sta_ping_succ", "gauge", "Consecutive answered echoes.", 1, h->s[i].succ);
+    PSTA("sta_score", "gauge", "Ranking value used by decide().", 1, C->s[i].score);
+    PSTA("sta_active", "gauge", "1 for the STA the default route points at.", 1, h->active == i);
+    PSTA("sta_score_trend", "gauge", "Score slope per second over trend_samples.", 1, C->s[i].slope);
+    PSTA("sta_floor_eta_seconds", "gauge", "Predicted time until the floor; NaN if not heading there.",
+         C->s[i].cross_ms >= 0, C->s[i].cross_ms / 1000.0);
+#undef PSTA
+    prom_head(o, "switches_total", "counter", "Default route moves to another STA.");
+    ob_printf(o, "linkmgrd_switches_total %lu\n", g_switches);
+    prom_head(o, "predictive_switches_total", "counter", "Switches made ahead of a predicted floor crossing.");
+    ob_printf(o, "linkmgrd_predictive_switches_total %lu\n", g_predicted);
+    prom_head(o, "route_switch_seconds", "gauge", "Duration of the last route change.");
+    ob_printf(o, "linkmgrd_route_switch_seconds %g\n", g_switch_us < 0 ? 0 : g_switch_us / 1e6);
+    prom_head(o, "transition", "gauge", "1 while a make-before-break window is open.");
+    ob_printf(o, "linkmgrd_transition %d\n", g_trans_end != 0);
+    prom_head(o, "ha_master", "gauge", "1 while this node owns the routes.");
+    ob_printf(o, "linkmgrd_ha_master %d\n", g_role == HA_MASTER);
+    prom_head(o, "ha_epoch", "gauge", "Master term, raised on every takeover.");
+    ob_printf(o, "linkmgrd_ha_epoch %u\n", g_epoch);
+}
+/* ───────────────────────── HTTP request handler ──────────────────────── */
+static void handle(struct conn *c, struct cfg *C)
+{
+    struct obuf body = {0};
+    const char *req = c->in;
 
     /* -------- simple routing -------- */
     if (!strncmp(req, "GET /status", 11)) {
 
-        char body[BUF_SZ];  json_status(C, body);
-        http_send(fd, "application/json", body);
+        json_status(C, &body);
+        http_send(c, "200 OK", "application/json", &body);
+
+    } else if (!strncmp(req, "GET /history", 12)) {
+
+        const char *q = strstr(req, "since=");
+        long since = 0;
+        if (q && q < strchr(req, '\n')) since = strtol(q + 6, NULL, 10);
+        json_history(C, &body, since);
+        http_send(c, "200 OK", "application/json", &body);
+
+    } else if (!strncmp(req, "GET /metrics", 12)) {
+
+        prom_metrics(C, &body);
+        http_send(c, "200 OK", "text/plain; version=0.0.4", &body);
 
     } else if (!strncmp(req, "GET / ", 6)) {
 
-        int f = open(C->g.html, O_RDONLY);
+        int f = open(C->g.html, O_RDONLY | O_CLOEXEC);
         if (f >= 0) {
-            struct stat st;  fstat(f, &st);
-            char hdr[128];
-            int hlen = snprintf(hdr, sizeof hdr,
-                "HTTP/1.0 200 OK\r\n"
-                "Content-Length: %zu\r\n"
-                "Content-Type: text/html\r\n\r\n",
-                st.st_size);
-            send(fd, hdr, hlen, 0);
-            while ((r = read(f, req, sizeof req)) > 0) send(fd, req, r, 0);
+            char b[BUF_SZ]; ssize_t r;
+            while ((r = read(f, b, sizeof b)) > 0) ob_put(&body, b, r);
             close(f);
+            http_send(c, "200 OK", "text/html", &body);
         } else {
-            http_send(fd, "text/plain", "404\n");
+            ob_put(&body, "404\n", 4);
+            http_send(c, "404 Not Found", "text/plain", &body);
         }
 
     } else {
 
-        http_send(fd, "text/plain", "404\n");
+        ob_put(&body, "404\n", 4);
+        http_send(c, "404 Not Found", "text/plain", &body);
+    }
+}
+static void conn_close(struct conn *c)
+{
+    close(c->fd); c->fd = -1;
+    ob_free(&c->out);
+}
+static void conn_accept(int srv)
+{
+    int fd;
+    while ((fd = accept4(srv, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct conn *c = NULL;
+        for (int i = 0; i < MAX_CONN && !c; i++)
+            if (g_conn[i].fd < 0) c = &g_conn[i];
+        if (!c) { close(fd); continue; }       /* all slots busy */
+        memset(c, 0, sizeof *c);
+        c->fd = fd; c->t0 = ms_mono();
     }
+}
+static void conn_io(struct conn *c, struct cfg *C, int rd, int wr)
+{
+    if (rd && !c->out.b) {
+        ssize_t n = recv(c->fd, c->in + c->in_n, sizeof c->in - 1 - c->in_n, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) { conn_close(c); return; }
+        if (n > 0) c->in_n += n;
+        c->in[c->in_n] = 0;
+        if (memchr(c->in, '\n', c->in_n)) handle(c, C);     /* have the request line */
+        else if (c->in_n >= (int)sizeof c->in - 1) { conn_close(c); return; }
+        wr = c->out.b != NULL;                               /* try to send right away */
+    }
+    if (wr && c->out.b) {
+        ssize_t n = send(c->fd, c->out.b + c->off, c->out.n - c->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) { conn_close(c); return; }
+        if (n > 0) c->off += n;
+        if (c->off >= c->out.n) conn_close(c);
+    }
+}
 
-    close(fd);
+/* linkmgrd CONF --bench-route N: time master_route() per backend while
+ * flipping the default route between the first two STAs */
+static int bench_route(struct cfg *C, int n)
+{
+    static const char *be[2] = { "shell", "netlink" };
+    if (C->nsta < 2) { fprintf(stderr, "bench-route: needs two STAs\n"); return 1; }
+    for (int b = 0; b < 2; b++) {
+        strcpy(C->g.route_backend, be[b]);
+        double sum = 0; long mx = 0;
+        for (int i = 0; i < n; i++) {
+            master_route(C, C->s[i & 1].ip, 1);
+            sum += g_switch_us; if (g_switch_us > mx) mx = g_switch_us;
+        }
+        printf("route-bench backend=%s n=%d avg_us=%.1f max_us=%ld verified=%d\n",
+               be[b], n, n ? sum / n : 0.0, mx, route_is_ok(C, C->s[(n - 1) & 1].ip));
+    }
+    return 0;
 }
 
 /* ───────────────────────── main loop ─────────────────────────────────── */
 int main(int argc, char **argv)
 {
     const char *cfgf = CFG_DEF;
+    int bench = 0;
     for (int i = 1; i < argc; i++)
         if (!strcmp(argv[i], "--verbose")) g_verbose = 1;
+        else if (!strcmp(argv[i], "--bench-route") && i + 1 < argc) bench = atoi(argv[++i]);
         else cfgf = argv[i];
 
     struct cfg C = {0};
@@ -485,15 +1665,37 @@ int main(int argc, char **argv)
     C.g.ping_succ_min = 2;
     C.txpwr      = -1;
     C.g.switch_cmd[0] = '\0';              /* no hook by default */
+    C.g.transition_ms = 0;                 /* one-step switch */
     C.cck_fail   = C.ofdm_fail = C.fa = -1;
-    for (int i = 0; i < MAX_STA; i++) C.s[i].retry = -1;
+    for (int i = 0; i < MAX_STA; i++) {
+        C.s[i].retry  = -1;
+        C.s[i].rssi_s = -10000; C.s[i].retry_s = -1;
+    }
+    strcpy(C.g.score_model, "weighted");
+    C.g.ewma_alpha = 0.3;
+    C.g.w_rssi = 1.0; C.g.w_retry = 0.2; C.g.w_rtt = 0.1; C.g.w_loss = 0.5;
+    C.g.rtt_pct = 90;
+    C.g.horizon_ms = 0; C.g.trend_n = 10;
+    C.g.ha_node = 1; C.g.ha_prio = 100;
+    C.g.ha_hb_ms = 50; C.g.ha_dead_ms = 200;
+    strcpy(C.g.ha_bind, "0.0.0.0:5820");
+    strcpy(C.g.route_backend, "netlink");
 
     strcpy(C.g.master_if, "wlan0");
     strcpy(C.g.html, "/etc/linkmgrd.html");
     /* default RSSI file can be empty; user may override */
     C.g.sta_poll_file[0] = '\0';
+    C.g.sta_watch = 1;
 
     if (ini_load(cfgf, &C) < 0) return 1;
+    if (C.g.rtt_pct < 0)   C.g.rtt_pct = 0;
+    if (C.g.rtt_pct > 100) C.g.rtt_pct = 100;
+    if (!(C.g.ewma_alpha > 0))  C.g.ewma_alpha = 0.01;   /* 0 would freeze the EWMAs */
+    if (C.g.ewma_alpha > 1)     C.g.ewma_alpha = 1;
+    if (C.g.trend_n < 3)         C.g.trend_n = 3;
+    if (C.g.trend_n > TREND_MAX) C.g.trend_n = TREND_MAX;
+    for (int i = 0; i < MAX_STA; i++) C.s[i].cross_ms = -1;
+    score_select(&C);
 
     if (setvbuf(stdout, NULL, _IOLBF, 0) != 0) perror("setvbuf");
 
@@ -505,39 +1707,84 @@ int main(int argc, char **argv)
 
     signal(SIGINT, sig_hdl); signal(SIGTERM, sig_hdl);
 
+    rtnl_open();
+    if (bench > 0) return bench_route(&C, bench);
+    icmp_open(&C);
+    sta_events_open(&C);
+    rssi_poll_from_file(&C);                   /* current sample; events from here on */
+    ha_open(&C);
+    if (g_ha >= 0)
+        fprintf(stderr, "[ha] node %d prio %d on %s, peer %s: standby until elected\n",
+                C.g.ha_node, C.g.ha_prio, C.g.ha_bind, C.g.ha_peer);
+    if (g_verbose && g_ino >= 0)     printf("[rssi] watching %s\n", C.g.sta_poll_file);
+    if (g_verbose && g_stasock >= 0) printf("[rssi] listening on %s\n", C.g.sta_listen);
     int srv = srv_init(C.g.http_port);
-    long next_poll = ms_now() + C.g.poll_ms;
-    long next_dec  = ms_now() + C.g.hyst_ms;
+    for (int i = 0; i < MAX_CONN; i++) g_conn[i].fd = -1;
+    long next_poll = ms_mono() + C.g.poll_ms;
+    long next_dec  = ms_mono() + C.g.hyst_ms;
+    unsigned seen_ping = 0, seen_rssi = 0;
 
     while (g_run) {
-        long now = ms_now();
+        long now = ms_mono();
         long to = 500;
         if (now < next_poll && next_poll - now < to) to = next_poll - now;
         if (now < next_dec  && next_dec  - now < to) to = next_dec  - now;
+        long pto = ping_expire(&C);
+        if (pto >= 0 && pto < to) to = pto;
+        long tto = transition_poll(&C);
+        if (tto >= 0 && tto < to) to = tto;
+        long hto = ha_tick(&C);
+        if (hto >= 0 && hto < to) to = hto;
 
         struct timeval tv = { to / 1000, (to % 1000) * 1000 };
-        fd_set rset; FD_ZERO(&rset); FD_SET(srv, &rset);
-        if (select(srv + 1, &rset, NULL, NULL, &tv) > 0 &&
-            FD_ISSET(srv, &rset)) {
-            int c = accept(srv, NULL, NULL);
-            if (c >= 0) {
-                /* 1-second read timeout guards partial / malicious requests */
-                struct timeval rto = { 1, 0 };
-                setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &rto, sizeof rto);
-
-                /* leave the socket *blocking* but bounded */
-                int flags = fcntl(c, F_GETFL, 0);
-                fcntl(c, F_SETFL, flags & ~O_NONBLOCK);
-
-                handle(c, &C);
-            }
+        fd_set rset, wset; FD_ZERO(&rset); FD_ZERO(&wset); FD_SET(srv, &rset);
+        int maxfd = srv;
+        for (int i = 0; i < MAX_CONN; i++) {
+            struct conn *c = &g_conn[i];
+            if (c->fd < 0) continue;
+            if (now - c->t0 >= CONN_TO_MS) { conn_close(c); continue; }   /* stuck client */
+            FD_SET(c->fd, c->out.b ? &wset : &rset);
+            if (c->fd > maxfd) maxfd = c->fd;
         }
+        if (g_icmp >= 0)  { FD_SET(g_icmp, &rset);  if (g_icmp > maxfd)  maxfd = g_icmp; }
+        if (g_rtmon >= 0) { FD_SET(g_rtmon, &rset); if (g_rtmon > maxfd) maxfd = g_rtmon; }
+        if (g_ino >= 0)   { FD_SET(g_ino, &rset);   if (g_ino > maxfd)   maxfd = g_ino; }
+        if (g_stasock >= 0) { FD_SET(g_stasock, &rset); if (g_stasock > maxfd) maxfd = g_stasock; }
+        if (g_ha >= 0)    { FD_SET(g_ha, &rset);    if (g_ha > maxfd)    maxfd = g_ha; }
+        int nfd = select(maxfd + 1, &rset, &wset, NULL, &tv);
+        int fresh = 0;
+        if (nfd > 0 && g_icmp >= 0 && FD_ISSET(g_icmp, &rset))
+            ping_recv(&C);
+        if (nfd > 0 && g_ha >= 0 && FD_ISSET(g_ha, &rset)) {
+            ha_recv(&C);
+            ha_tick(&C);                        /* split brain / election: act now */
+        }
+        if (nfd > 0 && g_ino >= 0 && FD_ISSET(g_ino, &rset) && sta_watch_fired()) {
+            rssi_poll_from_file(&C); fresh = 1;
+        }
+        if (nfd > 0 && g_stasock >= 0 && FD_ISSET(g_stasock, &rset))
+            fresh |= sta_sock_read(&C);
+        if (nfd > 0 && g_rtmon >= 0 && FD_ISSET(g_rtmon, &rset) && rtmon_read())
+            route_watchdog(&C);                 /* external change: repair now */
+        if (nfd > 0) {
+            for (int i = 0; i < MAX_CONN; i++)
+                if (g_conn[i].fd >= 0)
+                    conn_io(&g_conn[i], &C, FD_ISSET(g_conn[i].fd, &rset), FD_ISSET(g_conn[i].fd, &wset));
+            if (FD_ISSET(srv, &rset)) conn_accept(srv);
+        }
+
+        /* fresh sample or echo result: a failing active link is handled now */
+        if (g_ping_done != seen_ping) { seen_ping = g_ping_done; fresh = 1; }
+        if (g_rssi_done != seen_rssi) { seen_rssi = g_rssi_done; trend_update(&C); }
+        if (g_reprobe) { g_reprobe = 0; ping_send(&C); }
+        if (fresh && via_bad(&C)) decide(&C);
 
-        now = ms_now();
+        now = ms_mono();
         if (now >= next_poll) {
-            rssi_poll_from_file(&C);   /* ← new polling */
-            ping_poll(&C);
+            if (g_ino < 0) rssi_poll_from_file(&C);   /* events otherwise */
+            ping_send(&C);
             route_watchdog(&C);
+            hist_push(&C);
             next_poll = now + C.g.poll_ms;
         }
         if (now >= next_dec) {
@@ -546,5 +1793,12 @@ int main(int argc, char **argv)
         }
     }
     close(srv);
+    for (int i = 0; i < MAX_CONN; i++) if (g_conn[i].fd >= 0) conn_close(&g_conn[i]);
+    if (g_icmp >= 0) close(g_icmp);
+    if (g_rtnl >= 0) close(g_rtnl);
+    if (g_rtmon >= 0) close(g_rtmon);
+    if (g_ino >= 0) close(g_ino);
+    if (g_stasock >= 0) close(g_stasock);
+    if (g_ha >= 0) close(g_ha);
     return 0;
 }
@@ -6,6 +6,9 @@
  *               · optional CPU pin (--cpu=N)
  *               · per-port signed dloss = agg_fwd − port_recv
  *               · soft-realtime SCHED_FIFO 50
+ *               · local inputs without the loopback stack:
+ *                   unix:/PATH  (AF_UNIX SOCK_SEQPACKET, we listen)
+ *                   shm:/NAME   (SPSC ring, see shm_ring.h; polled every 1 ms)
  *               · reduced clock_gettime() calls (≈ every TIME_CHECK_PKTS pkts)
  *
  * Build:
@@ -14,6 +17,7 @@
  * Example:
  *   sudo setcap cap_sys_nice=eip ./rtp_merge 127.0.0.1 5600 \
  *        --cpu=3 --batch=32 --timepkts=2000 5702 5599
+ *   ./rtp_merge 127.0.0.1 5600 unix:/run/aprx0.sock shm:/aprx1
  */
 
 #define _GNU_SOURCE
@@ -31,8 +35,11 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/syscall.h>
+#include <sys/un.h>
 #include <linux/version.h>
+#include "shm_ring.h"
 
 #ifndef recvmmsg
 #  define recvmmsg(sockfd, msgvec, vlen, flags, timeout) \
@@ -129,9 +136,35 @@ static int make_sock(int port)
     return s;
 }
 
+static int make_unix_listener(const char *path)
+{
+    int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (s < 0) { perror("socket"); exit(EXIT_FAILURE); }
+
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    snprintf(a.sun_path, sizeof(a.sun_path), "%s", path);
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(s, 1) < 0) {
+        perror(path); exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+/* recvmmsg() reports SEQPACKET EOF as zero-length entries, indistinguishable
+ * from an empty datagram; the peer is only gone if the socket says so too */
+static bool unix_hup(int s)
+{
+    struct pollfd p = { .fd = s, .events = POLLRDHUP };
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP));
+}
+
 /* ----------------------------------------------------------------- per-input counters */
+enum { IN_UDP, IN_UNIX, IN_SHM };
 typedef struct {
-    int       sock, port;
+    int       kind;
+    int       sock, lsock, port;        /* lsock: unix listener, sock = peer */
+    const char *name;
+    struct shm_ring ring;
     uint64_t  recv, fwd, dup, gaps, late;
 } input_t;
 
@@ -141,7 +174,7 @@ int main(int argc, char *argv[])
     if (argc < 4) {
         fprintf(stderr,
         "Usage: %s OUT_IP OUT_PORT [--batch=N|-bN] [--cpu=N|-cN] "
-                "[--timepkts=N] IN_PORT...\n",
+                "[--timepkts=N] IN_PORT|unix:/PATH|shm:/NAME...\n",
         argv[0]); return EXIT_FAILURE; }
 
     const char *out_ip   = argv[1];
@@ -172,9 +205,23 @@ int main(int argc, char *argv[])
 
     /* create input sockets */
     input_t in[MAX_SOCKS] = {0};
+    bool any_shm = false;
     for (int i = 0; i < n_in; i++) {
-        in[i].port = atoi(argv[argi + i]);
-        in[i].sock = make_sock(in[i].port);
+        const char *a = argv[argi + i];
+        in[i].name  = a;
+        in[i].sock  = in[i].lsock = -1;
+        if (!strncmp(a, "unix:", 5)) {
+            in[i].kind  = IN_UNIX;
+            in[i].lsock = make_unix_listener(a + 5);
+        } else if (!strncmp(a, "shm:", 4)) {
+            in[i].kind = IN_SHM;
+            if (shm_ring_open(&in[i].ring, a + 4, 0) < 0) { perror(a); return EXIT_FAILURE; }
+            any_shm = true;
+        } else {
+            in[i].kind = IN_UDP;
+            in[i].port = atoi(a);
+            in[i].sock = make_sock(in[i].port);
+        }
     }
 
     /* output socket (unconnected, fire-and-forget) */
@@ -229,10 +276,17 @@ int main(int argc, char *argv[])
         /* poll up to 1 s */
         fd_set rfds; FD_ZERO(&rfds); int maxfd = -1;
         for (int i = 0; i < n_in; i++) {
-            FD_SET(in[i].sock, &rfds);
-            if (in[i].sock > maxfd) maxfd = in[i].sock;
+            if (in[i].sock >= 0) {
+                FD_SET(in[i].sock, &rfds);
+                if (in[i].sock > maxfd) maxfd = in[i].sock;
+            }
+            if (in[i].lsock >= 0) {
+                FD_SET(in[i].lsock, &rfds);
+                if (in[i].lsock > maxfd) maxfd = in[i].lsock;
+            }
         }
         struct timeval tv = {1,0};
+        if (any_shm) { tv.tv_sec = 0; tv.tv_usec = 1000; }    /* ring has no fd */
         int sel = select(maxfd+1, &rfds, NULL, NULL, &tv);
         if (sel < 0) {
             if (errno == EINTR) continue;
@@ -241,15 +295,39 @@ int main(int argc, char *argv[])
 
         /* per ready socket */
         for (int i = 0; i < n_in; i++) {
-            if (!FD_ISSET(in[i].sock, &rfds)) continue;
+            if (in[i].lsock >= 0 && FD_ISSET(in[i].lsock, &rfds)) {
+                int c = accept(in[i].lsock, NULL, NULL);   /* newest producer wins */
+                if (c >= 0) {
+                    if (in[i].sock >= 0) close(in[i].sock);
+                    fcntl(c, F_SETFL, fcntl(c, F_GETFL, 0) | O_NONBLOCK);
+                    in[i].sock = c;
+                }
+                continue;
+            }
+            if (in[i].kind != IN_SHM &&
+                (in[i].sock < 0 || !FD_ISSET(in[i].sock, &rfds))) continue;
 
             int tx_cnt = 0;
             int got;
+            bool eof = false;
             do {
-                got = recvmmsg(in[i].sock, rx_msg, batch, MSG_DONTWAIT, NULL);
-                if (got < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-                    perror("recvmmsg"); break;
+                if (in[i].kind == IN_SHM) {
+                    for (got = 0; got < batch; got++) {
+                        int l = shm_ring_pop(&in[i].ring, buf[got], MAX_PKT);
+                        if (l < 0) break;
+                        rx_msg[got].msg_len = l;
+                    }
+                    if (got == 0) break;
+                } else {
+                    got = recvmmsg(in[i].sock, rx_msg, batch, MSG_DONTWAIT, NULL);
+                    if (got < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                        perror("recvmmsg"); break;
+                    }
+                    if (in[i].kind == IN_UNIX &&               /* peer gone */
+                        (got == 0 ||
+                         (rx_msg[got - 1].msg_len == 0 && unix_hup(in[i].sock))))
+                        eof = true;                        /* after the data */
                 }
 
                 for (int j = 0; j < got; j++) {
@@ -296,12 +374,13 @@ int main(int argc, char *argv[])
                         tx_cnt = 0;
                     }
                 }
-            } while (got == batch);
+            } while (got == batch && !eof);
 
             if (tx_cnt > 0) {                          /* flush remainder */
                 if (sendmmsg(out_sock, tx_msg, tx_cnt, 0) < 0)
                     perror("sendmmsg");
             }
+            if (eof) { close(in[i].sock); in[i].sock = -1; }
         }
 
         /* decide whether to touch the clock */
@@ -320,9 +399,9 @@ int main(int argc, char *argv[])
 
             for (int i = 0; i < n_in; i++) {
                 int64_t dloss = (int64_t)agg_fwd - (int64_t)in[i].recv;
-                printf("%.3f:port=%d:recv=%"PRIu64":fwd=%"PRIu64":dupes=%"PRIu64
+                printf("%.3f:port=%s:recv=%"PRIu64":fwd=%"PRIu64":dupes=%"PRIu64
                        ":gaps=%"PRIu64":late=%"PRIu64":dloss=%"PRId64"\n",
-                       ts, in[i].port, in[i].recv, in[i].fwd, in[i].dup,
+                       ts, in[i].name, in[i].recv, in[i].fwd, in[i].dup,
                        in[i].gaps, in[i].late, dloss);
                 in[i].recv = in[i].fwd = in[i].dup = 0;
                 in[i].gaps = in[i].late = 0;
@@ -0,0 +1,105 @@
+/* shm_ring.h — single-producer / single-consumer packet ring in POSIX shm
+ *
+ *   producer: ap_rx  --out shm:/NAME
+ *   consumer: rtp_merge ... shm:/NAME
+ *
+ * Layout:  [hdr (2 cache lines)] [slots × slot_sz]
+ *          slot = u16 len | payload
+ * head/tail are free-running u32 counters; the producer drops when full.
+ * Each producer start bumps gen and records its first slot in gen_head;
+ * the consumer skips to gen_head when it sees a new gen, and to head when
+ * it starts itself, so neither side replays a previous run's packets.
+ * Build with -lrt on older glibc.
+ */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_RING_MAGIC  0x32474e52u          /* "RNG2" */
+#define SHM_RING_SLOTS  1024                 /* power of two */
+#define SHM_RING_SLOTSZ 2048
+
+struct shm_ring_hdr{
+    uint32_t magic, slots, slot_sz;
+    uint32_t gen, gen_head;                  /* written by producer at start */
+    uint8_t  _pad0[64-20];
+    uint32_t head;  uint8_t _pad1[64-4];     /* written by producer */
+    uint32_t tail;  uint8_t _pad2[64-4];     /* written by consumer */
+};
+struct shm_ring{
+    struct shm_ring_hdr *h;
+    uint8_t *slot;
+    uint32_t mask, slot_sz, gen;
+};
+
+/* open (creating and initialising if needed); 0 on success */
+static inline int shm_ring_open(struct shm_ring *r,const char *name,int producer){
+    size_t sz=sizeof(struct shm_ring_hdr)+(size_t)SHM_RING_SLOTS*SHM_RING_SLOTSZ;
+    int fd=shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600), fresh=fd>=0;
+    if(!fresh) fd=shm_open(name,O_RDWR,0600);
+    if(fd<0) return -1;
+    if(fresh && ftruncate(fd,sz)<0){ close(fd); return -1; }
+    if(!fresh){                              /* touching it before ftruncate is SIGBUS */
+        struct stat st; int i=0;
+        while(fstat(fd,&st)==0 && (size_t)st.st_size<sz && i++<100) usleep(10000);
+        if(fstat(fd,&st)<0 || (size_t)st.st_size<sz){ close(fd); return -1; }
+    }
+    void *m=mmap(NULL,sz,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(m==MAP_FAILED) return -1;
+    r->h=m; r->slot=(uint8_t*)m+sizeof(struct shm_ring_hdr);
+    if(fresh){
+        r->h->slots=SHM_RING_SLOTS; r->h->slot_sz=SHM_RING_SLOTSZ;
+        r->h->head=r->h->tail=r->h->gen=r->h->gen_head=0;
+        __atomic_store_n(&r->h->magic,SHM_RING_MAGIC,__ATOMIC_RELEASE);
+    }else{
+        for(int i=0;i<100 && __atomic_load_n(&r->h->magic,__ATOMIC_ACQUIRE)!=SHM_RING_MAGIC;i++)
+            usleep(10000);                   /* peer still initialising */
+        if(r->h->magic!=SHM_RING_MAGIC || r->h->slots!=SHM_RING_SLOTS ||
+           r->h->slot_sz!=SHM_RING_SLOTSZ){ munmap(m,sz); return -1; }
+    }
+    r->mask=SHM_RING_SLOTS-1; r->slot_sz=SHM_RING_SLOTSZ;
+    if(producer){                            /* new run: consumer skips what's left */
+        r->h->gen_head=r->h->head;
+        r->gen=__atomic_add_fetch(&r->h->gen,1,__ATOMIC_RELEASE);
+    }else{
+        r->gen=__atomic_load_n(&r->h->gen,__ATOMIC_ACQUIRE);
+        __atomic_store_n(&r->h->tail,__atomic_load_n(&r->h->head,__ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* producer: 0 on success, -1 if full or too big */
+static inline int shm_ring_push(struct shm_ring *r,const void *p,size_t len){
+    uint32_t head=r->h->head;
+    uint32_t tail=__atomic_load_n(&r->h->tail,__ATOMIC_ACQUIRE);
+    if(head-tail>r->mask || len>r->slot_sz-2) return -1;
+    uint8_t *s=r->slot+(size_t)(head&r->mask)*r->slot_sz;
+    uint16_t l=(uint16_t)len; memcpy(s,&l,2); memcpy(s+2,p,len);
+    __atomic_store_n(&r->h->head,head+1,__ATOMIC_RELEASE);
+    return 0;
+}
+
+/* consumer: payload length, or -1 if empty */
+static inline int shm_ring_pop(struct shm_ring *r,void *out,size_t cap){
+    uint32_t g=__atomic_load_n(&r->h->gen,__ATOMIC_ACQUIRE);
+    if(g!=r->gen){                           /* producer restarted */
+        r->gen=g; __atomic_store_n(&r->h->tail,r->h->gen_head,__ATOMIC_RELEASE);
+    }
+    uint32_t tail=r->h->tail;
+    if(__atomic_load_n(&r->h->head,__ATOMIC_ACQUIRE)==tail) return -1;
+    const uint8_t *s=r->slot+(size_t)(tail&r->mask)*r->slot_sz;
+    uint16_t l; memcpy(&l,s,2); if(l>cap) l=(uint16_t)cap;
+    memcpy(out,s+2,l);
+    __atomic_store_n(&r->h->tail,tail+1,__ATOMIC_RELEASE);
+    return l;
+}
+
+#endif /* SHM_RING_H */
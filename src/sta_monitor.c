@@ -17,6 +17,10 @@
 #include <sys/time.h>
 #include <getopt.h>
 #include <glob.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #define MAX_STA   16
 #define MAC_LEN   18
@@ -46,7 +50,7 @@ static void reset_rx(RxInfo *r){ r->rssi_min=r->cnt_cck_fail=r->cnt_ofdm_fail=r-
     r->rssi_a=r->rssi_b=-1; strcpy(r->rx_rate,"NA"); }
 
 /* --------------- INI ------------------- */
-static int load_cfg(const char *file,char macs[][MAC_LEN],int *intv,char *out,size_t os,char *proc,size_t ps)
+static int load_cfg(const char *file,char macs[][MAC_LEN],int *intv,char *out,size_t os,char *proc,size_t ps,char *push,size_t us)
 {
     FILE *fp=fopen(file,"r"); if(!fp){perror(file);return-1;}
     char l[LINE_SZ]; int n=0;
@@ -58,6 +62,7 @@ static int load_cfg(const char *file,char macs[][MAC_LEN],int *intv,char *out,si
         else if(!strcmp(k,"output_file")||!strcmp(k,"output_path")) strncpy(out,v,os);
         else if(!strcmp(k,"interval_ms")||!strcmp(k,"interval")) *intv=atoi(v);
         else if(!strcmp(k,"proc_path")||!strcmp(k,"trx_debug_path")) strncpy(proc,v,ps);
+        else if(!strcmp(k,"push_to")) strncpy(push,v,us);
     }
     fclose(fp); return n;
 }
@@ -119,27 +124,60 @@ static int txpower(const char *ifc){
 }
 
 /* --------------- output ----------------- */
-static void write_out(const char *file,StaStats st[],int n,int tx,const RxInfo *rx,int active_idx)
+static int fmt_out(char *b,size_t bs,StaStats st[],int n,int tx,const RxInfo *rx,int active_idx)
 {
-    char tmp[256]; snprintf(tmp,sizeof tmp,"%s.tmp",file);
-    FILE *f=fopen(tmp,"w"); if(!f){ if(verbose)perror(tmp); return; }
-
+    int l=0;
     /* per-STA */
-    for(int i=0;i<n;++i){
-        fprintf(f,"sta%d_rssi=%d\nsta%d_mcs=%s\nsta%d_bw=%d\nsta%d_retry=%d\nsta%d_active=%d\n",
-                i,st[i].rssi,i,st[i].mcs,i,st[i].bw,i,st[i].retry,i,st[i].active);
-    }
+    for(int i=0;i<n && (size_t)l<bs;++i)
+        l+=snprintf(b+l,bs-l,"sta%d_rssi=%d\nsta%d_mcs=%s\nsta%d_bw=%d\nsta%d_retry=%d\nsta%d_active=%d\n",
+                    i,st[i].rssi,i,st[i].mcs,i,st[i].bw,i,st[i].retry,i,st[i].active);
     /* global */
-    fprintf(f,"active_sta=%d\nactive_sta_rssi=%d\n",active_idx,
-            active_idx>=0?st[active_idx].rssi:-1);
-    fprintf(f,"txpwr=%d\n"
+    if((size_t)l<bs) l+=snprintf(b+l,bs-l,"active_sta=%d\nactive_sta_rssi=%d\n",active_idx,
+                                 active_idx>=0?st[active_idx].rssi:-1);
+    if((size_t)l<bs) l+=snprintf(b+l,bs-l,"txpwr=%d\n"
               "rxinfo_rssi_min=%d\nrxinfo_cnt_cck_fail=%d\nrxinfo_cnt_ofdm_fail=%d\n"
               "rxinfo_false_alarm=%d\nrxinfo_rx_rate=%s\nrxinfo_rssi_a=%d\nrxinfo_rssi_b=%d\n",
             tx,rx->rssi_min,rx->cnt_cck_fail,rx->cnt_ofdm_fail,rx->false_alarm,
             rx->rx_rate,rx->rssi_a,rx->rssi_b);
+    return (size_t)l<bs?l:(int)bs-1;
+}
+static void write_out(const char *file,const char *b,int len)
+{
+    char tmp[256]; snprintf(tmp,sizeof tmp,"%s.tmp",file);
+    FILE *f=fopen(tmp,"w"); if(!f){ if(verbose)perror(tmp); return; }
+    fwrite(b,1,len,f);
     fclose(f); rename(tmp,file);
 }
 
+/* --------------- push -------------------
+ * push_to = udp:IP:PORT | unix:/path  — the same text as the output file,
+ * one datagram per sample, so linkmgrd reacts without waiting on a poll. */
+static int push_fd=-1; static struct sockaddr_storage push_sa; static socklen_t push_len;
+
+static int push_open(const char *spec)
+{
+    memset(&push_sa,0,sizeof push_sa);
+    if(!strncmp(spec,"unix:",5)){
+        struct sockaddr_un *u=(struct sockaddr_un*)&push_sa; u->sun_family=AF_UNIX;
+        if(strlen(spec+5)>=sizeof u->sun_path) return -1;
+        strcpy(u->sun_path,spec+5); push_len=sizeof *u;
+        push_fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0);
+    }else if(!strncmp(spec,"udp:",4)){
+        struct sockaddr_in *a=(struct sockaddr_in*)&push_sa; a->sin_family=AF_INET;
+        char ip[64]; const char *c=strrchr(spec+4,':'); if(!c||c-(spec+4)>=(long)sizeof ip) return -1;
+        memcpy(ip,spec+4,c-(spec+4)); ip[c-(spec+4)]=0;
+        if(!inet_aton(ip,&a->sin_addr)) return -1;
+        a->sin_port=htons(atoi(c+1)); push_len=sizeof *a;
+        push_fd=socket(AF_INET,SOCK_DGRAM|SOCK_CLOEXEC,0);
+    }
+    return push_fd<0?-1:0;
+}
+static void push_out(const char *b,int len)
+{
+    if(push_fd>=0 && sendto(push_fd,b,len,MSG_DONTWAIT,(struct sockaddr*)&push_sa,push_len)<0 && verbose)
+        perror("push_to");                  /* receiver not up yet: the file still has it */
+}
+
 /* --------------- summary ---------------- */
 static void summary(const StaStats s[],int n,int tx,const RxInfo *rx,int active)
 {
@@ -152,7 +190,7 @@ static void summary(const StaStats s[],int n,int tx,const RxInfo *rx,int active)
 }
 
 /* ---------------- main ----------------- */
-static void usage(const char *p){ fprintf(stderr,"Usage: %s [-c conf] [-o out] [-i ms] [-p proc] [-d iface] [-v]\n",p); }
+static void usage(const char *p){ fprintf(stderr,"Usage: %s [-c conf] [-o out] [-i ms] [-p proc] [-d iface] [-u push_to] [-v]\n",p); }
 
 int main(int argc,char *argv[])
 {
@@ -161,18 +199,23 @@ int main(int argc,char *argv[])
     char proc[256]="/proc/net/rtl8733bu/wlan0/trx_info_debug";
     const char *iface="wlan0";
     int intv=200; char macs[MAX_STA][MAC_LEN]={{0}};
+    char push[256]="", push_cli[256]="";
 
     static const struct option lo[]={{"verbose",0,0,'v'},{0}};
-    int o,i; while((o=getopt_long(argc,argv,"c:o:i:p:d:vh",lo,&i))!=-1){
+    int o,i; while((o=getopt_long(argc,argv,"c:o:i:p:d:u:vh",lo,&i))!=-1){
         if(o=='c')cfg=optarg; else if(o=='o')strncpy(out,optarg,sizeof out);
         else if(o=='i')intv=atoi(optarg); else if(o=='p')strncpy(proc,optarg,sizeof proc);
-        else if(o=='d')iface=optarg; else if(o=='v')verbose=true; else{ usage(argv[0]); return 1; }
+        else if(o=='d')iface=optarg; else if(o=='u')strncpy(push_cli,optarg,sizeof push_cli-1);
+        else if(o=='v')verbose=true; else{ usage(argv[0]); return 1; }
     }
 
     int n = load_cfg(cfg, macs, &intv,
                      out, sizeof out,
-                     proc, sizeof proc);          /* <-- proc may contain '*' */
+                     proc, sizeof proc,           /* <-- proc may contain '*' */
+                     push, sizeof push - 1);
     if (n <= 0) { fprintf(stderr, "No STA MACs\n"); return 1; }
+    if (*push_cli) strcpy(push, push_cli);
+    if (*push && push_open(push) < 0) fprintf(stderr, "[WARN] push_to '%s' unusable\n", push);
 
     /* ---------- NEW: expand any wildcard in proc ---------------------- */
     {
@@ -199,7 +242,9 @@ int main(int argc,char *argv[])
         if(active>=0) st[active].active=1;
 
         int tx=txpower(iface);
-        write_out(out,st,n,tx,&rx,active);
+        char buf[4096]; int len=fmt_out(buf,sizeof buf,st,n,tx,&rx,active);
+        write_out(out,buf,len);
+        push_out(buf,len);
 
         if(verbose){
             struct timeval now; gettimeofday(&now,NULL);
@@ -1,4 +1,4 @@
-/* trafficctrl.c — single-stream MCS0–7 traffic shaper with tiny HTTP API
+/* trafficctrl.c — multi-link HT/VHT airtime-model traffic shaper with tiny HTTP API
  * Build:  gcc -O2 -Wall -Wextra -o trafficctrl trafficctrl.c
  * 2025-08-17  v1.0  — Single loop, file-telemetry, HTB updater, /api/v1/*
  */
@@ -10,25 +10,46 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <libgen.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/gen_stats.h>
 
 #define MAX_LINE         1024
-#define RES_BUFSZ        131072
+#define RES_BUFSZ        4096          /* http_send(); larger replies stream via jw_t */
 #define REQ_BUFSZ        131072
-#define MAX_CLIENTS      16
+#define MAX_CLIENTS      64            /* hard cap; http_max_clients applies below it */
+#define OUT_MAX          (4u<<20)      /* pending reply bytes before a client is dropped */
+#define OUT_HIWAT        (256u<<10)    /* stop parsing pipelined requests above this */
 #define MAX_KEYS         4096
 #define MAX_NAME         128
 #define MAX_PATH         512
+#define MAX_SHAPERS      4             /* [general] + [link1]..[link3] */
+#define MAX_CLASSES      16
 
 /* ---- time ---- */
 static inline uint64_t now_ms(void){
@@ -74,6 +95,7 @@ static int ini_load(const char *path, kv_t *arr, int maxn, int *out_n){
   }
   fclose(f); return 0;
 }
+/* tmp + fsync + rename + directory fsync: a crash leaves the old or the new file */
 static int ini_save(const char *path, const char *tmp, kv_t *arr, int n){
   FILE *f=fopen(tmp,"w"); if(!f) return -1;
   const char *cur="";
@@ -84,8 +106,11 @@ static int ini_save(const char *path, const char *tmp, kv_t *arr, int n){
     }
     fprintf(f,"%s=%s\n", arr[i].key, arr[i].val);
   }
-  fclose(f);
-  if(rename(tmp,path)<0) return -1;
+  if(fflush(f)!=0 || fsync(fileno(f))<0){ fclose(f); unlink(tmp); return -1; }
+  if(fclose(f)!=0 || rename(tmp,path)<0){ unlink(tmp); return -1; }
+  char dir[MAX_PATH]; snprintf(dir,sizeof(dir),"%s",path);
+  int dfd=open(dirname(dir),O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if(dfd>=0){ fsync(dfd); close(dfd); }
   return 0;
 }
 static int ini_get(kv_t *arr,int n,const char *sect,const char *key,char *out,size_t outsz){
@@ -94,22 +119,123 @@ static int ini_get(kv_t *arr,int n,const char *sect,const char *key,char *out,si
   }
   errno=ENOENT; return -1;
 }
+/* ---- parsed config store ----
+ * One heap copy of the INI with an open-addressing hash on section.key.
+ * sorted[] holds the (section,key) order for /keys so the file order in kv[]
+ * is preserved. The file is re-read when its inode/size/mtime changes or
+ * ini_gen is bumped, except while API edits are pending: those live only
+ * here (dirty) until ini_flush() writes them behind, cfg_flush_ms later.
+ */
+typedef struct {
+  char path[MAX_PATH];
+  kv_t *kv; int *sorted; int n, cap;
+  int *hash; unsigned hcap;              /* kv index or -1, power of two */
+  ino_t ino; off_t size; struct timespec mtim; unsigned gen;
+  bool valid, dirty;
+  uint64_t dirty_ms;                     /* first unsaved edit */
+} ini_cache_t;
+static ini_cache_t icache;
+static unsigned ini_gen=1;
+
+static int cmp_kv_idx(const void *a,const void *b,void *arg){
+  const kv_t *kv=arg, *ka=&kv[*(const int*)a], *kb=&kv[*(const int*)b];
+  int s=strcmp(ka->section,kb->section); if(s) return s; return strcmp(ka->key,kb->key);
+}
+static uint32_t kv_hash(const char *sect, const char *key){
+  uint32_t h=2166136261u;                /* FNV-1a over "sect.key" */
+  for(const unsigned char *p=(const unsigned char*)sect; *p; p++) h=(h^*p)*16777619u;
+  h=(h^'.')*16777619u;
+  for(const unsigned char *p=(const unsigned char*)key; *p; p++) h=(h^*p)*16777619u;
+  return h;
+}
+/* rebuild hash and sorted[] after a load or an insert */
+static int ini_index(ini_cache_t *ic){
+  unsigned hc=64; while(hc<(unsigned)ic->cap*2) hc*=2;
+  if(hc!=ic->hcap){ int *nh=realloc(ic->hash,sizeof(int)*hc); if(!nh) return -1; ic->hash=nh; ic->hcap=hc; }
+  memset(ic->hash,0xff,sizeof(int)*hc);
+  for(int i=0;i<ic->n;i++){               /* first of duplicate keys wins, as ini_get() */
+    uint32_t m=ic->hcap-1, h=kv_hash(ic->kv[i].section,ic->kv[i].key)&m;
+    while(ic->hash[h]>=0) h=(h+1)&m;
+    ic->hash[h]=i;
+  }
+  int *ns=realloc(ic->sorted,sizeof(int)*ic->cap); if(!ns) return -1;
+  ic->sorted=ns;
+  for(int i=0;i<ic->n;i++) ic->sorted[i]=i;
+  qsort_r(ic->sorted,ic->n,sizeof(int),cmp_kv_idx,ic->kv);
+  return 0;
+}
+static int ini_find(const ini_cache_t *ic, const char *sect, const char *key){
+  if(!ic->hcap) return -1;
+  uint32_t m=ic->hcap-1, h=kv_hash(sect,key)&m;
+  for(int i; (i=ic->hash[h])>=0; h=(h+1)&m)
+    if(strcmp(ic->kv[i].key,key)==0 && strcmp(ic->kv[i].section,sect)==0) return i;
+  return -1;
+}
+/* ini_get() on the store; an empty section still means "any section" */
+static int ini_cget(const ini_cache_t *ic, const char *sect, const char *key, char *out, size_t outsz){
+  if(!sect[0]) return ini_get(ic->kv,ic->n,sect,key,out,outsz);
+  int i=ini_find(ic,sect,key);
+  if(i<0){ errno=ENOENT; return -1; }
+  snprintf(out,outsz,"%s",ic->kv[i].val); return 0;
+}
+static ini_cache_t *ini_cached(const char *path){
+  ini_cache_t *ic=&icache; struct stat st;
+  bool same=ic->valid && strcmp(ic->path,path)==0;
+  if(same && ic->dirty) return ic;       /* unsaved edits win over the file */
+  if(stat(path,&st)<0) return NULL;
+  if(same && ic->gen==ini_gen && ic->ino==st.st_ino && ic->size==st.st_size &&
+     ic->mtim.tv_sec==st.st_mtim.tv_sec && ic->mtim.tv_nsec==st.st_mtim.tv_nsec) return ic;
+  ic->valid=ic->dirty=false;
+  if(!ic->cap){ ic->cap=64; ic->kv=malloc(sizeof(kv_t)*ic->cap); if(!ic->kv){ ic->cap=0; return NULL; } }
+  for(;;){
+    if(ini_load(path,ic->kv,ic->cap,&ic->n)<0) return NULL;
+    if(ic->n<ic->cap || ic->cap>=MAX_KEYS) break;
+    kv_t *nk=realloc(ic->kv,sizeof(kv_t)*ic->cap*2); if(!nk) break;
+    ic->kv=nk; ic->cap*=2;
+  }
+  if(ini_index(ic)<0) return NULL;
+  snprintf(ic->path,sizeof(ic->path),"%s",path);
+  ic->ino=st.st_ino; ic->size=st.st_size; ic->mtim=st.st_mtim; ic->gen=ini_gen;
+  ic->valid=true;
+  return ic;
+}
+/* write pending edits; the new file's stat keeps the store from re-reading it */
+static int ini_flush(void){
+  ini_cache_t *ic=&icache;
+  if(!ic->valid || !ic->dirty) return 0;
+  char tmp[MAX_PATH]; snprintf(tmp,sizeof(tmp), "%s.tmp", ic->path);
+  if(ini_save(ic->path,tmp,ic->kv,ic->n)<0){ logln("config: save %s: %s", ic->path, strerror(errno)); return -1; }
+  struct stat st;
+  if(stat(ic->path,&st)==0){ ic->ino=st.st_ino; ic->size=st.st_size; ic->mtim=st.st_mtim; }
+  ic->dirty=false;
+  return 0;
+}
+/* in-memory edit; persisted by ini_flush() */
 static int ini_set(const char *path,const char *sect,const char *key,const char *val){
-  kv_t arr[MAX_KEYS]; int n=0; if(ini_load(path,arr,MAX_KEYS,&n)<0) return -1;
-  for(int i=0;i<n;i++){
-    if(strcmp(arr[i].section,sect)==0 && strcmp(arr[i].key,key)==0){
-      snprintf(arr[i].val,sizeof(arr[i].val),"%s",val);
-      char tmp[MAX_PATH]; snprintf(tmp,sizeof(tmp), "%s.tmp", path);
-      return ini_save(path,tmp,arr,n);
+  ini_cache_t *ic=ini_cached(path); if(!ic) return -1;
+  int i=ini_find(ic,sect,key);
+  if(i>=0){
+    if(strcmp(ic->kv[i].val,val)==0) return 0;
+    snprintf(ic->kv[i].val,sizeof(ic->kv[i].val),"%s",val);
+  }else{
+    if(ic->n>=ic->cap){
+      kv_t *nk = ic->cap<MAX_KEYS? realloc(ic->kv,sizeof(kv_t)*ic->cap*2) : NULL;
+      if(!nk){ errno=ENOSPC; return -1; }
+      ic->kv=nk; ic->cap*=2;
     }
+    /* after the section's last key, so the saved file keeps one header per section */
+    int at=ic->n;
+    for(int k=ic->n-1;k>=0;k--) if(strcmp(ic->kv[k].section,sect)==0){ at=k+1; break; }
+    memmove(&ic->kv[at+1],&ic->kv[at],sizeof(kv_t)*(size_t)(ic->n-at));
+    kv_t *e=&ic->kv[at];
+    snprintf(e->section,sizeof(e->section),"%s",sect);
+    snprintf(e->key,sizeof(e->key),"%s",key);
+    snprintf(e->val,sizeof(e->val),"%s",val);
+    ic->n++;
+    if(ini_index(ic)<0) return -1;
   }
-  if(n>=MAX_KEYS){ errno=ENOSPC; return -1; }
-  /* ensure section ordering minimal: append */
-  snprintf(arr[n].section,sizeof(arr[n].section),"%s",sect);
-  snprintf(arr[n].key,sizeof(arr[n].key),"%s",key);
-  snprintf(arr[n].val,sizeof(arr[n].val),"%s",val);
-  char tmp[MAX_PATH]; snprintf(tmp,sizeof(tmp), "%s.tmp", path);
-  return ini_save(path,tmp,arr,n+1);
+  if(!ic->dirty){ ic->dirty=true; ic->dirty_ms=now_ms(); }
+  return 0;
 }
 
 /* ---- URL/query ---- */
@@ -139,6 +265,17 @@ static int query_get(const char *q,const char *name,char *out,size_t outsz){
 static int query_get_int(const char *q,const char *name,int dflt){ char b[64]; return query_get(q,name,b,sizeof(b))? atoi(b):dflt; }
 
 /* ---- cfg ---- */
+/* one HTB leaf under 1:99; [class.NAME] in the INI */
+typedef struct {
+  char name[32];
+  uint32_t minor;              /* classid 1:minor (hex, as tc) */
+  int weight;                  /* share of spare capacity, 0 = floor only */
+  int floor_kbps, min_floor_kbps, ceil_kbps_max;
+  int prio, mark;              /* mark<0: no fw filter */
+  char qdisc[16];              /* leaf qdisc, pfifo if it cannot be created */
+  bool off;                    /* enable=0 drops a built-in class */
+} tclass_t;
+
 typedef struct {
   char cfg_path[MAX_PATH];
   char http_addr[128];
@@ -154,18 +291,117 @@ typedef struct {
   int headroom_pct;
   int stale_ms;
   double eff_10, eff_20, eff_40;
-  /* marks */
-  int mark_video, mark_mavlink, mark_tunnel;
-  /* floors/ceils */
-  int video_floor_kbps, video_ceil_max_kbps;
-  int mav_floor_kbps,   mav_min_floor_kbps, mav_ceil_max_kbps;
-  int tun_floor_kbps,   tun_ceil_max_kbps;
-  int def_floor_kbps,   def_ceil_max_kbps;
-  int ceil_margin_pct;
+  /* capacity model: "airtime" (default) or "static" (eff_* only) */
+  char cap_model[16];
+  char key_retry[32];          /* retry ratio key in telemetry (0..1 or %) */
+  int  nss, sgi, vht, ampdu;   /* defaults when telemetry omits them */
+  int  mpdu_bytes;             /* typical IP packet size on the link */
+  double learn_alpha;          /* online correction EWMA, 0 = off */
+  double corr_min, corr_max;
+  /* class tree */
+  tclass_t cls[MAX_CLASSES]; int ncls;
+  int cls_video, cls_default;  /* indexes, -1 if absent */
+  int fill[MAX_CLASSES], nfill;/* weighted classes by (ceil-floor)/weight */
   /* http */
   int http_max_clients;
+  int http_idle_ms;            /* keep-alive idle timeout */
+  int http_sse_max_hz;         /* /events push rate cap, 0 = every change */
+  /* tc backend: "netlink" (default) or "shell" */
+  char tc_backend[16];
+  /* event-driven telemetry */
+  int  telem_watch;            /* inotify on telem_file */
+  int  cfg_flush_ms;           /* write-behind delay for API edits */
+  char tick_log[MAX_PATH];     /* per-tick ring file for --replay, empty = off */
+  int  tick_log_records;
+  char telem_listen[MAX_PATH]; /* "udp:IP:PORT" | "unix:/path" | "" */
+  int  fast_down;              /* pushed drops skip hold/dwell */
+  /* queue feedback (AIMD on alloc_kbps) */
+  int  fb_enable;
+  int  fb_target_ms;           /* max tolerated queueing delay */
+  double fb_md, fb_ai;         /* multiplicative decrease / additive increase */
+  double fb_min, fb_max;       /* scale bounds */
+  /* encoder bitrate hook */
+  int  enc_enable;
+  char enc_target[MAX_PATH];   /* "http://HOST[:PORT]/PATH?..%d.." | "udp:IP:PORT" */
+  char enc_fmt[128];           /* udp payload, %d = kbps */
+  int  enc_fec_k, enc_fec_n;   /* FEC k/n on the video stream */
+  int  enc_dup;                /* copies per packet (rtp_split --batch) */
+  int  enc_margin_pct;
+  int  enc_min_kbps, enc_max_kbps;
+  int  enc_hyst_pct;
+  int  enc_down_ms, enc_up_ms; /* min gap before a lower / higher push */
 } config_t;
 
+/* built-in tree; [class.NAME] sections override these or add classes */
+static const tclass_t cls_builtin[]={
+  {"video",   0x1,   8, 2000,   0, 120000, 2,  1, "fq_codel", false},
+  {"mavlink", 0x10,  1,  300, 150,   2000, 1, 10, "fq_codel", false},
+  {"tunnel",  0x20,  1,  200,   0,   3000, 3, 20, "fq_codel", false},
+  {"default", 0x100, 0,    5,   0,    500, 4, -1, "pfifo", false},
+};
+static tclass_t *cls_get(config_t *c, const char *name){
+  for(int i=0;i<c->ncls;i++) if(strcmp(c->cls[i].name,name)==0) return &c->cls[i];
+  if(c->ncls>=MAX_CLASSES) return NULL;
+  tclass_t *k=&c->cls[c->ncls++]; memset(k,0,sizeof(*k));
+  snprintf(k->name,sizeof(k->name),"%s",name);
+  k->weight=1; k->floor_kbps=100; k->ceil_kbps_max=100000; k->prio=3; k->mark=-1;
+  snprintf(k->qdisc,sizeof(k->qdisc),"fq_codel");
+  return k;
+}
+static void cfg_load_classes(config_t *c, kv_t *arr, int n){
+  c->ncls=0;
+  for(size_t i=0;i<sizeof(cls_builtin)/sizeof(cls_builtin[0]);i++) c->cls[c->ncls++]=cls_builtin[i];
+  for(int i=0;i<n;i++){
+    if(strncmp(arr[i].section,"class.",6)!=0) continue;
+    tclass_t *k=cls_get(c,arr[i].section+6); if(!k) continue;
+    const char *key=arr[i].key, *v=arr[i].val;
+    if(strcmp(key,"classid")==0){ const char *m=strchr(v,':'); k->minor=(uint32_t)strtoul(m? m+1:v,NULL,16); }
+    else if(strcmp(key,"weight")==0) k->weight=atoi(v);
+    else if(strcmp(key,"floor_kbps")==0) k->floor_kbps=atoi(v);
+    else if(strcmp(key,"min_floor_kbps")==0) k->min_floor_kbps=atoi(v);
+    else if(strcmp(key,"ceil_kbps_max")==0) k->ceil_kbps_max=atoi(v);
+    else if(strcmp(key,"prio")==0) k->prio=atoi(v);
+    else if(strcmp(key,"mark")==0) k->mark=atoi(v);
+    else if(strcmp(key,"qdisc")==0) snprintf(k->qdisc,sizeof(k->qdisc),"%s",v);
+    else if(strcmp(key,"enable")==0) k->off=atoi(v)==0;
+  }
+  int m=0;
+  for(int i=0;i<c->ncls;i++) if(!c->cls[i].off) c->cls[m++]=c->cls[i];
+  c->ncls=m;
+  /* new classes without a classid get 1:30, 1:40, ... */
+  uint32_t next=0x30;
+  for(int i=0;i<c->ncls;i++){
+    tclass_t *k=&c->cls[i];
+    bool clash=false;
+    for(int j=0;j<c->ncls;j++) if(j!=i && c->cls[j].minor==k->minor) clash=true;
+    if(k->minor && k->minor!=0x99 && k->minor<0x10000 && !clash) continue;
+    for(bool used=true; used; next+=0x10){
+      used=next==0x99 || next==0x100;
+      for(int j=0;j<c->ncls;j++) if(c->cls[j].minor==next) used=true;
+      if(!used) k->minor=next;
+    }
+  }
+  c->cls_video=c->cls_default=-1;
+  for(int i=0;i<c->ncls;i++){
+    if(c->cls[i].ceil_kbps_max<c->cls[i].floor_kbps) c->cls[i].ceil_kbps_max=c->cls[i].floor_kbps;
+    if(strcmp(c->cls[i].name,"video")==0) c->cls_video=i;
+    if(strcmp(c->cls[i].name,"default")==0) c->cls_default=i;
+  }
+  /* fill order for allocate(): a class saturates once the water level
+   * reaches (ceil-floor)/weight, which does not depend on the budget */
+  c->nfill=0;
+  for(int i=0;i<c->ncls;i++){
+    const tclass_t *k=&c->cls[i];
+    if(k->weight<=0) continue;
+    int p=c->nfill++;
+    while(p>0){
+      const tclass_t *q=&c->cls[c->fill[p-1]];
+      if((int64_t)(q->ceil_kbps_max-q->floor_kbps)*k->weight <= (int64_t)(k->ceil_kbps_max-k->floor_kbps)*q->weight) break;
+      c->fill[p]=c->fill[p-1]; p--;
+    }
+    c->fill[p]=i;
+  }
+}
 static void cfg_defaults(config_t *c){
   snprintf(c->cfg_path,sizeof(c->cfg_path), "/etc/trafficctrl.conf");
   snprintf(c->http_addr,sizeof(c->http_addr), "0.0.0.0:8084");
@@ -174,127 +410,309 @@ static void cfg_defaults(config_t *c){
   snprintf(c->key_mcs,sizeof(c->key_mcs), "mcs");
   snprintf(c->key_width,sizeof(c->key_width), "width");
   c->sample_hz=10; c->alpha=0.5; c->hysteresis_pct=15; c->hysteresis_hold_ms=800; c->min_dwell_ms=800;
-  c->headroom_pct=20; c->stale_ms=2500; c->ceil_margin_pct=15;
+  c->headroom_pct=20; c->stale_ms=2500;
   c->eff_10=0.55; c->eff_20=0.60; c->eff_40=0.58;
-  c->mark_video=1; c->mark_mavlink=10; c->mark_tunnel=20;
-  c->video_floor_kbps=2000; c->video_ceil_max_kbps=120000;
-  c->mav_floor_kbps=300; c->mav_min_floor_kbps=150; c->mav_ceil_max_kbps=2000;
-  c->tun_floor_kbps=200; c->tun_ceil_max_kbps=3000;
-  c->def_floor_kbps=5;   c->def_ceil_max_kbps=500;
-  c->http_max_clients=16;
+  snprintf(c->cap_model,sizeof(c->cap_model), "airtime");
+  snprintf(c->key_retry,sizeof(c->key_retry), "retry");
+  c->nss=1; c->sgi=0; c->vht=0; c->ampdu=8; c->mpdu_bytes=1400;
+  c->learn_alpha=0.05; c->corr_min=0.5; c->corr_max=1.1;
+  cfg_load_classes(c,NULL,0);
+  c->http_max_clients=16; c->http_idle_ms=30000; c->http_sse_max_hz=10;
+  snprintf(c->tc_backend,sizeof(c->tc_backend), "netlink");
+  c->telem_watch=1; c->telem_listen[0]=0; c->fast_down=1; c->cfg_flush_ms=1000;
+  c->tick_log[0]=0; c->tick_log_records=6000;
+  c->fb_enable=1; c->fb_target_ms=20; c->fb_md=0.85; c->fb_ai=0.02; c->fb_min=0.4; c->fb_max=1.0;
+  c->enc_enable=0;
+  snprintf(c->enc_target,sizeof(c->enc_target), "http://127.0.0.1/api/v1/set?video0.bitrate=%%d");
+  snprintf(c->enc_fmt,sizeof(c->enc_fmt), "bitrate=%%d");
+  c->enc_fec_k=1; c->enc_fec_n=1; c->enc_dup=1; c->enc_margin_pct=10;
+  c->enc_min_kbps=1024; c->enc_max_kbps=20480; c->enc_hyst_pct=10;
+  c->enc_down_ms=200; c->enc_up_ms=3000;
 }
 static int cfg_load(config_t *c, const char *path){
-  kv_t arr[MAX_KEYS]; int n=0; if(ini_load(path,arr,MAX_KEYS,&n)<0) return -1;
-  snprintf(c->cfg_path,sizeof(c->cfg_path), "%s", path);
+  ini_cache_t *ic=ini_cached(path); if(!ic) return -1;
+  if(path!=c->cfg_path) snprintf(c->cfg_path,sizeof(c->cfg_path), "%s", path);
   char v[256];
-  if(!ini_get(arr,n,"general","http_addr",v,sizeof(v))) snprintf(c->http_addr,sizeof(c->http_addr),"%s",v);
-  if(!ini_get(arr,n,"general","wlan",v,sizeof(v))) snprintf(c->wlan,sizeof(c->wlan),"%s",v);
-  if(!ini_get(arr,n,"general","telem_file",v,sizeof(v))) snprintf(c->telem_file,sizeof(c->telem_file),"%s",v);
-  if(!ini_get(arr,n,"general","telem_key_mcs",v,sizeof(v))) snprintf(c->key_mcs,sizeof(c->key_mcs),"%s",v);
-  if(!ini_get(arr,n,"general","telem_key_width",v,sizeof(v))) snprintf(c->key_width,sizeof(c->key_width),"%s",v);
-  if(!ini_get(arr,n,"general","sample_hz",v,sizeof(v))) c->sample_hz=atoi(v);
-  if(!ini_get(arr,n,"general","smoothing_alpha",v,sizeof(v))) c->alpha=strtod(v,NULL);
-  if(!ini_get(arr,n,"general","hysteresis_pct",v,sizeof(v))) c->hysteresis_pct=atoi(v);
-  if(!ini_get(arr,n,"general","hysteresis_hold_ms",v,sizeof(v))) c->hysteresis_hold_ms=atoi(v);
-  if(!ini_get(arr,n,"general","min_dwell_ms",v,sizeof(v))) c->min_dwell_ms=atoi(v);
-  if(!ini_get(arr,n,"general","headroom_pct",v,sizeof(v))) c->headroom_pct=atoi(v);
-  if(!ini_get(arr,n,"general","stale_ms",v,sizeof(v))) c->stale_ms=atoi(v);
-  if(!ini_get(arr,n,"general","ceil_margin_pct",v,sizeof(v))) c->ceil_margin_pct=atoi(v);
-  if(!ini_get(arr,n,"general","eff_10mhz",v,sizeof(v))) c->eff_10=strtod(v,NULL);
-  if(!ini_get(arr,n,"general","eff_20mhz",v,sizeof(v))) c->eff_20=strtod(v,NULL);
-  if(!ini_get(arr,n,"general","eff_40mhz",v,sizeof(v))) c->eff_40=strtod(v,NULL);
-  if(!ini_get(arr,n,"class.video","mark",v,sizeof(v))) c->mark_video=atoi(v);
-  if(!ini_get(arr,n,"class.video","floor_kbps",v,sizeof(v))) c->video_floor_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.video","ceil_kbps_max",v,sizeof(v))) c->video_ceil_max_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.mavlink","mark",v,sizeof(v))) c->mark_mavlink=atoi(v);
-  if(!ini_get(arr,n,"class.mavlink","floor_kbps",v,sizeof(v))) c->mav_floor_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.mavlink","min_floor_kbps",v,sizeof(v))) c->mav_min_floor_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.mavlink","ceil_kbps_max",v,sizeof(v))) c->mav_ceil_max_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.tunnel","mark",v,sizeof(v))) c->mark_tunnel=atoi(v);
-  if(!ini_get(arr,n,"class.tunnel","floor_kbps",v,sizeof(v))) c->tun_floor_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.tunnel","ceil_kbps_max",v,sizeof(v))) c->tun_ceil_max_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.default","floor_kbps",v,sizeof(v))) c->def_floor_kbps=atoi(v);
-  if(!ini_get(arr,n,"class.default","ceil_kbps_max",v,sizeof(v))) c->def_ceil_max_kbps=atoi(v);
-  if(!ini_get(arr,n,"general","http_max_clients",v,sizeof(v))) c->http_max_clients=atoi(v);
+  if(!ini_cget(ic,"general","http_addr",v,sizeof(v))) snprintf(c->http_addr,sizeof(c->http_addr),"%s",v);
+  if(!ini_cget(ic,"general","wlan",v,sizeof(v))) snprintf(c->wlan,sizeof(c->wlan),"%s",v);
+  if(!ini_cget(ic,"general","telem_file",v,sizeof(v))) snprintf(c->telem_file,sizeof(c->telem_file),"%s",v);
+  if(!ini_cget(ic,"general","telem_key_mcs",v,sizeof(v))) snprintf(c->key_mcs,sizeof(c->key_mcs),"%s",v);
+  if(!ini_cget(ic,"general","telem_key_width",v,sizeof(v))) snprintf(c->key_width,sizeof(c->key_width),"%s",v);
+  if(!ini_cget(ic,"general","sample_hz",v,sizeof(v))) c->sample_hz=atoi(v);
+  if(!ini_cget(ic,"general","smoothing_alpha",v,sizeof(v))) c->alpha=strtod(v,NULL);
+  if(!ini_cget(ic,"general","hysteresis_pct",v,sizeof(v))) c->hysteresis_pct=atoi(v);
+  if(!ini_cget(ic,"general","hysteresis_hold_ms",v,sizeof(v))) c->hysteresis_hold_ms=atoi(v);
+  if(!ini_cget(ic,"general","min_dwell_ms",v,sizeof(v))) c->min_dwell_ms=atoi(v);
+  if(!ini_cget(ic,"general","headroom_pct",v,sizeof(v))) c->headroom_pct=atoi(v);
+  if(!ini_cget(ic,"general","stale_ms",v,sizeof(v))) c->stale_ms=atoi(v);
+  if(!ini_cget(ic,"general","eff_10mhz",v,sizeof(v))) c->eff_10=strtod(v,NULL);
+  if(!ini_cget(ic,"general","eff_20mhz",v,sizeof(v))) c->eff_20=strtod(v,NULL);
+  if(!ini_cget(ic,"general","eff_40mhz",v,sizeof(v))) c->eff_40=strtod(v,NULL);
+  if(!ini_cget(ic,"general","telem_key_retry",v,sizeof(v))) snprintf(c->key_retry,sizeof(c->key_retry),"%s",v);
+  if(!ini_cget(ic,"capacity","model",v,sizeof(v))) snprintf(c->cap_model,sizeof(c->cap_model),"%s",v);
+  if(!ini_cget(ic,"capacity","nss",v,sizeof(v))) c->nss=atoi(v);
+  if(!ini_cget(ic,"capacity","sgi",v,sizeof(v))) c->sgi=atoi(v);
+  if(!ini_cget(ic,"capacity","vht",v,sizeof(v))) c->vht=atoi(v);
+  if(!ini_cget(ic,"capacity","ampdu",v,sizeof(v))) c->ampdu=atoi(v);
+  if(!ini_cget(ic,"capacity","mpdu_bytes",v,sizeof(v))) c->mpdu_bytes=atoi(v);
+  if(!ini_cget(ic,"capacity","learn_alpha",v,sizeof(v))) c->learn_alpha=strtod(v,NULL);
+  if(!ini_cget(ic,"capacity","corr_min",v,sizeof(v))) c->corr_min=strtod(v,NULL);
+  if(!ini_cget(ic,"capacity","corr_max",v,sizeof(v))) c->corr_max=strtod(v,NULL);
+  cfg_load_classes(c,ic->kv,ic->n);
+  if(!ini_cget(ic,"general","http_max_clients",v,sizeof(v))) c->http_max_clients=atoi(v);
+  if(!ini_cget(ic,"general","http_idle_ms",v,sizeof(v))) c->http_idle_ms=atoi(v);
+  if(!ini_cget(ic,"general","http_sse_max_hz",v,sizeof(v))) c->http_sse_max_hz=atoi(v);
+  if(!ini_cget(ic,"general","tc_backend",v,sizeof(v))) snprintf(c->tc_backend,sizeof(c->tc_backend),"%s",v);
+  if(!ini_cget(ic,"general","telem_watch",v,sizeof(v))) c->telem_watch=atoi(v);
+  if(!ini_cget(ic,"general","cfg_flush_ms",v,sizeof(v))) c->cfg_flush_ms=atoi(v);
+  if(!ini_cget(ic,"general","tick_log",v,sizeof(v))) snprintf(c->tick_log,sizeof(c->tick_log),"%s",v);
+  if(!ini_cget(ic,"general","tick_log_records",v,sizeof(v))) c->tick_log_records=atoi(v);
+  if(!ini_cget(ic,"general","telem_listen",v,sizeof(v))) snprintf(c->telem_listen,sizeof(c->telem_listen),"%s",v);
+  if(!ini_cget(ic,"general","fast_down",v,sizeof(v))) c->fast_down=atoi(v);
+  if(!ini_cget(ic,"feedback","enable",v,sizeof(v))) c->fb_enable=atoi(v);
+  if(!ini_cget(ic,"feedback","target_ms",v,sizeof(v))) c->fb_target_ms=atoi(v);
+  if(!ini_cget(ic,"feedback","md",v,sizeof(v))) c->fb_md=strtod(v,NULL);
+  if(!ini_cget(ic,"feedback","ai",v,sizeof(v))) c->fb_ai=strtod(v,NULL);
+  if(!ini_cget(ic,"feedback","min_scale",v,sizeof(v))) c->fb_min=strtod(v,NULL);
+  if(!ini_cget(ic,"feedback","max_scale",v,sizeof(v))) c->fb_max=strtod(v,NULL);
+  if(!ini_cget(ic,"encoder","enable",v,sizeof(v))) c->enc_enable=atoi(v);
+  if(!ini_cget(ic,"encoder","target",v,sizeof(v))) snprintf(c->enc_target,sizeof(c->enc_target),"%s",v);
+  if(!ini_cget(ic,"encoder","udp_fmt",v,sizeof(v))) snprintf(c->enc_fmt,sizeof(c->enc_fmt),"%s",v);
+  if(!ini_cget(ic,"encoder","fec_k",v,sizeof(v))) c->enc_fec_k=atoi(v);
+  if(!ini_cget(ic,"encoder","fec_n",v,sizeof(v))) c->enc_fec_n=atoi(v);
+  if(!ini_cget(ic,"encoder","dup",v,sizeof(v))) c->enc_dup=atoi(v);
+  if(!ini_cget(ic,"encoder","margin_pct",v,sizeof(v))) c->enc_margin_pct=atoi(v);
+  if(!ini_cget(ic,"encoder","min_kbps",v,sizeof(v))) c->enc_min_kbps=atoi(v);
+  if(!ini_cget(ic,"encoder","max_kbps",v,sizeof(v))) c->enc_max_kbps=atoi(v);
+  if(!ini_cget(ic,"encoder","hysteresis_pct",v,sizeof(v))) c->enc_hyst_pct=atoi(v);
+  if(!ini_cget(ic,"encoder","down_interval_ms",v,sizeof(v))) c->enc_down_ms=atoi(v);
+  if(!ini_cget(ic,"encoder","up_interval_ms",v,sizeof(v))) c->enc_up_ms=atoi(v);
   return 0;
 }
 
 /* ---- telemetry ---- */
-typedef struct { int mcs; int width; uint64_t ts_ms; bool valid; } telem_t;
+/* one link sample; mcs/width are required, the rest fall back to [capacity] */
+typedef struct { int mcs, width, nss, sgi, vht, ampdu; double retry; } link_t;
 
+static bool link_same(const link_t *a, const link_t *b){
+  return a->mcs==b->mcs && a->width==b->width && a->nss==b->nss && a->sgi==b->sgi &&
+         a->vht==b->vht && a->ampdu==b->ampdu && a->retry==b->retry;
+}
+static void link_init(const config_t *c, link_t *l){
+  l->mcs=-1; l->width=-1; l->nss=c->nss; l->sgi=c->sgi; l->vht=c->vht; l->ampdu=c->ampdu; l->retry=-1;
+}
 /* simple key=value reader */
-static int read_telem_file(const char *path, const char *kmcs, const char *kw, int *out_mcs, int *out_w){
-  FILE *f=fopen(path,"r"); if(!f) return -1;
-  char line[256]; int m=-1, w=-1;
-  while(fgets(line,sizeof(line),f)){
-    char *s=trim(line); if(!*s || *s=='#' || *s==';') continue;
-    char *eq=strchr(s,'='); if(!eq) continue; *eq=0;
-    char *k=trim(s), *v=trim(eq+1);
-    if(strcmp(k,kmcs)==0) m=atoi(v);
-    else if(strcmp(k,kw)==0) w=atoi(v);
-  }
+static void telem_line(char *line, const config_t *c, link_t *l){
+  char *s=trim(line); if(!*s || *s=='#' || *s==';') return;
+  char *eq=strchr(s,'='); if(!eq) return; *eq=0;
+  char *k=trim(s), *v=trim(eq+1);
+  if(strcmp(k,c->key_mcs)==0) l->mcs=atoi(v);
+  else if(strcmp(k,c->key_width)==0) l->width=atoi(v);
+  else if(strcmp(k,c->key_retry)==0){ l->retry=strtod(v,NULL); if(l->retry>1.0) l->retry/=100.0; }
+  else if(strcmp(k,"nss")==0) l->nss=atoi(v);
+  else if(strcmp(k,"sgi")==0) l->sgi=atoi(v);
+  else if(strcmp(k,"vht")==0) l->vht=atoi(v);
+  else if(strcmp(k,"ampdu")==0) l->ampdu=atoi(v);
+}
+static int read_telem_file(const config_t *c, link_t *out){
+  FILE *f=fopen(c->telem_file,"r"); if(!f) return -1;
+  char line[256]; link_t l; link_init(c,&l);
+  while(fgets(line,sizeof(line),f)) telem_line(line,c,&l);
   fclose(f);
-  if(m<0 || w<=0) { errno=EINVAL; return -1; }
-  *out_mcs=m; *out_w=w; return 0;
+  if(l.mcs<0 || l.width<=0) { errno=EINVAL; return -1; }
+  *out=l; return 0;
+}
+/* same format, one datagram = one sample ("mcs=5\nwidth=20\n") */
+static int parse_telem_buf(char *buf, const config_t *c, link_t *out){
+  link_t l; link_init(c,&l); char *save=NULL;
+  for(char *ln=strtok_r(buf,"\n",&save); ln; ln=strtok_r(NULL,"\n",&save)) telem_line(ln,c,&l);
+  if(l.mcs<0 || l.width<=0) { errno=EINVAL; return -1; }
+  *out=l; return 0;
+}
+
+/* ---- event-driven telemetry ----
+ * inotify on the file's directory (writers usually rename() into place, which
+ * replaces the inode) plus an optional datagram socket for pushed samples.
+ */
+typedef struct { int ino, sfd; char base[MAX_PATH]; } telem_src_t;
+
+static void telem_events_close(telem_src_t *t){
+  if(t->ino>=0) close(t->ino);
+  if(t->sfd>=0) close(t->sfd);
+  t->ino=t->sfd=-1;
 }
+static int telem_listen_open(const char *spec){
+  if(strncmp(spec,"unix:",5)==0){
+    struct sockaddr_un ua; memset(&ua,0,sizeof(ua)); ua.sun_family=AF_UNIX;
+    snprintf(ua.sun_path,sizeof(ua.sun_path),"%s",spec+5);
+    int fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0); if(fd<0) return -1;
+    unlink(ua.sun_path);
+    if(bind(fd,(struct sockaddr*)&ua,sizeof(ua))<0){ close(fd); return -1; }
+    return fd;
+  }
+  if(strncmp(spec,"udp:",4)==0){
+    const char *hp=spec+4, *colon=strrchr(hp,':'); if(!colon) return -1;
+    char ip[64]; size_t il=(size_t)(colon-hp); if(il>=sizeof(ip)) return -1;
+    memcpy(ip,hp,il); ip[il]=0;
+    struct sockaddr_in sa; memset(&sa,0,sizeof(sa)); sa.sin_family=AF_INET; sa.sin_port=htons(atoi(colon+1));
+    if(!il || inet_pton(AF_INET,ip,&sa.sin_addr)!=1) sa.sin_addr.s_addr=INADDR_ANY;
+    int fd=socket(AF_INET,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0); if(fd<0) return -1;
+    if(bind(fd,(struct sockaddr*)&sa,sizeof(sa))<0){ close(fd); return -1; }
+    return fd;
+  }
+  errno=EINVAL; return -1;
+}
+static void telem_events_open(telem_src_t *t, config_t *c){
+  telem_events_close(t);
+  if(c->telem_watch){
+    char dir[MAX_PATH], base[MAX_PATH];
+    snprintf(dir,sizeof(dir),"%s",c->telem_file); snprintf(base,sizeof(base),"%s",c->telem_file);
+    snprintf(t->base,sizeof(t->base),"%s",basename(base));
+    t->ino=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(t->ino>=0 && inotify_add_watch(t->ino, dirname(dir), IN_CLOSE_WRITE|IN_MOVED_TO)<0){
+      logln("inotify %s: %s (falling back to polling)", c->telem_file, strerror(errno));
+      close(t->ino); t->ino=-1;
+    }
+  }
+  if(c->telem_listen[0]){
+    t->sfd=telem_listen_open(c->telem_listen);
+    if(t->sfd<0) logln("telem_listen %s: %s", c->telem_listen, strerror(errno));
+  }
+}
+/* drain inotify; true if our file was (re)written */
+static bool telem_watch_fired(telem_src_t *t){
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool hit=false; ssize_t rd;
+  while((rd=read(t->ino,buf,sizeof(buf)))>0){
+    for(char *p=buf; p<buf+rd; ){
+      struct inotify_event *ev=(struct inotify_event*)p;
+      if(ev->len && strcmp(ev->name,t->base)==0) hit=true;
+      p+=sizeof(*ev)+ev->len;
+    }
+  }
+  return hit;
+}
+/* drain the socket, keep the newest valid sample */
+static bool telem_sock_read(telem_src_t *t, config_t *c, link_t *l){
+  char buf[512]; ssize_t rd; bool got=false;
+  while((rd=recv(t->sfd,buf,sizeof(buf)-1,0))>0){
+    buf[rd]=0;
+    if(parse_telem_buf(buf,c,l)==0) got=true;
+  }
+  return got;
+}
+
+/* ---- capacity & allocation ----
+ * PHY rate from the HT/VHT tables (1-stream 20 MHz long-GI rate, scaled by
+ * data subcarriers for wider channels, by NSS, and by 10/9 for short GI).
+ * HT MCS 8..31 encode the stream count; VHT takes MCS 0..9 plus nss.
+ * Efficiency is the airtime share of one A-MPDU exchange that carries payload:
+ *   t = DIFS + mean backoff + preamble + A-MPDU + SIFS + (Block)Ack
+ * times (1 - retry), times a per-link correction learnt from achieved
+ * throughput.
+ */
+static const double phy_20_1ss[10] = {6.5,13,19.5,26,39,52,58.5,65,78,86.7};
 
-/* ---- capacity & allocation ---- */
-static double phy_20[8] = {6.5,13,19.5,26,39,52,58.5,65};
-static double phy_40[8] = {13.5,27,40.5,54,81,108,121.5,135};
+static int link_nss(const link_t *l){
+  int nss = l->vht? l->nss : (l->mcs>=0? l->mcs/8+1 : 1);
+  return nss<1? 1 : nss>4? 4 : nss;
+}
 /* 10 MHz = half of 20 MHz */
-static double phy_for(int width,int mcs){
-  if(mcs<0) mcs=0; if(mcs>7) mcs=7;
-  if(width==40) return phy_40[mcs];
-  if(width==10) return phy_20[mcs]*0.5;
-  return phy_20[mcs];
+static double phy_for(const link_t *l){
+  int m=l->vht? l->mcs : l->mcs%8;
+  if(m<0) m=0; if(m>9) m=9; if(!l->vht && m>7) m=7;
+  double r=phy_20_1ss[m]*link_nss(l);
+  switch(l->width){
+    case 10:  r*=0.5; break;
+    case 40:  r*=108.0/52; break;
+    case 80:  r*=234.0/52; break;
+    case 160: r*=468.0/52; break;
+  }
+  return l->sgi? r*10.0/9.0 : r;
 }
-static double eff_for(config_t *c,int width){
-  if(width==40) return c->eff_40;
-  if(width==10) return c->eff_10;
-  return c->eff_20;
+static double airtime_eff(const config_t *c, const link_t *l, double phy_mbps){
+  double ts = l->width==10? 2.0 : 1.0;            /* half-clocked OFDM */
+  double slot=9*ts, sifs=16*ts, sym=(l->sgi? 3.6:4.0)*ts;
+  double difs=sifs+2*slot, backoff=15*slot/2;     /* CWmin 15, BE */
+  double pre=(32+4*link_nss(l)+(l->vht? 4:0))*ts; /* L-STF..HT/VHT-LTFs */
+  int n=l->ampdu<1? 1 : l->ampdu>64? 64 : l->ampdu;
+  int mpdu=c->mpdu_bytes+26+8+4;                  /* QoS hdr + LLC + FCS */
+  if(n>1) mpdu=(mpdu+4+3)&~3;                     /* delimiter + pad */
+  double bits=16+8.0*n*mpdu+6;                    /* SERVICE + tail */
+  double data=(double)(long)(bits/(phy_mbps*sym)+0.999)*sym;
+  double ack=sifs+(20+(n>1? 12:8))*ts;            /* BA / ACK at 24 Mb/s */
+  double t=difs+backoff+pre+data+ack;
+  double e=8.0*n*c->mpdu_bytes/t/phy_mbps;
+  if(l->retry>0) e*=1.0-(l->retry<0.95? l->retry:0.95);
+  return e;
+}
+static double eff_for(const config_t *c, const link_t *l, double phy_mbps, double corr){
+  if(strcmp(c->cap_model,"static")==0){
+    if(l->width==40) return c->eff_40;
+    if(l->width==10) return c->eff_10;
+    return c->eff_20;
+  }
+  return airtime_eff(c,l,phy_mbps)*corr;
 }
 typedef struct {
-  int rate_video, ceil_video;
-  int rate_mav,   ceil_mav;
-  int rate_tun,   ceil_tun;
-  int rate_def,   ceil_def;
+  int rate[MAX_CLASSES], ceil[MAX_CLASSES];  /* per config_t.cls[] */
+  int n;
   int alloc_total;
 } rates_t;
 
-static void allocate(config_t *cfg, int alloc_kbps, rates_t *r){
+static int rate_of(const rates_t *r, int i){ return i>=0 && i<r->n? r->rate[i] : 0; }
+
+/* Weighted max-min: every class gets its floor, the rest is shared by
+ * weight with each class capped at ceil_kbps_max. Classes saturate in the
+ * precomputed fill order, so one pass settles it. If the floors alone do
+ * not fit they are scaled down, but not below min_floor_kbps. Ceils let a
+ * class borrow up to ceil_kbps_max within the link (1:99 = alloc_total).
+ */
+static void allocate(const config_t *cfg, int alloc_kbps, rates_t *r){
   if(alloc_kbps<100) alloc_kbps=100;
-  int vfloor=cfg->video_floor_kbps;
-  int mfloor=cfg->mav_floor_kbps;
-  int tfloor=cfg->tun_floor_kbps;
-  int dfloor=cfg->def_floor_kbps;
-  int sumflo = vfloor+mfloor+tfloor+dfloor;
-  int vmarg_pct=cfg->ceil_margin_pct;
-  r->alloc_total=alloc_kbps;
+  int n=cfg->ncls;
+  r->n=n; r->alloc_total=alloc_kbps;
+  int64_t sumflo=0;
+  for(int i=0;i<n;i++) sumflo+=cfg->cls[i].floor_kbps;
 
   if(alloc_kbps < sumflo){
-    double scale = (double)alloc_kbps / (double)sumflo;
-    int nm = (int)(mfloor*scale);
-    if(nm < cfg->mav_min_floor_kbps) nm = cfg->mav_min_floor_kbps;
-    int nt = (int)(tfloor*scale);
-    int nd = (int)(dfloor*scale);
-    int nv = alloc_kbps - (nm+nt+nd);
-    if(nv<0) nv=0;
-    r->rate_mav=nm; r->rate_tun=nt; r->rate_def=nd; r->rate_video=nv;
+    int64_t sum=0, above=0;
+    for(int i=0;i<n;i++){
+      const tclass_t *k=&cfg->cls[i];
+      int v=(int)(k->floor_kbps*(int64_t)alloc_kbps/sumflo);
+      r->rate[i]=v<k->min_floor_kbps? k->min_floor_kbps : v;
+      sum+=r->rate[i]; above+=r->rate[i]-k->min_floor_kbps;
+    }
+    /* min floors pushed us over: take the excess from the others */
+    int64_t over=sum-alloc_kbps;
+    if(over>0 && above>0)
+      for(int i=0;i<n;i++){
+        int64_t a=r->rate[i]-cfg->cls[i].min_floor_kbps;
+        r->rate[i]-=(int)((a*over+above-1)/above);
+        if(r->rate[i]<cfg->cls[i].min_floor_kbps) r->rate[i]=cfg->cls[i].min_floor_kbps;
+      }
   } else {
-    int rem = alloc_kbps - (mfloor+tfloor+dfloor);
-    int vr = (rem>vfloor)? rem : vfloor;
-    r->rate_mav=mfloor; r->rate_tun=tfloor; r->rate_def=dfloor; r->rate_video=vr;
+    int64_t spare=alloc_kbps-sumflo, wsum=0;
+    for(int i=0;i<n;i++) r->rate[i]=cfg->cls[i].floor_kbps;
+    for(int f=0;f<cfg->nfill;f++) wsum+=cfg->cls[cfg->fill[f]].weight;
+    int f=0;
+    for(;f<cfg->nfill;f++){
+      const tclass_t *k=&cfg->cls[cfg->fill[f]];
+      int64_t room=k->ceil_kbps_max-k->floor_kbps;
+      if(room*wsum > spare*k->weight) break;  /* level stays below this cap */
+      r->rate[cfg->fill[f]]=k->ceil_kbps_max;
+      spare-=room; wsum-=k->weight;
+    }
+    for(;f<cfg->nfill;f++){
+      const tclass_t *k=&cfg->cls[cfg->fill[f]];
+      r->rate[cfg->fill[f]]=k->floor_kbps+(int)(spare*k->weight/wsum);
+    }
+  }
+  for(int i=0;i<n;i++){
+    if(r->rate[i]<1) r->rate[i]=1;             /* HTB rejects a zero rate */
+    int c=cfg->cls[i].ceil_kbps_max<alloc_kbps? cfg->cls[i].ceil_kbps_max : alloc_kbps;
+    r->ceil[i]=c<r->rate[i]? r->rate[i] : c;
   }
-  /* ceils */
-  r->ceil_mav = (cfg->mav_ceil_max_kbps<r->rate_mav)? r->rate_mav : cfg->mav_ceil_max_kbps;
-  r->ceil_tun = (cfg->tun_ceil_max_kbps<r->rate_tun)? r->rate_tun : cfg->tun_ceil_max_kbps;
-  r->ceil_def = (cfg->def_ceil_max_kbps<r->rate_def)? r->rate_def : cfg->def_ceil_max_kbps;
-
-  int vceil1 = r->rate_video + (r->rate_video * vmarg_pct)/100;
-  int vceil2 = (cfg->video_ceil_max_kbps<alloc_kbps? cfg->video_ceil_max_kbps: alloc_kbps);
-  r->ceil_video = vceil1<r->rate_video? r->rate_video : vceil1;
-  if(r->ceil_video > vceil2) r->ceil_video = vceil2;
-  if(r->ceil_video < r->rate_video) r->ceil_video = r->rate_video;
 }
 
 /* ---- tc helper ---- */
@@ -305,61 +723,610 @@ static int sh(const char *fmt, ...){
   if(rc!=0) logln("tc-cmd rc=%d: %s", rc, cmd);
   return rc;
 }
-static void tc_setup(config_t *c){
+static void tc_setup_sh(config_t *c){
   const char *ifn=c->wlan;
+  int def=c->cls_default>=0? (int)c->cls[c->cls_default].minor : 0;
   sh("tc qdisc del dev %s root 2>/dev/null", ifn);
-  sh("tc qdisc add dev %s handle 1: root htb default 100", ifn);
+  sh("tc qdisc add dev %s handle 1: root htb default %x", ifn, def);
   sh("tc class add dev %s parent 1: classid 1:99 htb rate 100mbit ceil 100mbit", ifn);
+  for(int i=0;i<c->ncls;i++){
+    const tclass_t *k=&c->cls[i];
+    sh("tc class add dev %s parent 1:99 classid 1:%x htb rate %dkbit ceil %dkbit prio %d",
+       ifn, k->minor, k->floor_kbps, k->ceil_kbps_max, k->prio);
+    if(sh("tc qdisc add dev %s parent 1:%x %s 2>/dev/null", ifn, k->minor, k->qdisc)!=0 && strcmp(k->qdisc,"pfifo")!=0)
+      sh("tc qdisc add dev %s parent 1:%x pfifo", ifn, k->minor);
+  }
+  for(int i=0;i<c->ncls;i++) if(c->cls[i].mark>=0)
+    sh("tc filter add dev %s parent 1: protocol ip prio 1 handle %d fw flowid 1:%x", ifn, c->cls[i].mark, c->cls[i].minor);
+}
+static void tc_apply_rates_sh(config_t *c, const rates_t *r){
+  const char *ifn=c->wlan;
+  sh("tc class change dev %s classid 1:99 htb rate %dkbit ceil %dkbit", ifn, r->alloc_total, r->alloc_total);
+  for(int i=0;i<r->n && i<c->ncls;i++)
+    sh("tc class change dev %s classid 1:%x htb rate %dkbit ceil %dkbit prio %d",
+       ifn, c->cls[i].minor, r->rate[i], r->ceil[i], c->cls[i].prio);
+}
 
-  sh("tc class add dev %s parent 1:99 classid 1:1   htb rate %dkbit ceil %dkbit prio 2", ifn, 1000, 2000);
-  sh("tc class add dev %s parent 1:99 classid 1:10  htb rate %dkbit ceil %dkbit prio 1", ifn, 300, 2000);
-  sh("tc class add dev %s parent 1:99 classid 1:20  htb rate %dkbit ceil %dkbit prio 3", ifn, 200, 3000);
-  sh("tc class add dev %s parent 1:99 classid 1:100 htb rate %dkbit ceil %dkbit prio 4", ifn, 5,   500);
+/* ---- tc via rtnetlink ----
+ * Same tree as the shell path (tc class ids are hex: 1:10 == 0x10), but built
+ * in-process. Messages are queued into one buffer, sent with a single
+ * sendmsg() and every one is ACKed; nl_commit() reports per-message errno.
+ */
+#define NL_BUFSZ   8192
+#define NL_MAXMSG  32
+#define CID(maj,min) (((uint32_t)(maj)<<16)|(uint32_t)(min))
 
-  if(sh("tc qdisc add dev %s parent 1:1   fq_codel 2>/dev/null", ifn)!=0) sh("tc qdisc add dev %s parent 1:1   pfifo", ifn);
-  if(sh("tc qdisc add dev %s parent 1:10  fq_codel 2>/dev/null", ifn)!=0) sh("tc qdisc add dev %s parent 1:10  pfifo", ifn);
-  if(sh("tc qdisc add dev %s parent 1:20  fq_codel 2>/dev/null", ifn)!=0) sh("tc qdisc add dev %s parent 1:20  pfifo", ifn);
-  if(sh("tc qdisc add dev %s parent 1:100 pfifo", ifn)!=0) {}
+static int nl_fd=-1;
+static uint32_t nl_seq=1, nl_seq0=0;
+static char nl_buf[NL_BUFSZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+static size_t nl_len=0;
+static int nl_cnt=0, nl_err[NL_MAXMSG];
+static double nl_tick_us=1.0;              /* psched ticks per usec */
+static unsigned nl_hz=1000;
 
-  sh("tc filter add dev %s parent 1: protocol ip prio 1 handle %d fw flowid 1:1",   ifn, c->mark_video);
-  sh("tc filter add dev %s parent 1: protocol ip prio 1 handle %d fw flowid 1:10",  ifn, c->mark_mavlink);
-  sh("tc filter add dev %s parent 1: protocol ip prio 1 handle %d fw flowid 1:20",  ifn, c->mark_tunnel);
+static int nl_open(void){
+  if(nl_fd>=0) return 0;
+  nl_fd=socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(nl_fd<0) return -1;
+  struct sockaddr_nl sa; memset(&sa,0,sizeof(sa)); sa.nl_family=AF_NETLINK;
+  if(bind(nl_fd,(struct sockaddr*)&sa,sizeof(sa))<0){ close(nl_fd); nl_fd=-1; return -1; }
+  int one=1; setsockopt(nl_fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+  struct timeval tv={1,0}; setsockopt(nl_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  /* same clock conversion as iproute2's tc_core_init() */
+  FILE *f=fopen("/proc/net/psched","r");
+  if(f){
+    unsigned t2us=0, us2t=0, res=0, hz=0;
+    if(fscanf(f,"%08x%08x%08x%08x",&t2us,&us2t,&res,&hz)>=3 && us2t){
+      if(res==1000000000u) t2us=us2t;
+      nl_tick_us=(double)t2us/us2t*((double)res/1000000.0);
+      if(res==1000000u && hz) nl_hz=hz;
+    }
+    fclose(f);
+  }
+  return 0;
+}
+static void nl_reset(void){ nl_len=0; nl_cnt=0; nl_seq0=nl_seq; }
+static struct nlmsghdr *nl_msg(int type, int flags, int ifindex, uint32_t parent, uint32_t handle, uint32_t info){
+  size_t need=NLMSG_SPACE(sizeof(struct tcmsg));
+  if(nl_cnt>=NL_MAXMSG || nl_len+need>NL_BUFSZ) return NULL;
+  struct nlmsghdr *n=(struct nlmsghdr*)(nl_buf+nl_len);
+  memset(n,0,need);
+  n->nlmsg_len=NLMSG_LENGTH(sizeof(struct tcmsg));
+  n->nlmsg_type=type; n->nlmsg_flags=NLM_F_REQUEST|NLM_F_ACK|flags; n->nlmsg_seq=nl_seq++;
+  struct tcmsg *t=NLMSG_DATA(n);
+  t->tcm_family=AF_UNSPEC; t->tcm_ifindex=ifindex; t->tcm_parent=parent; t->tcm_handle=handle; t->tcm_info=info;
+  nl_cnt++;
+  return n;
+}
+static struct rtattr *nl_attr(struct nlmsghdr *n, int type, const void *data, size_t len){
+  if(!n) return NULL;
+  size_t off=NLMSG_ALIGN(n->nlmsg_len), alen=RTA_LENGTH(len);
+  if((size_t)((char*)n-nl_buf)+off+RTA_ALIGN(alen)>NL_BUFSZ) return NULL;
+  struct rtattr *a=(struct rtattr*)((char*)n+off);
+  a->rta_type=type; a->rta_len=alen;
+  if(len) memcpy(RTA_DATA(a),data,len);
+  n->nlmsg_len=off+RTA_ALIGN(alen);
+  return a;
+}
+static void nl_nest_end(struct nlmsghdr *n, struct rtattr *a){
+  if(n && a) a->rta_len=(unsigned short)((char*)n+n->nlmsg_len-(char*)a);
+}
+static void nl_done(struct nlmsghdr *n){ if(n) nl_len=(size_t)((char*)n-nl_buf)+NLMSG_ALIGN(n->nlmsg_len); }
+
+/* send the queued batch, collect one ACK per message; returns #failures */
+static int nl_commit(void){
+  if(nl_cnt==0) return 0;
+  for(int i=0;i<nl_cnt;i++) nl_err[i]=1;   /* 1 = no answer yet */
+  struct sockaddr_nl kern; memset(&kern,0,sizeof(kern)); kern.nl_family=AF_NETLINK;
+  struct iovec iov={nl_buf,nl_len};
+  struct msghdr mh={.msg_name=&kern,.msg_namelen=sizeof(kern),.msg_iov=&iov,.msg_iovlen=1};
+  if(sendmsg(nl_fd,&mh,0)<0){ logln("netlink send: %s", strerror(errno)); nl_reset(); return -1; }
+  int pending=nl_cnt, fails=0;
+  char rb[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+  while(pending>0){
+    ssize_t rd=recv(nl_fd,rb,sizeof(rb),0);
+    if(rd<0){ if(errno==EINTR) continue; logln("netlink recv: %s", strerror(errno)); fails+=pending; break; }
+    for(struct nlmsghdr *h=(struct nlmsghdr*)rb; NLMSG_OK(h,(size_t)rd); h=NLMSG_NEXT(h,rd)){
+      if(h->nlmsg_type!=NLMSG_ERROR) continue;
+      int idx=(int)(h->nlmsg_seq-nl_seq0);
+      if(idx<0 || idx>=nl_cnt || nl_err[idx]!=1) continue;
+      struct nlmsgerr *e=NLMSG_DATA(h);
+      nl_err[idx]=-e->error; pending--;
+      if(e->error) fails++;
+    }
+  }
+  nl_reset();
+  return fails;
+}
+
+static void nl_rate(struct tc_ratespec *r, uint32_t kbit){
+  memset(r,0,sizeof(*r));
+  r->rate=(uint32_t)((uint64_t)kbit*1000/8);       /* bytes/s */
+  r->linklayer=TC_LINKLAYER_ETHERNET;               /* kernel computes, no rtab */
+  r->mpu=0;
+}
+static uint32_t nl_xmit_ticks(uint32_t bps, uint32_t bytes){
+  if(!bps) return 0;
+  return (uint32_t)(1000000.0*bytes/bps*nl_tick_us);
+}
+static void nl_htb_class(int ifx, int flags, uint32_t parent, uint32_t cid, int rate_kbit, int ceil_kbit, int prio){
+  int type=RTM_NEWTCLASS;
+  struct nlmsghdr *n=nl_msg(type, flags, ifx, parent, cid, 0);
+  nl_attr(n, TCA_KIND, "htb", 4);
+  struct rtattr *o=nl_attr(n, TCA_OPTIONS, NULL, 0);
+  struct tc_htb_opt h; memset(&h,0,sizeof(h));
+  nl_rate(&h.rate, rate_kbit); nl_rate(&h.ceil, ceil_kbit);
+  /* default burst as tc: rate/HZ + mtu */
+  h.buffer =nl_xmit_ticks(h.rate.rate, h.rate.rate/nl_hz+1600);
+  h.cbuffer=nl_xmit_ticks(h.ceil.rate, h.ceil.rate/nl_hz+1600);
+  h.prio=prio;
+  nl_attr(n, TCA_HTB_PARMS, &h, sizeof(h));
+  nl_nest_end(n,o); nl_done(n);
+}
+/* create or replace, as "tc qdisc replace" */
+static void nl_leaf_qdisc(int ifx, uint32_t parent, const char *kind){
+  struct nlmsghdr *n=nl_msg(RTM_NEWQDISC, NLM_F_CREATE|NLM_F_REPLACE, ifx, parent, 0, 0);
+  nl_attr(n, TCA_KIND, kind, strlen(kind)+1); nl_done(n);
+}
+static void nl_fw_filter(int ifx, int mark, uint32_t cid){
+  struct nlmsghdr *n=nl_msg(RTM_NEWTFILTER, NLM_F_CREATE|NLM_F_EXCL, ifx, CID(1,0), (uint32_t)mark,
+                            TC_H_MAKE(1u<<16, htons(ETH_P_IP)));
+  nl_attr(n, TCA_KIND, "fw", 3);
+  struct rtattr *o=nl_attr(n, TCA_OPTIONS, NULL, 0);
+  nl_attr(n, TCA_FW_CLASSID, &cid, sizeof(cid));
+  nl_nest_end(n,o); nl_done(n);
+}
+static void nl_fw_del(int ifx, int mark){
+  struct nlmsghdr *n=nl_msg(RTM_DELTFILTER, 0, ifx, CID(1,0), (uint32_t)mark, TC_H_MAKE(1u<<16, htons(ETH_P_IP)));
+  nl_attr(n, TCA_KIND, "fw", 3); nl_done(n);
+}
+
+static int tc_setup_nl(config_t *c){
+  int ifx=(int)if_nametoindex(c->wlan);
+  if(!ifx){ logln("tc-nl: no such interface %s", c->wlan); return -1; }
+  nl_reset();
+  struct nlmsghdr *n=nl_msg(RTM_DELQDISC, 0, ifx, TC_H_ROOT, 0, 0); nl_done(n);
+  nl_commit();                              /* ENOENT/EINVAL when none: fine */
+
+  n=nl_msg(RTM_NEWQDISC, NLM_F_CREATE|NLM_F_EXCL, ifx, TC_H_ROOT, CID(1,0), 0);
+  nl_attr(n, TCA_KIND, "htb", 4);
+  struct rtattr *o=nl_attr(n, TCA_OPTIONS, NULL, 0);
+  struct tc_htb_glob g={.version=3,.rate2quantum=10,.defcls=c->cls_default>=0? c->cls[c->cls_default].minor : 0};
+  nl_attr(n, TCA_HTB_INIT, &g, sizeof(g));
+  nl_nest_end(n,o); nl_done(n);
+  const int cf=NLM_F_CREATE|NLM_F_EXCL;
+  nl_htb_class(ifx, cf, CID(1,0), CID(1,0x99), 100000, 100000, 0);
+  for(int i=0;i<c->ncls;i++){
+    const tclass_t *k=&c->cls[i];
+    nl_htb_class(ifx, cf, CID(1,0x99), CID(1,k->minor), k->floor_kbps, k->ceil_kbps_max, k->prio);
+  }
+  if(nl_commit()!=0){ logln("tc-nl: htb tree setup failed (%s)", strerror(nl_err[0]>0? nl_err[0]:EIO)); return -1; }
+
+  for(int i=0;i<c->ncls;i++) nl_leaf_qdisc(ifx, CID(1,c->cls[i].minor), c->cls[i].qdisc);
+  bool bad[MAX_CLASSES]={0};
+  if(nl_commit()>0) for(int i=0;i<c->ncls;i++) bad[i]=nl_err[i]!=0 && strcmp(c->cls[i].qdisc,"pfifo")!=0;
+  for(int i=0;i<c->ncls;i++) if(bad[i]) nl_leaf_qdisc(ifx, CID(1,c->cls[i].minor), "pfifo");
+  if(nl_commit()>0) logln("tc-nl: leaf qdisc fallback failed");
+
+  for(int i=0;i<c->ncls;i++) if(c->cls[i].mark>=0) nl_fw_filter(ifx, c->cls[i].mark, CID(1,c->cls[i].minor));
+  if(nl_commit()>0) logln("tc-nl: fw filter setup failed");
+  return 0;
+}
+/* link budget on 1:99 plus every class change in one batch; returns #failed ACKs */
+static int tc_apply_rates_nl(config_t *c, const rates_t *r){
+  int ifx=(int)if_nametoindex(c->wlan);
+  if(!ifx) return -1;
+  nl_reset();
+  nl_htb_class(ifx, 0, CID(1,0), CID(1,0x99), r->alloc_total, r->alloc_total, 0);
+  for(int i=0;i<r->n && i<c->ncls;i++)
+    nl_htb_class(ifx, 0, CID(1,0x99), CID(1,c->cls[i].minor), r->rate[i], r->ceil[i], c->cls[i].prio);
+  int f=nl_commit();
+  if(f) logln("tc-nl: %d of %d class changes failed", f, r->n+1);
+  return f;
+}
+
+static bool tc_use_nl(config_t *c){
+  if(strcmp(c->tc_backend,"shell")==0) return false;
+  if(nl_open()<0){ logln("tc-nl: netlink unavailable, using shell"); return false; }
+  return true;
+}
+static void tc_setup(config_t *c){
+  if(tc_use_nl(c) && tc_setup_nl(c)==0) return;
+  tc_setup_sh(c);
 }
 static void tc_apply_rates(config_t *c, const rates_t *r){
+  if(tc_use_nl(c) && tc_apply_rates_nl(c,r)==0) return;
+  tc_apply_rates_sh(c,r);
+}
+/* the interface no longer has a link: take our tree off it */
+static void tc_teardown(config_t *c){
+  int ifx=(int)if_nametoindex(c->wlan);
+  if(!ifx) return;                          /* interface gone, and the tree with it */
+  if(tc_use_nl(c)){
+    nl_reset();
+    struct nlmsghdr *n=nl_msg(RTM_DELQDISC, 0, ifx, TC_H_ROOT, 0, 0); nl_done(n);
+    if(nl_commit()==0) return;
+  }
+  sh("tc qdisc del dev %s root 2>/dev/null", c->wlan);
+}
+
+/* ---- incremental tree update ----
+ * A config change on the same interface only touches the classes that
+ * differ, matched by minor: removed ones lose their filter, then the class;
+ * new ones get class + leaf + filter; a changed qdisc is replaced in place
+ * and a changed mark moves its filter. Rates and prio follow with the next
+ * tc_apply_rates(). HTB cannot change its default class, so that (and a new
+ * interface or backend) still rebuilds the tree: tc_sync() returns -1.
+ */
+static int cls_by_minor(const config_t *c, uint32_t minor){
+  for(int i=0;i<c->ncls;i++) if(c->cls[i].minor==minor) return i;
+  return -1;
+}
+/* what changes for class i of c against o */
+static bool cls_new(const config_t *o, const config_t *c, int i){ return cls_by_minor(o,c->cls[i].minor)<0; }
+static bool cls_requeue(const config_t *o, const config_t *c, int i){
+  int j=cls_by_minor(o,c->cls[i].minor);
+  return j<0 || strcmp(o->cls[j].qdisc,c->cls[i].qdisc)!=0;
+}
+static bool cls_refilter(const config_t *o, const config_t *c, int i){
+  int j=cls_by_minor(o,c->cls[i].minor);
+  return c->cls[i].mark>=0 && (j<0 || o->cls[j].mark!=c->cls[i].mark);
+}
+/* class i of o loses its filter / goes away */
+static bool cls_unfilter(const config_t *o, const config_t *c, int i){
+  int j=cls_by_minor(c,o->cls[i].minor);
+  return o->cls[i].mark>=0 && (j<0 || c->cls[j].mark!=o->cls[i].mark);
+}
+static bool cls_gone(const config_t *o, const config_t *c, int i){ return cls_by_minor(c,o->cls[i].minor)<0; }
+
+static int tc_sync_nl(const config_t *o, config_t *c){
+  int ifx=(int)if_nametoindex(c->wlan);
+  if(!ifx) return -1;
+  nl_reset();
+  for(int i=0;i<o->ncls;i++) if(cls_unfilter(o,c,i)) nl_fw_del(ifx, o->cls[i].mark);
+  nl_commit();                              /* ENOENT if it never got installed: fine */
+  for(int i=0;i<o->ncls;i++) if(cls_gone(o,c,i)){
+    struct nlmsghdr *n=nl_msg(RTM_DELTCLASS, 0, ifx, CID(1,0x99), CID(1,o->cls[i].minor), 0); nl_done(n);
+  }
+  for(int i=0;i<c->ncls;i++) if(cls_new(o,c,i)){
+    const tclass_t *k=&c->cls[i];
+    nl_htb_class(ifx, NLM_F_CREATE|NLM_F_EXCL, CID(1,0x99), CID(1,k->minor), k->floor_kbps, k->ceil_kbps_max, k->prio);
+  }
+  if(nl_commit()!=0){ logln("tc-nl: class update failed"); return -1; }
+
+  int q[MAX_CLASSES], nq=0;
+  for(int i=0;i<c->ncls;i++) if(cls_requeue(o,c,i)){ q[nq++]=i; nl_leaf_qdisc(ifx, CID(1,c->cls[i].minor), c->cls[i].qdisc); }
+  bool bad[MAX_CLASSES]={0};
+  if(nl_commit()>0) for(int k=0;k<nq;k++) bad[k]=nl_err[k]!=0 && strcmp(c->cls[q[k]].qdisc,"pfifo")!=0;
+  for(int k=0;k<nq;k++) if(bad[k]) nl_leaf_qdisc(ifx, CID(1,c->cls[q[k]].minor), "pfifo");
+  if(nl_commit()>0) logln("tc-nl: leaf qdisc fallback failed");
+
+  for(int i=0;i<c->ncls;i++) if(cls_refilter(o,c,i)) nl_fw_filter(ifx, c->cls[i].mark, CID(1,c->cls[i].minor));
+  if(nl_commit()>0) logln("tc-nl: fw filter update failed");
+  return 0;
+}
+static void tc_sync_sh(const config_t *o, config_t *c){
   const char *ifn=c->wlan;
-  sh("tc class change dev %s classid 1:1   htb rate %dkbit ceil %dkbit prio 2", ifn, r->rate_video, r->ceil_video);
-  sh("tc class change dev %s classid 1:10  htb rate %dkbit ceil %dkbit prio 1", ifn, r->rate_mav,   r->ceil_mav);
-  sh("tc class change dev %s classid 1:20  htb rate %dkbit ceil %dkbit prio 3", ifn, r->rate_tun,   r->ceil_tun);
-  sh("tc class change dev %s classid 1:100 htb rate %dkbit ceil %dkbit prio 4", ifn, r->rate_def,   r->ceil_def);
+  for(int i=0;i<o->ncls;i++) if(cls_unfilter(o,c,i))
+    sh("tc filter del dev %s parent 1: protocol ip prio 1 handle %d fw 2>/dev/null", ifn, o->cls[i].mark);
+  for(int i=0;i<o->ncls;i++) if(cls_gone(o,c,i)) sh("tc class del dev %s classid 1:%x", ifn, o->cls[i].minor);
+  for(int i=0;i<c->ncls;i++) if(cls_new(o,c,i)){
+    const tclass_t *k=&c->cls[i];
+    sh("tc class add dev %s parent 1:99 classid 1:%x htb rate %dkbit ceil %dkbit prio %d",
+       ifn, k->minor, k->floor_kbps, k->ceil_kbps_max, k->prio);
+  }
+  for(int i=0;i<c->ncls;i++) if(cls_requeue(o,c,i)){
+    const tclass_t *k=&c->cls[i];
+    if(sh("tc qdisc replace dev %s parent 1:%x %s 2>/dev/null", ifn, k->minor, k->qdisc)!=0 && strcmp(k->qdisc,"pfifo")!=0)
+      sh("tc qdisc replace dev %s parent 1:%x pfifo", ifn, k->minor);
+  }
+  for(int i=0;i<c->ncls;i++) if(cls_refilter(o,c,i))
+    sh("tc filter add dev %s parent 1: protocol ip prio 1 handle %d fw flowid 1:%x", ifn, c->cls[i].mark, c->cls[i].minor);
+}
+static int tc_sync(const config_t *o, config_t *c){
+  uint32_t od=o->cls_default>=0? o->cls[o->cls_default].minor : 0;
+  uint32_t nd=c->cls_default>=0? c->cls[c->cls_default].minor : 0;
+  if(od!=nd || strcmp(o->wlan,c->wlan)!=0 || strcmp(o->tc_backend,c->tc_backend)!=0) return -1;
+  if(tc_use_nl(c)) return tc_sync_nl(o,c);
+  tc_sync_sh(o,c);
+  return 0;
 }
 
-/* ---- HTTP ---- */
+/* ---- per-class queue stats (RTM_GETTCLASS + RTM_GETQDISC dumps) ----
+ * The HTB class only counts packets its leaf refused at enqueue; fq_codel's
+ * own drops (AQM at dequeue, overflow taken from the fattest flow) are only
+ * on the leaf qdisc, so that one is read too, into qdrops.
+ */
+typedef struct { uint32_t qlen, backlog, drops, qdrops, overlimits; uint64_t bytes; bool valid; } qstat_t;
+
+/* one dump; classes match on handle 1:minor, leaf qdiscs on parent 1:minor */
+static int tc_dump_stats(config_t *c, int ifx, int type, qstat_t out[MAX_CLASSES]){
+  nl_reset();
+  struct nlmsghdr *n=nl_msg(type, NLM_F_DUMP, ifx, 0, 0, 0);
+  if(!n) return -1;
+  n->nlmsg_flags&=~NLM_F_ACK; nl_done(n);
+  struct sockaddr_nl kern; memset(&kern,0,sizeof(kern)); kern.nl_family=AF_NETLINK;
+  if(sendto(nl_fd,nl_buf,nl_len,0,(struct sockaddr*)&kern,sizeof(kern))<0){ nl_reset(); return -1; }
+  uint32_t seq=n->nlmsg_seq; nl_reset();
+  bool leaf=type==RTM_GETQDISC;
+  char rb[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+  for(;;){
+    ssize_t rd=recv(nl_fd,rb,sizeof(rb),0);
+    if(rd<0){ if(errno==EINTR) continue; return -1; }
+    for(struct nlmsghdr *h=(struct nlmsghdr*)rb; NLMSG_OK(h,(size_t)rd); h=NLMSG_NEXT(h,rd)){
+      if(h->nlmsg_seq!=seq) continue;
+      if(h->nlmsg_type==NLMSG_DONE) return 0;
+      if(h->nlmsg_type==NLMSG_ERROR) return -1;
+      if(h->nlmsg_type!=(leaf? RTM_NEWQDISC : RTM_NEWTCLASS)) continue;
+      struct tcmsg *t=NLMSG_DATA(h);
+      if(t->tcm_ifindex!=ifx) continue;
+      uint32_t id=leaf? t->tcm_parent : t->tcm_handle;
+      int k=-1; for(int i=0;i<c->ncls;i++) if(CID(1,c->cls[i].minor)==id) k=i;
+      if(k<0) continue;
+      int alen=(int)h->nlmsg_len-NLMSG_LENGTH(sizeof(*t));
+      for(struct rtattr *a=(struct rtattr*)((char*)t+NLMSG_ALIGN(sizeof(*t))); RTA_OK(a,alen); a=RTA_NEXT(a,alen)){
+        if(a->rta_type!=TCA_STATS2) continue;
+        int sl=RTA_PAYLOAD(a);
+        for(struct rtattr *b=RTA_DATA(a); RTA_OK(b,sl); b=RTA_NEXT(b,sl)){
+          if(b->rta_type==TCA_STATS_QUEUE && RTA_PAYLOAD(b)>=sizeof(struct gnet_stats_queue)){
+            struct gnet_stats_queue q; memcpy(&q,RTA_DATA(b),sizeof(q));
+            if(leaf){ out[k].qdrops=q.drops; continue; }
+            out[k].qlen=q.qlen; out[k].backlog=q.backlog; out[k].drops=q.drops; out[k].overlimits=q.overlimits;
+            out[k].valid=true;
+          }else if(!leaf && b->rta_type==TCA_STATS_BASIC && RTA_PAYLOAD(b)>=8){
+            memcpy(&out[k].bytes,RTA_DATA(b),8);
+          }
+        }
+      }
+    }
+  }
+}
+/* out[] is indexed like c->cls[] */
+static int tc_read_stats(config_t *c, qstat_t out[MAX_CLASSES]){
+  memset(out,0,sizeof(qstat_t)*MAX_CLASSES);
+  int ifx=(int)if_nametoindex(c->wlan);
+  if(!ifx || nl_open()<0) return -1;
+  if(tc_dump_stats(c,ifx,RTM_GETTCLASS,out)<0) return -1;
+  tc_dump_stats(c,ifx,RTM_GETQDISC,out);    /* no leaf stats: class drops only */
+  return 0;
+}
+/* counter growth between two samples; a smaller value means the class or
+ * leaf was recreated and counts from 0 again */
+static uint64_t qs_delta(uint64_t cur, uint64_t prev){ return cur>=prev? cur-prev : cur; }
+/* drops of class i over the last interval. The leaf counts every drop the
+ * class does, so the larger delta wins. */
+static uint32_t qs_ddrops(const qstat_t *cur, const qstat_t *prev){
+  uint32_t d=(uint32_t)qs_delta(cur->drops,prev->drops);
+  uint32_t q=(uint32_t)qs_delta(cur->qdrops,prev->qdrops);
+  return q>d? q : d;
+}
+
+/* trafficctrl CONF --bench-tc N : time tc_apply_rates() per backend */
+static void tc_bench(config_t *c, int n){
+  static const char *be[2]={"shell","netlink"};
+  char saved[sizeof(c->tc_backend)]; memcpy(saved,c->tc_backend,sizeof(saved));
+  for(int b=0;b<2;b++){
+    snprintf(c->tc_backend,sizeof(c->tc_backend),"%s",be[b]);
+    tc_setup(c);
+    double sum=0, mx=0;
+    for(int i=0;i<n;i++){
+      rates_t rr; allocate(c, (i&1)? 20000 : 8000, &rr);
+      struct timespec a,z; clock_gettime(CLOCK_MONOTONIC,&a);
+      tc_apply_rates(c,&rr);
+      clock_gettime(CLOCK_MONOTONIC,&z);
+      double us=(z.tv_sec-a.tv_sec)*1e6+(z.tv_nsec-a.tv_nsec)/1e3;
+      sum+=us; if(us>mx) mx=us;
+    }
+    printf("tc-bench backend=%s n=%d avg_us=%.1f max_us=%.1f\n", be[b], n, n? sum/n:0.0, mx);
+  }
+  memcpy(c->tc_backend,saved,sizeof(saved));
+}
+
+/* ---- HTTP ----
+ * Connections are HTTP/1.1 keep-alive with pipelining. Replies are written
+ * straight to the non-blocking socket; whatever the kernel does not take is
+ * parked in `out` and drained on EPOLLOUT, so handlers never block the loop.
+ */
 typedef struct {
   int fd;
+  bool keep, closing, dead;    /* keep-alive / close once drained / I/O error */
+  bool http10;                 /* no chunked replies: close-delimited instead */
+  bool want_out;               /* EPOLLOUT armed */
+  bool sse, sse_resync;        /* /events subscriber; owes a full snapshot */
+  uint64_t last_ms;
   char req[REQ_BUFSZ]; size_t rlen;
-  size_t content_len;
+  size_t head_len, content_len;
   char method[8], path[1024], query[1024];
-  char body[REQ_BUFSZ];
+  const char *body;            /* points into req */
+  char *out; size_t olen, ooff, ocap;
 } conn_t;
 
-static void http_send(int fd, const char *ct, const char *fmt, ...){
+static int conn_queue(conn_t *c, const char *p, size_t n){
+  if(c->ooff && c->ooff==c->olen) c->ooff=c->olen=0;
+  if(c->olen+n > c->ocap){
+    if(c->ooff){ memmove(c->out,c->out+c->ooff,c->olen-c->ooff); c->olen-=c->ooff; c->ooff=0; }
+    if(c->olen+n > c->ocap){
+      size_t cap=c->ocap? c->ocap:16384;
+      while(cap<c->olen+n) cap*=2;
+      if(cap>OUT_MAX) return -1;
+      char *no=realloc(c->out,cap); if(!no) return -1;
+      c->out=no; c->ocap=cap;
+    }
+  }
+  memcpy(c->out+c->olen,p,n); c->olen+=n;
+  return 0;
+}
+/* write directly while nothing is pending, park the rest */
+static int conn_send(conn_t *c, struct iovec *iov, int cnt){
+  if(c->dead) return -1;
+  size_t skip=0;
+  if(c->olen==c->ooff){
+    ssize_t w=writev(c->fd,iov,cnt);
+    if(w<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR){ c->dead=true; return -1; }
+    if(w>0) skip=(size_t)w;
+  }
+  for(int i=0;i<cnt;i++){
+    const char *p=iov[i].iov_base; size_t len=iov[i].iov_len;
+    if(skip>=len){ skip-=len; continue; }
+    p+=skip; len-=skip; skip=0;
+    if(conn_queue(c,p,len)<0){ c->dead=true; return -1; }
+  }
+  return 0;
+}
+/* EPOLLOUT: 1 when drained, 0 when still pending, -1 on error */
+static int conn_drain(conn_t *c){
+  while(c->ooff<c->olen){
+    ssize_t w=send(c->fd,c->out+c->ooff,c->olen-c->ooff,MSG_NOSIGNAL);
+    if(w<0){ if(errno==EINTR) continue; if(errno==EAGAIN || errno==EWOULDBLOCK) return 0; return -1; }
+    c->ooff+=(size_t)w;
+  }
+  c->ooff=c->olen=0;
+  return 1;
+}
+static const char *conn_hdr(const conn_t *c){ return c->keep? "keep-alive" : "close"; }
+
+static void http_send(conn_t *cn, const char *ct, const char *fmt, ...){
   char body[RES_BUFSZ];
   va_list ap; va_start(ap,fmt); int blen=vsnprintf(body,sizeof(body),fmt,ap); va_end(ap);
   if(blen<0) blen=0; if(blen>(int)sizeof(body)) blen=sizeof(body);
   char hdr[512];
   int hlen=snprintf(hdr,sizeof(hdr),
-    "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\nCache-Control: no-store\r\nPragma: no-cache\r\n\r\n",
-    ct, blen);
-  (void)write(fd, hdr, hlen);
-  (void)write(fd, body, blen);
+    "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: %s\r\nCache-Control: no-store\r\nPragma: no-cache\r\n\r\n",
+    ct, blen, conn_hdr(cn));
+  struct iovec iov[2]={{hdr,(size_t)hlen},{body,(size_t)blen}};
+  conn_send(cn,iov,2);
 }
-static void http_err(int fd, int code, const char *msg){
+static void http_err(conn_t *cn, int code, const char *msg){
   char body[256]; int blen=snprintf(body,sizeof(body), "{\"error\":%d,\"message\":\"%s\"}", code, msg?msg:"");
   char hdr[256]; int hlen=snprintf(hdr,sizeof(hdr),
-    "HTTP/1.1 %d ERR\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
-    code, blen);
-  (void)write(fd, hdr, hlen); (void)write(fd, body, blen);
+    "HTTP/1.1 %d ERR\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+    code, blen, conn_hdr(cn));
+  struct iovec iov[2]={{hdr,(size_t)hlen},{body,(size_t)blen}};
+  conn_send(cn,iov,2);
 }
+
+/* ---- streaming JSON writer ----
+ * Output goes through a fixed buffer straight into the socket: each flush is
+ * one conn_send() (writev) of [headers] + data. A reply that fits the buffer goes out
+ * with Content-Length in a single call; larger ones use chunked encoding, or
+ * for an HTTP/1.0 client no framing at all and the connection closed after.
+ * Nothing is allocated and replies are not size-limited. With an sbuf_t
+ * sink instead of a connection the same writer renders into memory.
+ */
+#define JW_BUFSZ 8192
+typedef struct { char *p; size_t len, cap; } sbuf_t;
+static int sb_put(sbuf_t *b, const char *p, size_t n){
+  if(b->len+n > b->cap){
+    size_t cap=b->cap? b->cap:1024;
+    while(cap<b->len+n) cap*=2;
+    char *np=realloc(b->p,cap); if(!np) return -1;
+    b->p=np; b->cap=cap;
+  }
+  memcpy(b->p+b->len,p,n); b->len+=n;
+  return 0;
+}
+static int sb_str(sbuf_t *b, const char *s){ return sb_put(b,s,strlen(s)); }
+
+typedef struct {
+  conn_t *cn; const char *ct; sbuf_t *sb;
+  bool hdr_sent, err, after_key;
+  int depth; uint32_t need_comma;        /* one bit per nesting level */
+  size_t len; char buf[JW_BUFSZ];
+} jw_t;
+
+static void jw_flush(jw_t *j, bool last){
+  if(j->err){ j->len=0; return; }
+  if(j->sb){ if(sb_put(j->sb,j->buf,j->len)<0) j->err=true; j->len=0; return; }
+  char hdr[256], csz[16]; struct iovec iov[5]; int n=0;
+  bool whole = last && !j->hdr_sent;
+  bool chunked = !whole && !j->cn->http10;
+  if(!j->hdr_sent){
+    char clen[48]="";                        /* 1.0, streamed: body ends at close */
+    if(chunked) snprintf(clen,sizeof(clen),"Transfer-Encoding: chunked\r\n");
+    else if(whole) snprintf(clen,sizeof(clen),"Content-Length: %zu\r\n",j->len);
+    else j->cn->keep=false;
+    int hl=snprintf(hdr,sizeof(hdr),
+      "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%sConnection: %s\r\nCache-Control: no-store\r\nPragma: no-cache\r\n\r\n",
+      j->ct, clen, conn_hdr(j->cn));
+    iov[n++]=(struct iovec){hdr,(size_t)hl}; j->hdr_sent=true;
+  }
+  if(j->len){
+    if(chunked){ int cl=snprintf(csz,sizeof(csz),"%zx\r\n",j->len); iov[n++]=(struct iovec){csz,(size_t)cl}; }
+    iov[n++]=(struct iovec){j->buf,j->len};
+    if(chunked) iov[n++]=(struct iovec){(void*)"\r\n",2};
+  }
+  if(last && chunked) iov[n++]=(struct iovec){(void*)"0\r\n\r\n",5};
+  if(n && conn_send(j->cn,iov,n)<0) j->err=true;
+  j->len=0;
+}
+static void jw_begin(jw_t *j, conn_t *cn, const char *ct){
+  j->cn=cn; j->ct=ct; j->sb=NULL; j->hdr_sent=j->err=j->after_key=false; j->depth=0; j->need_comma=0; j->len=0;
+}
+static void jw_begin_sb(jw_t *j, sbuf_t *sb){ jw_begin(j,NULL,NULL); j->sb=sb; }
+static int jw_end(jw_t *j){ jw_flush(j,true); return j->err? -1:0; }
+static void jw_raw(jw_t *j, const char *s, size_t n){
+  while(n){
+    if(j->len==JW_BUFSZ) jw_flush(j,false);
+    size_t k=JW_BUFSZ-j->len; if(k>n) k=n;
+    memcpy(j->buf+j->len,s,k); j->len+=k; s+=k; n-=k;
+  }
+}
+static inline void jw_ch(jw_t *j, char c){ if(j->len==JW_BUFSZ) jw_flush(j,false); j->buf[j->len++]=c; }
+/* comma before a value unless it follows its key */
+static void jw_sep(jw_t *j){
+  if(j->after_key){ j->after_key=false; return; }
+  uint32_t bit=1u<<(j->depth&31);
+  if(j->need_comma&bit) jw_ch(j,','); else j->need_comma|=bit;
+}
+static void jw_esc(jw_t *j, const char *s){
+  jw_ch(j,'"');
+  for(const unsigned char *p=(const unsigned char*)s; *p; ){
+    const unsigned char *q=p;                 /* copy plain runs in one go */
+    while(*q>=0x20 && *q!='"' && *q!='\\') q++;
+    if(q>p){ jw_raw(j,(const char*)p,(size_t)(q-p)); p=q; continue; }
+    if(*p=='"' || *p=='\\'){ jw_ch(j,'\\'); jw_ch(j,(char)*p); }
+    else if(*p=='\n'){ jw_raw(j,"\\n",2); }
+    else { char u[8]; snprintf(u,sizeof(u),"\\u%04x",*p); jw_raw(j,u,6); }
+    p++;
+  }
+  jw_ch(j,'"');
+}
+static void jw_open(jw_t *j, char c){ jw_sep(j); jw_ch(j,c); j->depth++; j->need_comma&=~(1u<<(j->depth&31)); }
+static void jw_close(jw_t *j, char c){ j->depth--; jw_ch(j,c); }
+static void jw_key(jw_t *j, const char *k){ jw_sep(j); jw_esc(j,k); jw_ch(j,':'); j->after_key=true; }
+static void jw_str(jw_t *j, const char *v){ jw_sep(j); jw_esc(j,v); }
+static void jw_fmt(jw_t *j, const char *fmt, ...){
+  jw_sep(j);
+  for(int pass=0; pass<2; pass++){
+    va_list ap; va_start(ap,fmt);
+    int n=vsnprintf(j->buf+j->len,JW_BUFSZ-j->len,fmt,ap); va_end(ap);
+    if(n>=0 && (size_t)n<JW_BUFSZ-j->len){ j->len+=(size_t)n; return; }
+    jw_flush(j,false);                  /* retry into an empty buffer */
+  }
+}
+static void jw_kstr(jw_t *j, const char *k, const char *v){ jw_key(j,k); jw_str(j,v); }
+/* integers and fixed-point numbers without going through printf */
+static void jw_int(jw_t *j, long long v){
+  char t[24]; int i=sizeof(t); unsigned long long u= v<0? 0ull-(unsigned long long)v : (unsigned long long)v;
+  do { t[--i]=(char)('0'+u%10); u/=10; } while(u);
+  if(v<0) t[--i]='-';
+  jw_sep(j); jw_raw(j,t+i,sizeof(t)-(size_t)i);
+}
+static void jw_num(jw_t *j, int prec, double v){
+  static const long long p10[]={1,10,100,1000,10000,100000,1000000};
+  if(prec<0 || prec>6 || !(v>-9e12 && v<9e12)){ jw_fmt(j,"%.*f",prec<0?0:prec,v); return; }
+  bool neg=v<0; if(neg) v=-v;
+  long long f=(long long)(v*p10[prec]+0.5), ip=f/p10[prec], fp=f%p10[prec];
+  char t[40]; int i=sizeof(t);
+  for(int d=0; d<prec; d++){ t[--i]=(char)('0'+fp%10); fp/=10; }
+  if(prec) t[--i]='.';
+  do { t[--i]=(char)('0'+ip%10); ip/=10; } while(ip);
+  if(neg && f) t[--i]='-';
+  jw_sep(j); jw_raw(j,t+i,sizeof(t)-(size_t)i);
+}
+static void jw_kint(jw_t *j, const char *k, long long v){ jw_key(j,k); jw_int(j,v); }
+static void jw_knum(jw_t *j, const char *k, int prec, double v){ jw_key(j,k); jw_num(j,prec,v); }
+
 static int tcp_listen(const char *bind_addr, int backlog){
   char ip[128]={0}; int port=0;
   const char *colon=strrchr(bind_addr, ':'); if(!colon) return -1;
@@ -375,50 +1342,594 @@ static int tcp_listen(const char *bind_addr, int backlog){
   fcntl(fd,F_SETFL, fcntl(fd,F_GETFL,0)|O_NONBLOCK);
   return fd;
 }
+/* 1 = complete request at the head of req, 0 = need more, -1 = malformed */
 static int parse_request(conn_t *c){
   c->req[c->rlen]=0;
-  char *hdrs=strstr(c->req,"\r\n\r\n"); if(!hdrs) hdrs=strstr(c->req,"\n\n"); if(!hdrs) return 0;
-  size_t head_len = (size_t)(hdrs - c->req) + ((hdrs[0]=='\r'&&hdrs[1]=='\n')?4:2);
+  char *hdrs=strstr(c->req,"\r\n\r\n"); size_t sep=4;
+  char *lf=strstr(c->req,"\n\n"); if(lf && (!hdrs || lf<hdrs)){ hdrs=lf; sep=2; }
+  if(!hdrs) return 0;
+  size_t head_len = (size_t)(hdrs - c->req) + sep;
+  char save=*hdrs; *hdrs=0;              /* keep header lookups inside this request */
   char proto[16]={0}, url[1024]={0};
-  if(sscanf(c->req,"%7s %1023s %15s",c->method,url,proto)!=3) return -1;
-  char *q=strchr(url,'?'); if(q){ *q=0; snprintf(c->path,sizeof(c->path),"%s",url); snprintf(c->query,sizeof(c->query),"%s",q+1); }
-  else { snprintf(c->path,sizeof(c->path),"%s",url); c->query[0]=0; }
-  char *cl=strcasestr(c->req,"Content-Length:"); c->content_len=0;
-  if(cl){ c->content_len=(size_t)atoi(cl+15); }
-  size_t body_have = c->rlen - head_len;
-  if(body_have < c->content_len) return 0;
-  if(c->content_len>0){
-    size_t tocopy = c->content_len<sizeof(c->body)-1? c->content_len: sizeof(c->body)-1;
-    memcpy(c->body, c->req+head_len, tocopy); c->body[tocopy]=0;
-  } else c->body[0]=0;
+  bool ok = sscanf(c->req,"%7s %1023s %15s",c->method,url,proto)==3;
+  if(ok){
+    char *q=strchr(url,'?'); if(q){ *q=0; snprintf(c->path,sizeof(c->path),"%s",url); snprintf(c->query,sizeof(c->query),"%s",q+1); }
+    else { snprintf(c->path,sizeof(c->path),"%s",url); c->query[0]=0; }
+    char *cl=strcasestr(c->req,"\nContent-Length:"); c->content_len=0;
+    if(cl){ c->content_len=(size_t)atoi(cl+16); }
+    c->http10 = strcmp(proto,"HTTP/1.0")==0;
+    c->keep = strcmp(proto,"HTTP/1.1")==0;  /* 1.1 defaults to keep-alive, 1.0 to close */
+    char *cn=strcasestr(c->req,"\nConnection:");
+    if(cn){
+      cn+=12; while(*cn==' '||*cn=='\t') cn++;
+      if(strncasecmp(cn,"close",5)==0) c->keep=false;
+      else if(strncasecmp(cn,"keep-alive",10)==0) c->keep=true;
+    }
+  }
+  *hdrs=save;
+  if(!ok || c->content_len > sizeof(c->req)-1-head_len) return -1;
+  if(c->rlen - head_len < c->content_len) return 0;
+  c->head_len=head_len; c->body=c->req+head_len;
   return 1;
 }
 
 /* ---- world ---- */
-static volatile sig_atomic_t want_reload_sig=0;
+static volatile sig_atomic_t want_reload_sig=0, want_exit_sig=0;
+static bool want_apply=false;               /* API edit: reload without rebuilding tc */
 static void on_hup(int s){ (void)s; want_reload_sig=1; }
+static void on_term(int s){ (void)s; want_exit_sig=1; }
 
 static config_t ccfg;
 static int lfd=-1;
 
 static uint64_t start_ms=0;
-static uint64_t last_tc_ms=0;
-static uint64_t last_hold_start_ms=0;
+static bool sse_dirty;                       /* status changed since last /events push */
 
-static int last_mcs=-1, last_width=-1;
-static uint64_t last_telem_ms=0;
-static double sm_alloc_kbps=0.0;
-static int last_applied_alloc=-1;
+/* ---- shaper instances ----
+ * Link 0 is the [general] interface; [link1]..[link3] add more, each with its
+ * own interface, telemetry source and keys, HTB tree and shaping state. Their
+ * config_t is a copy of the global one with the section's keys on top.
+ * [general] budget_kbps > 0 caps the sum of all allocations, split in
+ * proportion to each link's current modelled capacity.
+ */
+typedef struct {
+  config_t cfg;
+  char name[MAX_NAME];
+  telem_src_t ts;
+  link_t last_link;
+  uint64_t last_telem_ms, last_tc_ms, last_hold_start_ms;
+  double sm_alloc_kbps;
+  int last_applied_alloc, hold_active;
+  int usable_kbps;                           /* latest model capacity */
+  int model_kbps;                            /* allocation before smoothing/hysteresis */
+  qstat_t qs_cur[MAX_CLASSES], qs_prev[MAX_CLASSES];
+  uint64_t qs_cur_ms, qs_prev_ms;
+  rates_t applied_rates;
+  double fb_scale;
+  int fb_sojourn_ms[MAX_CLASSES];
+  double cap_corr, cap_achieved_kbps;
+} shaper_t;
+static shaper_t links[MAX_SHAPERS];
+static int nlinks=0;
+static int budget_kbps=0;
 
-static void json_ok(int fd){ http_send(fd,"application/json","{\"ok\":1}"); }
+static void shaper_init(shaper_t *s){
+  memset(s,0,sizeof(*s));
+  s->ts.ino=s->ts.sfd=-1;
+  s->last_link.mcs=s->last_link.width=-1;
+  s->last_applied_alloc=-1;
+  s->fb_scale=1.0; s->cap_corr=1.0;
+}
+/* per-link keys; anything else is inherited from the global config */
+static void cfg_load_link(config_t *c, const ini_cache_t *ic, const char *sect){
+  char v[256];
+  if(!ini_cget(ic,sect,"wlan",v,sizeof(v))) snprintf(c->wlan,sizeof(c->wlan),"%s",v);
+  if(!ini_cget(ic,sect,"telem_file",v,sizeof(v))) snprintf(c->telem_file,sizeof(c->telem_file),"%s",v);
+  if(!ini_cget(ic,sect,"telem_listen",v,sizeof(v))) snprintf(c->telem_listen,sizeof(c->telem_listen),"%s",v);
+  else c->telem_listen[0]=0;                 /* a port can only be bound once */
+  if(!ini_cget(ic,sect,"telem_key_mcs",v,sizeof(v))) snprintf(c->key_mcs,sizeof(c->key_mcs),"%s",v);
+  if(!ini_cget(ic,sect,"telem_key_width",v,sizeof(v))) snprintf(c->key_width,sizeof(c->key_width),"%s",v);
+  if(!ini_cget(ic,sect,"telem_key_retry",v,sizeof(v))) snprintf(c->key_retry,sizeof(c->key_retry),"%s",v);
+  if(!ini_cget(ic,sect,"headroom_pct",v,sizeof(v))) c->headroom_pct=atoi(v);
+  if(!ini_cget(ic,sect,"nss",v,sizeof(v))) c->nss=atoi(v);
+  if(!ini_cget(ic,sect,"sgi",v,sizeof(v))) c->sgi=atoi(v);
+  if(!ini_cget(ic,sect,"vht",v,sizeof(v))) c->vht=atoi(v);
+  if(!ini_cget(ic,sect,"ampdu",v,sizeof(v))) c->ampdu=atoi(v);
+}
+/* (re)build the link table from ccfg; running links keep their state */
+static void links_load(void){
+  ini_cache_t *ic=ini_cached(ccfg.cfg_path);
+  char v[64];
+  budget_kbps = ic && !ini_cget(ic,"general","budget_kbps",v,sizeof(v))? atoi(v) : 0;
+  int n=0;
+  for(int i=0;i<MAX_SHAPERS;i++){
+    char sect[16]; snprintf(sect,sizeof(sect),i? "link%d":"general",i);
+    if(i && (!ic || ini_cget(ic,sect,"wlan",v,sizeof(v)))) continue;
+    shaper_t *s=&links[n];
+    if(n>=nlinks || strcmp(s->name,sect)!=0){ telem_events_close(&s->ts); shaper_init(s); }
+    s->cfg=ccfg;
+    if(i) cfg_load_link(&s->cfg,ic,sect);
+    snprintf(s->name,sizeof(s->name),"%s",sect);
+    n++;
+  }
+  for(int i=n;i<nlinks;i++) telem_events_close(&links[i].ts);
+  nlinks=n;
+}
 
-/* keys endpoint (flat/tree with values) */
-static int cmp_kv(const void *a,const void *b){
-  const kv_t *ka=(const kv_t*)a, *kb=(const kv_t*)b;
-  int s=strcmp(ka->section,kb->section); if(s) return s; return strcmp(ka->key,kb->key);
+/* ---- queue feedback ----
+ * AIMD on a scale applied to the PHY-model allocation: new drops, or a
+ * queueing delay (backlog / class rate) above fb_target_ms, cut the scale by
+ * fb_md; an almost empty queue lets it creep back by fb_ai per tick.
+ */
+static int sojourn_ms(uint32_t backlog_bytes, int rate_kbps){
+  return rate_kbps>0? (int)((uint64_t)backlog_bytes*8/(uint64_t)rate_kbps) : 0;
+}
+/* 0 when two consecutive class samples are available */
+static int qstats_poll(shaper_t *s, uint64_t now){
+  if(!s->cfg.fb_enable && s->cfg.learn_alpha<=0) return -1;
+  if(!s->cfg.ncls) return -1;
+  memcpy(s->qs_prev,s->qs_cur,sizeof(s->qs_cur)); s->qs_prev_ms=s->qs_cur_ms;
+  if(tc_read_stats(&s->cfg,s->qs_cur)<0){ s->qs_cur[0].valid=false; return -1; }
+  s->qs_cur_ms=now;
+  return s->qs_prev[0].valid && s->qs_cur[0].valid? 0 : -1;
+}
+/* returns -1 after a decrease, +1 after an increase, 0 otherwise */
+static int feedback_update(shaper_t *s){
+  const config_t *c=&s->cfg;
+  if(!c->fb_enable) { s->fb_scale=1.0; return 0; }
+  uint32_t ddrops=0; int worst=0;
+  for(int i=0;i<c->ncls;i++){
+    s->fb_sojourn_ms[i]=sojourn_ms(s->qs_cur[i].backlog,rate_of(&s->applied_rates,i));
+    if(i==c->cls_default) continue;               /* default class is best effort */
+    ddrops+=qs_ddrops(&s->qs_cur[i],&s->qs_prev[i]);
+    if(s->fb_sojourn_ms[i]>worst) worst=s->fb_sojourn_ms[i];
+  }
+  double old=s->fb_scale;
+  if(ddrops>0 || worst>c->fb_target_ms) s->fb_scale*=c->fb_md;
+  else if(worst*4<c->fb_target_ms)      s->fb_scale+=c->fb_ai;
+  if(s->fb_scale<c->fb_min) s->fb_scale=c->fb_min;
+  if(s->fb_scale>c->fb_max) s->fb_scale=c->fb_max;
+  return s->fb_scale<old? -1 : s->fb_scale>old? 1 : 0;
+}
+
+/* ---- online capacity correction ----
+ * While video stays backlogged the class counters tell who is limiting: if
+ * the link moved clearly less than the shaper allowed, the model is too
+ * optimistic and cap_corr follows achieved/model; if the shaper was the
+ * limit, cap_corr probes upwards slowly (the headroom absorbs the error).
+ */
+static void cap_learn(shaper_t *s, const link_t *l, double phy){
+  config_t *c=&s->cfg;
+  double a=c->learn_alpha;
+  if(a<=0 || strcmp(c->cap_model,"static")==0) return;
+  uint64_t dt=s->qs_cur_ms-s->qs_prev_ms; if(dt<20) return;
+  uint64_t db=0;
+  for(int i=0;i<c->ncls;i++) db+=qs_delta(s->qs_cur[i].bytes,s->qs_prev[i].bytes);
+  s->cap_achieved_kbps=(double)db*8.0/(double)dt;
+  int v=c->cls_video;                              /* the class that keeps the link busy */
+  if(v<0 || !s->qs_cur[v].backlog || !s->qs_prev[v].backlog || s->applied_rates.alloc_total<=0) return;
+  double model_kbps=phy*1000.0*airtime_eff(c,l,phy);
+  if(s->cap_achieved_kbps < 0.85*s->applied_rates.alloc_total)
+    s->cap_corr=(1.0-a)*s->cap_corr + a*(s->cap_achieved_kbps/model_kbps);
+  else if(!qs_ddrops(&s->qs_cur[v],&s->qs_prev[v]))
+    s->cap_corr+=a*0.1*(c->corr_max-s->cap_corr);
+  if(s->cap_corr<c->corr_min) s->cap_corr=c->corr_min;
+  if(s->cap_corr>c->corr_max) s->cap_corr=c->corr_max;
+}
+
+static bool link_stale(const shaper_t *s, uint64_t now){
+  return s->last_link.mcs<0 || s->last_link.width<=0 || (now - s->last_telem_ms) > (uint64_t)s->cfg.stale_ms;
+}
+/* sample in effect at `now`: stale telemetry falls back to MCS0/20 MHz */
+static link_t link_now(const shaper_t *s, uint64_t now){
+  link_t l=s->last_link;
+  if(link_stale(s,now)){ link_init(&s->cfg,&l); l.mcs=0; l.width=20; }
+  return l;
+}
+/* this link's share of budget_kbps, by current capacity */
+static int budget_share(const shaper_t *s){
+  if(budget_kbps<=0) return -1;
+  int64_t sum=0;
+  for(int i=0;i<nlinks;i++) sum+=links[i].usable_kbps;
+  if(sum<=0) return budget_kbps/(nlinks? nlinks:1);
+  return (int)((int64_t)budget_kbps*s->usable_kbps/sum);
+}
+
+/* ---- encoder bitrate hook ----
+ * Pushes the video payload rate the shaper can carry (video class rate less FEC and
+ * duplication overhead and a margin) so the encoder backs off before HTB
+ * starts dropping. Lower targets go out after enc_down_ms, higher ones after
+ * enc_up_ms, and only when they differ by enc_hyst_pct from the last push.
+ * HTTP requests are non-blocking and driven from the main event loop; a push
+ * only counts as sent on a 200 reply, a failed one is retried after the same
+ * interval (enc_up_ms while nothing has been acknowledged yet).
+ */
+static int enc_fd=-1;                       /* in-flight HTTP request */
+static unsigned enc_gen;                    /* bumped per socket, for epoll */
+static bool enc_connected;
+static uint64_t enc_start_ms, enc_last_ms;
+static char enc_req[512]; static size_t enc_req_len;
+static int enc_want=-1, enc_sent=-1, enc_errors=0;
+static int enc_inflight=-1;                 /* kbps of the request in flight */
+static bool enc_failed;                     /* last push not acknowledged */
+
+static void enc_close(void){ if(enc_fd>=0) close(enc_fd); enc_fd=-1; enc_connected=false; }
+/* end of one push; only the first failure after a success is logged */
+static void enc_done(bool ok, const char *why){
+  if(ok){ enc_sent=enc_inflight; enc_failed=false; }
+  else{
+    if(!enc_failed) logln("encoder: push %d kbps to %s: %s", enc_inflight, ccfg.enc_target, why);
+    enc_errors++; enc_failed=true;
+  }
+  enc_inflight=-1; enc_close();
+}
+
+static int enc_target_kbps(int video_kbps){
+  int k=ccfg.enc_fec_k>0? ccfg.enc_fec_k:1, n=ccfg.enc_fec_n>=k? ccfg.enc_fec_n:k;
+  int dup=ccfg.enc_dup>0? ccfg.enc_dup:1;
+  int64_t t=(int64_t)video_kbps*k*(100-ccfg.enc_margin_pct)/((int64_t)n*dup*100);
+  if(t<ccfg.enc_min_kbps) t=ccfg.enc_min_kbps;
+  if(t>ccfg.enc_max_kbps) t=ccfg.enc_max_kbps;
+  return (int)t;
+}
+/* copy tmpl with the first "%d" replaced by kbps (config text is not a format) */
+static int enc_fmt_kbps(char *dst, size_t cap, const char *tmpl, int kbps){
+  const char *p=strstr(tmpl,"%d");
+  int n = p? snprintf(dst,cap,"%.*s%d%s",(int)(p-tmpl),tmpl,kbps,p+2) : snprintf(dst,cap,"%s",tmpl);
+  return (n<0 || (size_t)n>=cap)? -1 : n;
+}
+static int enc_send(int kbps){
+  char ip[128]; const char *path="/";
+  const char *t=ccfg.enc_target;
+  struct sockaddr_in sa; memset(&sa,0,sizeof(sa)); sa.sin_family=AF_INET;
+  bool udp=strncmp(t,"udp:",4)==0;
+  if(udp) t+=4; else if(strncmp(t,"http://",7)==0) t+=7; else { errno=EINVAL; return -1; }
+  size_t hl=strcspn(t,"/"); if(hl>=sizeof(ip)) { errno=EINVAL; return -1; }
+  memcpy(ip,t,hl); ip[hl]=0; if(t[hl]) path=t+hl;
+  char *colon=strrchr(ip,':'); int port=udp? 0:80;
+  if(colon){ *colon=0; port=atoi(colon+1); }
+  sa.sin_port=htons(port);
+  if(!port || inet_pton(AF_INET,ip,&sa.sin_addr)!=1) { errno=EINVAL; return -1; }
+  if(udp){
+    char msg[160]; int ml=enc_fmt_kbps(msg,sizeof(msg),ccfg.enc_fmt,kbps);
+    if(ml<0) { errno=EMSGSIZE; return -1; }
+    int fd=socket(AF_INET,SOCK_DGRAM|SOCK_CLOEXEC,0); if(fd<0) return -1;
+    ssize_t w=sendto(fd,msg,(size_t)ml,MSG_DONTWAIT,(struct sockaddr*)&sa,sizeof(sa));
+    close(fd);
+    return w==ml? 0 : -1;
+  }
+  char url[MAX_PATH]; if(enc_fmt_kbps(url,sizeof(url),path,kbps)<0) { errno=EMSGSIZE; return -1; }
+  enc_close();
+  int n=snprintf(enc_req,sizeof(enc_req),"GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",url,ip);
+  if(n<0 || (size_t)n>=sizeof(enc_req)) { errno=EMSGSIZE; return -1; }
+  enc_req_len=(size_t)n;
+  enc_fd=socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0); if(enc_fd<0) return -1;
+  enc_gen++;
+  if(connect(enc_fd,(struct sockaddr*)&sa,sizeof(sa))<0 && errno!=EINPROGRESS){ enc_close(); return -1; }
+  enc_start_ms=now_ms();
+  return 0;
+}
+/* EV_ENC events: enc_ep_sync() adds each new socket edge-triggered for
+ * EPOLLIN|EPOLLOUT. The first EPOLLOUT edge = connected, send the request;
+ * EPOLLIN/HUP/ERR = reply or EOF, and one read of the status line ends it. */
+static void enc_io(bool rd, bool wr){
+  if(enc_fd<0) return;
+  if(wr && !enc_connected){
+    int err=0; socklen_t el=sizeof(err);
+    getsockopt(enc_fd,SOL_SOCKET,SO_ERROR,&err,&el);
+    if(err || send(enc_fd,enc_req,enc_req_len,MSG_NOSIGNAL)!=(ssize_t)enc_req_len){
+      enc_done(false, strerror(err? err:errno)); return;
+    }
+    enc_connected=true;
+  }
+  if(rd){
+    char buf[512]; ssize_t n=recv(enc_fd,buf,sizeof(buf)-1,0);
+    if(n>0){                                 /* status line is all we need */
+      buf[n]=0; buf[strcspn(buf,"\r\n")]=0;
+      const char *sp=strchr(buf,' ');
+      enc_done(strncmp(buf,"HTTP/",5)==0 && sp && atoi(sp+1)==200, buf);
+    }
+    else if(n==0) enc_done(false, "closed without reply");
+    else if(errno!=EAGAIN) enc_done(false, strerror(errno));
+  }
+}
+/* video class rate on the link that carries video (link 0) */
+static void enc_tick(uint64_t now, int video_kbps){
+  if(enc_fd>=0 && now-enc_start_ms>1000) enc_done(false, "timeout");
+  if(!ccfg.enc_enable || video_kbps<=0) return;
+  enc_want=enc_target_kbps(video_kbps);
+  if(enc_sent>0){
+    int d=abs(enc_want-enc_sent);
+    if(d*100 < enc_sent*ccfg.enc_hyst_pct) return;
+  }
+  if(enc_sent>0 || enc_failed){
+    uint64_t gap=(uint64_t)(enc_sent>0 && enc_want<enc_sent? ccfg.enc_down_ms:ccfg.enc_up_ms);
+    if(now-enc_last_ms<gap) return;
+  }
+  if(enc_fd>=0) return;                      /* previous push still in flight */
+  enc_last_ms=now; enc_inflight=enc_want;
+  if(enc_send(enc_want)<0){ enc_done(false, strerror(errno)); return; }
+  if(enc_fd<0) enc_done(true, NULL);         /* udp: fire and forget */
+}
+
+/* model, smoothing and hysteresis for one tick: true, with *rr filled, when
+ * the allocation should go to tc. fb is feedback_update()'s verdict. No I/O,
+ * so --replay runs exactly this. */
+static bool shape_step(shaper_t *s, uint64_t now, bool event, int fb, rates_t *rr){
+  config_t *c=&s->cfg;
+  link_t l = link_now(s, now);
+  double phy = phy_for(&l);
+  double eff = eff_for(c, &l, phy, s->cap_corr);
+  int usable_kbps = (int)(phy * 1000.0 * eff + 0.5);
+  s->usable_kbps = usable_kbps;
+  int alloc_kbps = (int)(usable_kbps * (100 - c->headroom_pct) / 100);
+  alloc_kbps = (int)(alloc_kbps*s->fb_scale);
+  int share = budget_share(s);
+  if(share>=0 && alloc_kbps>share) alloc_kbps=share;
+  if(alloc_kbps<100) alloc_kbps=100;
+  s->model_kbps = alloc_kbps;
+
+  /* a pushed MCS drop or a queue-driven cut goes straight to the shaper:
+   * no smoothing, hold or dwell */
+  bool fast = (event && c->fast_down) || fb<0;
+  fast = fast && s->last_applied_alloc>0 && alloc_kbps<s->last_applied_alloc;
+  if(s->sm_alloc_kbps<=0.1 || fast) s->sm_alloc_kbps = alloc_kbps;
+  else s->sm_alloc_kbps = c->alpha*alloc_kbps + (1.0-c->alpha)*s->sm_alloc_kbps;
+
+  int target = (int)(s->sm_alloc_kbps + 0.5);
+
+  int diff = (s->last_applied_alloc<0)? 100 : abs(target - s->last_applied_alloc);
+  int pct  = (s->last_applied_alloc<=0)? 100 : (diff*100)/(s->last_applied_alloc? s->last_applied_alloc:1);
+
+  if(pct >= c->hysteresis_pct){
+    if(!s->hold_active){ s->hold_active=1; s->last_hold_start_ms=now; }
+    if(fast || (now - s->last_hold_start_ms >= (uint64_t)c->hysteresis_hold_ms && now - s->last_tc_ms >= (uint64_t)c->min_dwell_ms)){
+      allocate(c, target, rr);
+      s->applied_rates = *rr;
+      s->last_tc_ms = now;
+      s->last_applied_alloc = target;
+      s->hold_active=0;
+      return true;
+    }
+  } else s->hold_active=0;
+  return false;
+}
+
+/* ---- tick log ----
+ * [general] tick_log=PATH keeps the last tick_log_records shaping ticks of
+ * every link in an mmap'd ring file: the inputs shape_step() saw and what it
+ * decided. The file survives restarts (same record size and capacity: it is
+ * appended to) and is what --replay reads.
+ *   layout: [hdr 64 B] [cap x tlog_rec_t], record i lives at head%cap
+ */
+#define TLOG_MAGIC 0x31474c54u               /* "TLG1" */
+enum { TL_EVENT=1, TL_STALE=2, TL_FBCUT=4, TL_APPLY=8, TL_START=16 };
+typedef struct {
+  uint32_t magic, rec_size, cap, _r;
+  uint64_t head;                             /* records ever written */
+  uint8_t  _pad[40];
+} tlog_hdr_t;
+typedef struct {
+  uint64_t t_ms;                             /* CLOCK_MONOTONIC */
+  uint8_t  link, flags;                      /* shaper index, TL_* */
+  int8_t   nss, sgi, vht, ampdu;
+  int16_t  mcs, width;                       /* raw telemetry, -1 = none */
+  float    retry, fb_scale, cap_corr;
+  int32_t  share_kbps;                       /* budget share, -1 = no budget */
+  int32_t  model_kbps, target_kbps, applied_kbps;
+  rates_t  rates;                            /* in effect after this tick */
+} tlog_rec_t;
+
+static tlog_hdr_t *tlog;
+static tlog_rec_t *tlog_recs;
+static size_t tlog_sz;
+static char tlog_path[MAX_PATH];
+static unsigned tlog_started;                /* links logged since process start */
+
+static void tlog_close(void){
+  if(tlog) munmap(tlog,tlog_sz);
+  tlog=NULL; tlog_recs=NULL; tlog_path[0]=0;
+}
+/* (re)open for c->tick_log; a matching file keeps its history */
+static void tlog_open(const config_t *c){
+  uint32_t cap=c->tick_log_records>0? (uint32_t)c->tick_log_records : 1;
+  if(tlog && strcmp(tlog_path,c->tick_log)==0 && tlog->cap==cap) return;
+  tlog_close();
+  if(!c->tick_log[0]) return;
+  size_t sz=sizeof(tlog_hdr_t)+(size_t)cap*sizeof(tlog_rec_t);
+  int fd=open(c->tick_log,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+  if(fd<0){ logln("tick log %s: %s", c->tick_log, strerror(errno)); return; }
+  tlog_hdr_t h; struct stat st;
+  bool keep = fstat(fd,&st)==0 && (size_t)st.st_size==sz && pread(fd,&h,sizeof(h),0)==(ssize_t)sizeof(h) &&
+              h.magic==TLOG_MAGIC && h.rec_size==sizeof(tlog_rec_t) && h.cap==cap;
+  if(!keep && (ftruncate(fd,0)<0 || ftruncate(fd,(off_t)sz)<0)){
+    logln("tick log %s: %s", c->tick_log, strerror(errno)); close(fd); return;
+  }
+  void *m=mmap(NULL,sz,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(m==MAP_FAILED){ logln("tick log %s: %s", c->tick_log, strerror(errno)); return; }
+  tlog=m; tlog_recs=(tlog_rec_t*)((char*)m+sizeof(tlog_hdr_t)); tlog_sz=sz;
+  if(!keep){ tlog->rec_size=sizeof(tlog_rec_t); tlog->cap=cap; tlog->head=0; tlog->magic=TLOG_MAGIC; }
+  snprintf(tlog_path,sizeof(tlog_path),"%s",c->tick_log);
+  logln("tick log: %s, %u records", c->tick_log, cap);
+}
+static void tlog_tick(const shaper_t *s, uint64_t now, bool event, int fb, bool applied){
+  if(!tlog) return;
+  uint64_t h=tlog->head;
+  tlog_rec_t *r=&tlog_recs[h%tlog->cap];
+  const link_t *l=&s->last_link;
+  memset(r,0,sizeof(*r));
+  r->t_ms=now; r->link=(uint8_t)(s-links);
+  r->flags=(event? TL_EVENT:0)|(link_stale(s,now)? TL_STALE:0)|(fb<0? TL_FBCUT:0)|(applied? TL_APPLY:0);
+  if(!(tlog_started&(1u<<r->link))){ r->flags|=TL_START; tlog_started|=1u<<r->link; }
+  r->mcs=(int16_t)l->mcs; r->width=(int16_t)l->width;
+  r->nss=(int8_t)l->nss; r->sgi=(int8_t)l->sgi; r->vht=(int8_t)l->vht; r->ampdu=(int8_t)(l->ampdu>127? 127:l->ampdu);
+  r->retry=(float)l->retry; r->fb_scale=(float)s->fb_scale; r->cap_corr=(float)s->cap_corr;
+  r->share_kbps=budget_share(s);
+  r->model_kbps=s->model_kbps; r->target_kbps=(int32_t)(s->sm_alloc_kbps+0.5);
+  r->applied_kbps=s->last_applied_alloc; r->rates=s->applied_rates;
+  __atomic_store_n(&tlog->head,h+1,__ATOMIC_RELEASE);
+}
+
+/* one shaping step; event=true when a fresh sample was just pushed */
+static void shape_tick(shaper_t *s, uint64_t now, bool event){
+  int fb = 0;
+  if(!event && qstats_poll(s, now)==0){
+    link_t l = link_now(s, now);
+    fb = feedback_update(s); cap_learn(s, &l, phy_for(&l));
+  }
+  rates_t rr;
+  bool apply = shape_step(s, now, event, fb, &rr);
+  if(apply){ tc_apply_rates(&s->cfg, &rr); sse_dirty=true; }
+  tlog_tick(s, now, event, fb, apply);
+  if(s==&links[0]) enc_tick(now, rate_of(&s->applied_rates, s->cfg.cls_video));
+}
+
+/* ---- replay ----
+ * trafficctrl CONF --replay SRC [link=N] [SET ...]
+ * Runs a tick log (SRC = file) or a synthetic MCS trace (SRC =
+ * synth:steps|walk|fade[:SECONDS]) through shape_step(), first with CONF as
+ * is, then once per SET: comma-separated smoothing_alpha=, hysteresis_pct=,
+ * hysteresis_hold_ms=, min_dwell_ms=, headroom_pct=, fast_down= overrides.
+ * Logged fb_scale, cap_corr and budget share are replayed as inputs. "Demand"
+ * is the unsmoothed model allocation; below/over count time the applied rate
+ * was >5% under/over it, reaction is the time from a >=20% step in demand
+ * until the applied rate is within 10% (avg/max ms).
+ */
+typedef struct {
+  int ticks, changes, nup, ndown;
+  uint64_t span_ms, below_ms, over_ms, up_sum, up_max, down_sum, down_max;
+} replay_res_t;
+
+static int tlog_read(const char *path, int link, tlog_rec_t **out){
+  int fd=open(path,O_RDONLY|O_CLOEXEC); if(fd<0) return -1;
+  tlog_hdr_t h; struct stat st;
+  if(pread(fd,&h,sizeof(h),0)!=(ssize_t)sizeof(h) || h.magic!=TLOG_MAGIC || h.rec_size!=sizeof(tlog_rec_t) ||
+     fstat(fd,&st)<0 || (size_t)st.st_size<sizeof(h)+(size_t)h.cap*sizeof(tlog_rec_t)){ close(fd); errno=EINVAL; return -1; }
+  size_t sz=sizeof(h)+(size_t)h.cap*sizeof(tlog_rec_t);
+  void *m=mmap(NULL,sz,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(m==MAP_FAILED) return -1;
+  const tlog_hdr_t *mh=m; const tlog_rec_t *rec=(const tlog_rec_t*)((const char*)m+sizeof(h));
+  uint64_t head=__atomic_load_n(&mh->head,__ATOMIC_ACQUIRE);
+  uint64_t first=head>h.cap? head-h.cap+1 : 0;   /* the oldest slot may be rewritten under us */
+  tlog_rec_t *v=malloc(sizeof(*v)*(size_t)(head-first+1)); int n=0;
+  if(!v){ munmap(m,sz); return -1; }
+  for(uint64_t i=first;i<head;i++) if(rec[i%h.cap].link==link) v[n++]=rec[i%h.cap];
+  munmap(m,sz);
+  *out=v; return n;
+}
+static int tlog_synth(const config_t *c, const char *spec, tlog_rec_t **out){
+  char name[16]=""; int secs=600;
+  if(sscanf(spec,"synth:%15[^:]:%d",name,&secs)<1 || secs<=0) return -1;
+  int hz=c->sample_hz>0? c->sample_hz : 10, n=secs*hz, top=c->vht? 9 : 7, mcs=top, prev=-1;
+  bool steps=strcmp(name,"steps")==0, walk=strcmp(name,"walk")==0, fade=strcmp(name,"fade")==0;
+  if(!steps && !walk && !fade) return -1;
+  tlog_rec_t *v=calloc((size_t)n,sizeof(*v)); if(!v) return -1;
+  uint32_t x=2463534242u;                    /* xorshift32, fixed seed: runs are comparable */
+  for(int i=0;i<n;i++){
+    uint64_t t=(uint64_t)i*1000/(uint64_t)hz;
+    if(steps) mcs=(t/5000)&1? 2 : top;                 /* 5 s high, 5 s low */
+    else if(fade) mcs=t%4000<300? 0 : top;             /* 300 ms fade every 4 s */
+    else { x^=x<<13; x^=x>>17; x^=x<<5; if(x%10==0){ mcs+=(x>>8)&1? 1:-1; if(mcs<0) mcs=0; if(mcs>top) mcs=top; } }
+    tlog_rec_t *r=&v[i];
+    r->t_ms=t; r->mcs=(int16_t)mcs; r->width=20;
+    r->nss=(int8_t)c->nss; r->sgi=(int8_t)c->sgi; r->vht=(int8_t)c->vht; r->ampdu=(int8_t)c->ampdu;
+    r->retry=-1; r->fb_scale=1; r->cap_corr=1; r->share_kbps=-1;
+    r->flags=mcs!=prev && i? TL_EVENT : 0;           /* as if pushed over telem_listen */
+    prev=mcs;
+  }
+  *out=v; return n;
+}
+static void replay_run(const config_t *c, const tlog_rec_t *v, int n, replay_res_t *o){
+  shaper_t *s=&links[0];
+  memset(o,0,sizeof(*o));
+  nlinks=1;
+  int ref=-1, dir=0; uint64_t step_t=0;
+  for(int i=0;i<n;i++){
+    const tlog_rec_t *r=&v[i];
+    if(i==0 || (r->flags&TL_START) || r->t_ms<v[i-1].t_ms || r->t_ms-v[i-1].t_ms>60000){   /* daemon restart */
+      shaper_init(s); s->cfg=*c; ref=-1; dir=0;
+    }
+    link_t *l=&s->last_link;
+    l->mcs=r->flags&TL_STALE? -1 : r->mcs; l->width=r->width;
+    l->nss=r->nss; l->sgi=r->sgi; l->vht=r->vht; l->ampdu=r->ampdu; l->retry=r->retry;
+    s->last_telem_ms=r->t_ms; s->fb_scale=r->fb_scale; s->cap_corr=r->cap_corr;
+    budget_kbps=r->share_kbps>0? r->share_kbps : 0;
+    rates_t rr;
+    if(shape_step(s, r->t_ms, r->flags&TL_EVENT, r->flags&TL_FBCUT? -1:0, &rr)) o->changes++;
+    o->ticks++;
+    int dem=s->model_kbps, app=s->last_applied_alloc;
+    if(ref<0) ref=dem;
+    else if(abs(dem-ref)*5>=ref){
+      if(dir){ uint64_t d=r->t_ms-step_t; if(dir<0){ o->ndown++; o->down_sum+=d; if(d>o->down_max) o->down_max=d; }
+                                          else   { o->nup++;   o->up_sum+=d;   if(d>o->up_max) o->up_max=d; } }
+      dir=dem<ref? -1 : 1; step_t=r->t_ms; ref=dem;
+    }
+    if(dir && abs(app-dem)*10<=dem){
+      uint64_t d=r->t_ms-step_t;
+      if(dir<0){ o->ndown++; o->down_sum+=d; if(d>o->down_max) o->down_max=d; }
+      else     { o->nup++;   o->up_sum+=d;   if(d>o->up_max) o->up_max=d; }
+      dir=0;
+    }
+    uint64_t dt=i+1<n && v[i+1].t_ms>=r->t_ms && !(v[i+1].flags&TL_START)? v[i+1].t_ms-r->t_ms : 0;
+    if(dt>1000) dt=1000;
+    o->span_ms+=dt;
+    if((int64_t)app*100<(int64_t)dem*95) o->below_ms+=dt;
+    else if((int64_t)app*100>(int64_t)dem*105) o->over_ms+=dt;
+  }
+}
+static int replay_set(config_t *c, char *spec){
+  char *sv=NULL;
+  for(char *kv=strtok_r(spec,",",&sv); kv; kv=strtok_r(NULL,",",&sv)){
+    char *eq=strchr(kv,'='); if(!eq) return -1;
+    *eq=0; const char *v=eq+1;
+    if(strcmp(kv,"smoothing_alpha")==0) c->alpha=strtod(v,NULL);
+    else if(strcmp(kv,"hysteresis_pct")==0) c->hysteresis_pct=atoi(v);
+    else if(strcmp(kv,"hysteresis_hold_ms")==0) c->hysteresis_hold_ms=atoi(v);
+    else if(strcmp(kv,"min_dwell_ms")==0) c->min_dwell_ms=atoi(v);
+    else if(strcmp(kv,"headroom_pct")==0) c->headroom_pct=atoi(v);
+    else if(strcmp(kv,"fast_down")==0) c->fast_down=atoi(v);
+    else return -1;
+  }
+  return 0;
 }
-static void handle_keys(int fd, const char *path, const char *q){
-  kv_t arr[MAX_KEYS]; int n=0; if(ini_load(path,arr,MAX_KEYS,&n)<0){ http_err(fd,404,"no config"); return; }
+static int tlog_replay(int argc, char **argv){
+  const char *src=argv[0]; int link=0, a=1;
+  if(a<argc && strncmp(argv[a],"link=",5)==0) link=atoi(argv[a++]+5);
+  links_load();
+  if(link<0 || link>=nlinks){ fprintf(stderr,"replay: no link %d\n", link); return 1; }
+  config_t base=links[link].cfg;
+  tlog_rec_t *v=NULL; errno=0;
+  int n=strncmp(src,"synth:",6)==0? tlog_synth(&base,src,&v) : tlog_read(src,link,&v);
+  if(n<0){ fprintf(stderr,"replay: %s: %s\n", src, errno? strerror(errno) : "bad trace"); return 1; }
+  printf("replay src=%s link=%d records=%d\n", src, link, n);
+  for(int k=0; k==0 || a<argc; k++){
+    config_t c=base;
+    if(k && replay_set(&c,argv[a++])<0){ fprintf(stderr,"replay: bad set '%s'\n", argv[a-1]); free(v); return 1; }
+    replay_res_t o;
+    struct timespec t0,t1; clock_gettime(CLOCK_MONOTONIC,&t0);
+    replay_run(&c,v,n,&o);
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    double wall=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6, span=o.span_ms? (double)o.span_ms : 1;
+    printf("set=%d alpha=%.2f hyst_pct=%d hold_ms=%d dwell_ms=%d headroom_pct=%d fast_down=%d"
+           " ticks=%d span_s=%.1f changes=%d below_pct=%.1f over_pct=%.1f"
+           " react_down_ms=%.0f/%llu react_up_ms=%.0f/%llu speed=%.0fx\n",
+           k, c.alpha, c.hysteresis_pct, c.hysteresis_hold_ms, c.min_dwell_ms, c.headroom_pct, c.fast_down,
+           o.ticks, o.span_ms/1000.0, o.changes, 100.0*o.below_ms/span, 100.0*o.over_ms/span,
+           o.ndown? (double)o.down_sum/o.ndown : 0.0, (unsigned long long)o.down_max,
+           o.nup? (double)o.up_sum/o.nup : 0.0, (unsigned long long)o.up_max,
+           wall>0? o.span_ms/wall : 0.0);
+  }
+  free(v);
+  return 0;
+}
+
+static void json_ok(conn_t *cn){ http_send(cn,"application/json","{\"ok\":1}"); }
+
+/* keys endpoint (flat/tree with values) */
+static void handle_keys(conn_t *cn, const char *path, const char *q){
+  ini_cache_t *ic=ini_cached(path); if(!ic){ http_err(cn,404,"no config"); return; }
   char fmt[16]="flat", want_values_buf[8]="0", section[128]="", prefix[256]="", sortbuf[8]="1";
   (void)query_get(q,"format",fmt,sizeof(fmt));
   (void)query_get(q,"values",want_values_buf,sizeof(want_values_buf));
@@ -427,120 +1938,229 @@ static void handle_keys(int fd, const char *path, const char *q){
   (void)query_get(q,"sort",sortbuf,sizeof(sortbuf));
   bool want_values = (strcmp(want_values_buf,"1")==0 || strcasecmp(want_values_buf,"true")==0);
   bool do_sort = (strcmp(sortbuf,"1")==0 || strcasecmp(sortbuf,"true")==0);
-  if(do_sort) qsort(arr,n,sizeof(kv_t),cmp_kv);
+  bool tree = strcmp(fmt,"tree")==0;
+  size_t plen=strlen(prefix);
 
-  if(strcmp(fmt,"tree")==0){
-    char out[RES_BUFSZ]; int off=0; off+=snprintf(out+off,sizeof(out)-off,"{\"sections\":{");
-    const char *cur=""; int first_sec=1;
-    for(int i=0;i<n;i++){
-      if(section[0] && strcmp(arr[i].section,section)!=0) continue;
-      if(prefix[0] && strncmp(arr[i].key,prefix,strlen(prefix))!=0) continue;
-      if(strcmp(cur,arr[i].section)!=0){
-        if(!first_sec){ if(off>0 && out[off-1]==',') off--; off+=snprintf(out+off,sizeof(out)-off,"},"); }
-        cur=arr[i].section; first_sec=0;
-        off+=snprintf(out+off,sizeof(out)-off, "\"%s\":{", cur);
-      }
-      if(want_values){
-        /* escape minimal */
-        char ev[1024]; int eo=0; const char *p=arr[i].val;
-        for(;*p && eo<(int)sizeof(ev)-2;p++){ if(*p=='\\'||*p=='"'){ ev[eo++]='\\'; ev[eo++]=*p; }
-          else if(*p=='\n'){ ev[eo++]='\\'; ev[eo++]='n'; } else ev[eo++]=*p; } ev[eo]=0;
-        off+=snprintf(out+off,sizeof(out)-off,"\"%s\":\"%s\",", arr[i].key, ev);
-      }else{
-        off+=snprintf(out+off,sizeof(out)-off,"\"%s\",", arr[i].key);
-      }
-      if(off>(int)sizeof(out)-128) break;
-    }
-    if(!first_sec){ if(off>0 && out[off-1]==',') off--; off+=snprintf(out+off,sizeof(out)-off,"}"); }
-    off+=snprintf(out+off,sizeof(out)-off,"},\"count\":%d}", n);
-    http_send(fd,"application/json","%.*s", off, out);
-  }else{
-    char out[RES_BUFSZ]; int off=0; off+=snprintf(out+off,sizeof(out)-off,"{\"keys\":[");
-    for(int i=0;i<n;i++){
-      if(section[0] && strcmp(arr[i].section,section)!=0) continue;
-      if(prefix[0] && strncmp(arr[i].key,prefix,strlen(prefix))!=0) continue;
-      if(want_values){
-        char ev[1024]; int eo=0; const char *p=arr[i].val;
-        for(;*p && eo<(int)sizeof(ev)-2;p++){ if(*p=='\\'||*p=='"'){ ev[eo++]='\\'; ev[eo++]=*p; }
-          else if(*p=='\n'){ ev[eo++]='\\'; ev[eo++]='n'; } else ev[eo++]=*p; } ev[eo]=0;
-        off+=snprintf(out+off,sizeof(out)-off,"{\"k\":\"%s.%s\",\"v\":\"%s\"},", arr[i].section,arr[i].key,ev);
-      }else{
-        off+=snprintf(out+off,sizeof(out)-off,"\"%s.%s\",", arr[i].section, arr[i].key);
+  jw_t j; jw_begin(&j,cn,"application/json");
+  jw_open(&j,'{'); jw_key(&j, tree? "sections":"keys"); jw_open(&j, tree? '{':'[');
+  const char *cur=NULL;
+  for(int i=0;i<ic->n;i++){
+    const kv_t *e=&ic->kv[do_sort? ic->sorted[i] : i];
+    if(section[0] && strcmp(e->section,section)!=0) continue;
+    if(plen && strncmp(e->key,prefix,plen)!=0) continue;
+    if(tree){
+      if(!cur || strcmp(cur,e->section)!=0){
+        if(cur) jw_close(&j,'}');
+        cur=e->section; jw_key(&j,cur); jw_open(&j,'{');
       }
-      if(off>(int)sizeof(out)-128) break;
+      if(want_values) jw_kstr(&j,e->key,e->val); else jw_str(&j,e->key);
+    }else{
+      char sk[2*MAX_NAME+2]; snprintf(sk,sizeof(sk),"%s.%s",e->section,e->key);
+      if(want_values){ jw_open(&j,'{'); jw_kstr(&j,"k",sk); jw_kstr(&j,"v",e->val); jw_close(&j,'}'); }
+      else jw_str(&j,sk);
     }
-    if(off>0 && out[off-1]==',') off--;
-    off+=snprintf(out+off,sizeof(out)-off,"],\"count\":%d}", n);
-    http_send(fd,"application/json","%.*s", off, out);
   }
+  if(cur) jw_close(&j,'}');
+  jw_close(&j, tree? '}':']');
+  jw_kint(&j,"count",ic->n);
+  jw_close(&j,'}');
+  jw_end(&j);
 }
 
 /* ---- API handlers ---- */
-static void handle_get_config(int fd, const char *path){
-  FILE *f=fopen(path,"r"); if(!f){ http_err(fd,404,"no config"); return; }
-  struct stat st; fstat(fileno(f), &st);
-  size_t sz=(size_t)st.st_size; if(sz>RES_BUFSZ-1) sz=RES_BUFSZ-1;
-  char *content=(char*)malloc(sz+1); if(!content){ fclose(f); http_err(fd,500,"oom"); return; }
-  size_t rd=fread(content,1,sz,f); content[rd]=0; fclose(f);
-  http_send(fd,"text/plain","%s",content); free(content);
-}
-static void handle_post_config(int fd, const char *path, const char *body, size_t blen){
+static void handle_get_config(conn_t *cn, const char *path){
+  ini_flush();
+  int cf=open(path,O_RDONLY|O_CLOEXEC); if(cf<0){ http_err(cn,404,"no config"); return; }
+  jw_t j; jw_begin(&j,cn,"text/plain");
+  for(;;){
+    ssize_t rd=read(cf,j.buf+j.len,JW_BUFSZ-j.len);
+    if(rd<=0) break;
+    j.len+=(size_t)rd; if(j.len==JW_BUFSZ) jw_flush(&j,false);
+  }
+  close(cf); jw_end(&j);
+}
+static void handle_post_config(conn_t *cn, const char *path, const char *body, size_t blen){
   char tmp[MAX_PATH]; snprintf(tmp,sizeof(tmp), "%s.tmp", path);
-  FILE *f=fopen(tmp,"w"); if(!f){ http_err(fd,500,"write tmp"); return; }
-  fwrite(body,1,blen,f); fclose(f);
-  if(rename(tmp,path)<0){ http_err(fd,500,"rename"); return; }
-  json_ok(fd); want_reload_sig=1;
-}
-static void handle_get_kv(int fd, const char *path, const char *q){
-  char sk[256]; if(!query_get(q,"key",sk,sizeof(sk))){ http_err(fd,400,"missing key"); return; }
-  char sect[MAX_NAME]="", key[MAX_NAME]=""; char *dot=strchr(sk,'.');
-  if(dot){ snprintf(sect,sizeof(sect),"%.*s",(int)(dot-sk)); snprintf(key,sizeof(key),"%s",dot+1); }
+  FILE *f=fopen(tmp,"w"); if(!f){ http_err(cn,500,"write tmp"); return; }
+  bool ok=fwrite(body,1,blen,f)==blen && fflush(f)==0 && fsync(fileno(f))==0;
+  if(fclose(f)!=0 || !ok){ unlink(tmp); http_err(cn,500,"write tmp"); return; }
+  if(rename(tmp,path)<0){ http_err(cn,500,"rename"); return; }
+  icache.dirty=false;                        /* the new file replaces pending edits */
+  ini_gen++;
+  json_ok(cn); want_apply=true;
+}
+static void handle_get_kv(conn_t *cn, const char *path, const char *q){
+  char sk[256]; if(!query_get(q,"key",sk,sizeof(sk))){ http_err(cn,400,"missing key"); return; }
+  char sect[MAX_NAME]="", key[MAX_NAME]=""; char *dot=strrchr(sk,'.');
+  if(dot){ snprintf(sect,sizeof(sect),"%.*s",(int)(dot-sk),sk); snprintf(key,sizeof(key),"%s",dot+1); }
   else { sect[0]=0; snprintf(key,sizeof(key),"%s",sk); }
-  kv_t arr[MAX_KEYS]; int n=0; if(ini_load(path,arr,MAX_KEYS,&n)<0){ http_err(fd,404,"no config"); return; }
-  for(int i=0;i<n;i++) if((!sect[0]||strcmp(arr[i].section,sect)==0)&&strcmp(arr[i].key,key)==0){
-    http_send(fd,"application/json","{\"value\":\"%s\"}", arr[i].val); return;
+  ini_cache_t *ic=ini_cached(path); if(!ic){ http_err(cn,404,"no config"); return; }
+  char val[1024];
+  if(!ini_cget(ic,sect,key,val,sizeof(val))){
+    jw_t j; jw_begin(&j,cn,"application/json");
+    jw_open(&j,'{'); jw_kstr(&j,"value",val); jw_close(&j,'}'); jw_end(&j);
+    return;
   }
-  http_err(fd,404,"not found");
+  http_err(cn,404,"not found");
 }
-static void handle_set_kv(int fd, const char *path, const char *q){
-  char sk[256]; if(!query_get(q,"key",sk,sizeof(sk))){ http_err(fd,400,"missing key"); return; }
-  char val[1024]; if(!query_get(q,"value",val,sizeof(val))){ http_err(fd,400,"missing value"); return; }
-  char sect[MAX_NAME]="", key[MAX_NAME]=""; char *dot=strchr(sk,'.');
-  if(dot){ snprintf(sect,sizeof(sect),"%.*s",(int)(dot-sk)); snprintf(key,sizeof(key),"%s",dot+1); }
+static void handle_set_kv(conn_t *cn, const char *path, const char *q){
+  char sk[256]; if(!query_get(q,"key",sk,sizeof(sk))){ http_err(cn,400,"missing key"); return; }
+  char val[1024]; if(!query_get(q,"value",val,sizeof(val))){ http_err(cn,400,"missing value"); return; }
+  char sect[MAX_NAME]="", key[MAX_NAME]=""; char *dot=strrchr(sk,'.');
+  if(dot){ snprintf(sect,sizeof(sect),"%.*s",(int)(dot-sk),sk); snprintf(key,sizeof(key),"%s",dot+1); }
   else { sect[0]=0; snprintf(key,sizeof(key),"%s",sk); }
-  if(ini_set(ccfg.cfg_path,sect,key,val)<0){ http_err(fd,500,"set failed"); return; }
-  json_ok(fd); want_reload_sig=1;
-}
-static void handle_status(int fd, int mcs, int width, int alloc_kbps, const rates_t *r, double eff, double phy, int usable_kbps){
-  http_send(fd,"application/json",
-    "{"
-    "\"wlan\":\"%s\","
-    "\"link\":{\"mcs\":%d,\"width\":%d,\"phy_mbps\":%.1f,\"eff\":%.2f,"
-      "\"usable_kbps\":%d,\"headroom_pct\":%d,\"alloc_kbps\":%d,"
-      "\"provider_file\":\"%s\",\"last_telem_ms\":%llu},"
-    "\"classes\":["
-      "{\"name\":\"video\",\"cid\":\"1:1\",\"mark\":%d,\"rate_kbps\":%d,\"ceil_kbps\":%d},"
-      "{\"name\":\"mavlink\",\"cid\":\"1:10\",\"mark\":%d,\"rate_kbps\":%d,\"ceil_kbps\":%d},"
-      "{\"name\":\"tunnel\",\"cid\":\"1:20\",\"mark\":%d,\"rate_kbps\":%d,\"ceil_kbps\":%d},"
-      "{\"name\":\"default\",\"cid\":\"1:100\",\"rate_kbps\":%d,\"ceil_kbps\":%d}"
-    "],"
-    "\"tc_last_update_ms\":%llu"
-    "}",
-    ccfg.wlan, mcs, width, phy, eff, usable_kbps, ccfg.headroom_pct, alloc_kbps,
-    ccfg.telem_file, (unsigned long long)(now_ms()-last_telem_ms),
-    ccfg.mark_video, r->rate_video, r->ceil_video,
-    ccfg.mark_mavlink, r->rate_mav, r->ceil_mav,
-    ccfg.mark_tunnel, r->rate_tun, r->ceil_tun,
-    r->rate_def, r->ceil_def,
-    (unsigned long long)(now_ms()-last_tc_ms)
-  );
+  if(ini_set(path,sect,key,val)<0){ http_err(cn,500,"set failed"); return; }
+  json_ok(cn); want_apply=true;
 }
+/* status document, one top-level member per section so /events can send
+ * only the sections that changed */
+typedef struct { const shaper_t *sh; link_t l; rates_t r; double phy, eff; int usable_kbps; } status_t;
+/* the top-level members describe link 0; "links" lists every link when
+ * there is more than one */
+enum { ST_WLAN, ST_LINK, ST_CAP, ST_CLASSES, ST_FB, ST_ENC, ST_TC, ST_LINKS, ST_N };
 
+static void status_snapshot(status_t *s, const shaper_t *sh){
+  /* recompute status quickly from current smoothed/baseline */
+  const config_t *c=&sh->cfg;
+  s->sh=sh;
+  s->l=link_now(sh,now_ms());
+  s->phy=phy_for(&s->l); s->eff=eff_for(c,&s->l,s->phy,sh->cap_corr);
+  s->usable_kbps=(int)(s->phy*1000.0*s->eff + 0.5);
+  int alloc_kbps=(int)(s->usable_kbps * (100 - c->headroom_pct) / 100);
+  if(alloc_kbps<100) alloc_kbps=100;
+  allocate(c, (int)(sh->sm_alloc_kbps>0? sh->sm_alloc_kbps:alloc_kbps), &s->r);
+}
+static void status_section(jw_t *j, int sec, const status_t *s, uint64_t now){
+  const shaper_t *sh=s->sh; const config_t *c=&sh->cfg;
+  const link_t *l=&s->l; const rates_t *r=&s->r;
+  switch(sec){
+  case ST_WLAN: jw_kstr(j,"wlan",c->wlan); break;
+  case ST_LINK:
+    jw_key(j,"link"); jw_open(j,'{');
+    jw_kint(j,"mcs",l->mcs); jw_kint(j,"width",l->width);
+    jw_knum(j,"phy_mbps",1,s->phy); jw_knum(j,"eff",2,s->eff);
+    jw_kint(j,"usable_kbps",s->usable_kbps); jw_kint(j,"headroom_pct",c->headroom_pct);
+    jw_kint(j,"alloc_kbps",r->alloc_total);
+    jw_kstr(j,"provider_file",c->telem_file); jw_kint(j,"last_telem_ms",(long long)(now-sh->last_telem_ms));
+    jw_close(j,'}');
+    break;
+  case ST_CAP:
+    jw_key(j,"capacity"); jw_open(j,'{');
+    jw_kstr(j,"model",c->cap_model); jw_kint(j,"vht",l->vht); jw_kint(j,"nss",link_nss(l));
+    jw_kint(j,"sgi",l->sgi); jw_kint(j,"ampdu",l->ampdu);
+    jw_knum(j,"retry",3,l->retry>0? l->retry:0.0); jw_knum(j,"corr",3,sh->cap_corr);
+    jw_kint(j,"achieved_kbps",(long long)sh->cap_achieved_kbps);
+    jw_close(j,'}');
+    break;
+  case ST_CLASSES:
+    jw_key(j,"classes"); jw_open(j,'[');
+    for(int i=0;i<c->ncls;i++){
+      const tclass_t *k=&c->cls[i]; char cid[16];
+      snprintf(cid,sizeof(cid),"1:%x",k->minor);
+      jw_open(j,'{');
+      jw_kstr(j,"name",k->name); jw_kstr(j,"cid",cid);
+      if(k->mark>=0) jw_kint(j,"mark",k->mark);
+      jw_kint(j,"weight",k->weight); jw_kint(j,"prio",k->prio); jw_kstr(j,"qdisc",k->qdisc);
+      jw_kint(j,"rate_kbps",rate_of(r,i)); jw_kint(j,"ceil_kbps",i<r->n? r->ceil[i]:0);
+      jw_kint(j,"qlen",sh->qs_cur[i].qlen); jw_kint(j,"backlog_bytes",sh->qs_cur[i].backlog);
+      jw_kint(j,"drops",sh->qs_cur[i].drops); jw_kint(j,"leaf_drops",sh->qs_cur[i].qdrops);
+      jw_kint(j,"overlimits",sh->qs_cur[i].overlimits);
+      jw_kint(j,"sojourn_ms",sh->fb_sojourn_ms[i]);
+      jw_close(j,'}');
+    }
+    jw_close(j,']');
+    break;
+  case ST_FB:
+    jw_key(j,"feedback"); jw_open(j,'{');
+    jw_kint(j,"enable",c->fb_enable); jw_knum(j,"scale",3,sh->fb_scale); jw_kint(j,"target_ms",c->fb_target_ms);
+    jw_close(j,'}');
+    break;
+  case ST_ENC:
+    jw_key(j,"encoder"); jw_open(j,'{');
+    jw_kint(j,"enable",ccfg.enc_enable); jw_kint(j,"target_kbps",enc_want); jw_kint(j,"sent_kbps",enc_sent);
+    jw_kint(j,"last_push_ms",enc_last_ms? (long long)(now-enc_last_ms) : -1LL); jw_kint(j,"errors",enc_errors);
+    jw_close(j,'}');
+    break;
+  case ST_TC: jw_kint(j,"tc_last_update_ms",(long long)(now-sh->last_tc_ms)); break;
+  case ST_LINKS:
+    if(nlinks<2) break;
+    jw_kint(j,"budget_kbps",budget_kbps);
+    jw_key(j,"links"); jw_open(j,'[');
+    for(int i=0;i<nlinks;i++){
+      status_t ls; status_snapshot(&ls,&links[i]);
+      jw_open(j,'{');
+      jw_kstr(j,"name",links[i].name);
+      for(int k=ST_WLAN;k<=ST_TC;k++) if(k!=ST_ENC) status_section(j,k,&ls,now);
+      jw_close(j,'}');
+    }
+    jw_close(j,']');
+    break;
+  }
+}
+static void handle_status(conn_t *cn){
+  status_t s; status_snapshot(&s,&links[0]);
+  uint64_t now=now_ms();
+  jw_t j; jw_begin(&j,cn,"application/json");
+  jw_open(&j,'{');
+  for(int i=0;i<ST_N;i++) status_section(&j,i,&s,now);
+  jw_close(&j,'}');
+  jw_end(&j);
+}
+
+/* ---- /events: Server-Sent Events ----
+ * Subscribers get the full status as `event: status`, then `event: delta`
+ * frames holding only the top-level members that changed. A push is due
+ * when rates are applied or the link sample changes; pushes are coalesced
+ * to http_sse_max_hz. A subscriber whose socket is backed up skips deltas
+ * and gets a full snapshot once it catches up.
+ */
+#define SSE_PING_MS 15000
+static int nsse=0;
+static uint64_t sse_last_ms;
+static sbuf_t sse_cur[ST_N], sse_prev[ST_N], sse_delta, sse_full;
+
+static void sse_render(uint64_t now){
+  status_t s; status_snapshot(&s,&links[0]);
+  for(int i=0;i<ST_N;i++){
+    jw_t j; jw_begin_sb(&j,&sse_cur[i]); sse_cur[i].len=0;
+    status_section(&j,i,&s,now); jw_end(&j);
+  }
+}
+/* "event: EV\ndata: {a,b,..}\n\n" from the sections in mask; empty when none */
+static void sse_frame(sbuf_t *out, const char *ev, unsigned mask){
+  out->len=0;
+  if(!mask) return;
+  sb_str(out,"event: "); sb_str(out,ev); sb_str(out,"\ndata: {");
+  bool first=true;
+  for(int i=0;i<ST_N;i++) if(mask&(1u<<i)){
+    if(!first) sb_put(out,",",1);
+    sb_put(out,sse_cur[i].p,sse_cur[i].len); first=false;
+  }
+  sb_str(out,"}\n\n");
+}
+static void sse_write(conn_t *c, const sbuf_t *b){
+  if(!b->len) return;
+  struct iovec iov={b->p,b->len};
+  conn_send(c,&iov,1);
+}
+static void handle_events(conn_t *cn){
+  char hdr[160]; int hl=snprintf(hdr,sizeof(hdr),
+    "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-store\r\nConnection: keep-alive\r\n\r\nretry: 2000\n\n");
+  struct iovec iov={hdr,(size_t)hl};
+  if(conn_send(cn,&iov,1)<0) return;
+  cn->sse=true; cn->keep=true; nsse++;
+  sse_render(now_ms());
+  sse_frame(&sse_full,"status",(1u<<ST_N)-1);
+  sse_write(cn,&sse_full);
+  if(nsse==1)                                /* nobody else: deltas start from here */
+    for(int i=0;i<ST_N;i++){ sse_prev[i].len=0; sb_put(&sse_prev[i],sse_cur[i].p,sse_cur[i].len); }
+}
 /* ---- server loop helpers ---- */
-static int accept_client(int lfd){ struct sockaddr_in sa; socklen_t sl=sizeof(sa); int fd=accept(lfd,(struct sockaddr*)&sa,&sl); if(fd<0) return -1; fcntl(fd,F_SETFL, fcntl(fd,F_GETFL,0)|O_NONBLOCK); return fd; }
 static int is_get(const char *m){ return strcmp(m,"GET")==0; }
 static int is_post(const char *m){ return strcmp(m,"POST")==0; }
-static int is_path(const char *p,const char *want){ return strcmp(p,want)==0 || strcmp(p,want+9)==0; } /* allow legacy w/o /api/v1 */
+static int is_path(const char *p,const char *want){ /* allow legacy w/o /api/v1 */
+  return strcmp(p,want)==0 || (strncmp(want,"/api/v1/",8)==0 && strcmp(p,want+7)==0);
+}
 
 static void ensure_default_conf(const char *path){
   struct stat st; if(stat(path,&st)==0) return;
@@ -560,18 +2180,278 @@ static void ensure_default_conf(const char *path){
 "min_dwell_ms=800\n"
 "headroom_pct=20\n"
 "stale_ms=2500\n"
-"ceil_margin_pct=15\n"
 "eff_10mhz=0.55\n"
 "eff_20mhz=0.60\n"
 "eff_40mhz=0.58\n"
+"telem_key_retry=retry\n"
 "http_max_clients=16\n"
-"\n[class.video]\nmark=1\nfloor_kbps=2000\nceil_kbps_max=120000\n"
-"\n[class.mavlink]\nmark=10\nfloor_kbps=300\nmin_floor_kbps=150\nceil_kbps_max=2000\n"
-"\n[class.tunnel]\nmark=20\nfloor_kbps=200\nceil_kbps_max=3000\n"
-"\n[class.default]\nfloor_kbps=5\nceil_kbps_max=500\n");
+"http_idle_ms=30000\n"
+"http_sse_max_hz=10\n"
+"tc_backend=netlink\n"
+"telem_watch=1\n"
+"cfg_flush_ms=1000\n"
+"; tick_log=/tmp/trafficctrl.tlog  (ring of shaping ticks, see --replay)\n"
+"tick_log=\n"
+"tick_log_records=6000\n"
+"telem_listen=\n"
+"fast_down=1\n"
+"budget_kbps=0\n"
+"; more interfaces: [link1]..[link3] with wlan=, telem_file=, telem_listen=,\n"
+"; telem_key_mcs/width/retry=, headroom_pct=, nss/sgi/vht/ampdu=\n"
+"\n; [class.NAME]: classid=1:HEX weight= floor_kbps= min_floor_kbps= ceil_kbps_max=\n"
+"; prio= mark= qdisc= enable=0; spare capacity is shared by weight\n"
+"\n[class.video]\nclassid=1:1\nweight=8\nmark=1\nfloor_kbps=2000\nceil_kbps_max=120000\nprio=2\nqdisc=fq_codel\n"
+"\n[class.mavlink]\nclassid=1:10\nweight=1\nmark=10\nfloor_kbps=300\nmin_floor_kbps=150\nceil_kbps_max=2000\nprio=1\nqdisc=fq_codel\n"
+"\n[class.tunnel]\nclassid=1:20\nweight=1\nmark=20\nfloor_kbps=200\nceil_kbps_max=3000\nprio=3\nqdisc=fq_codel\n"
+"\n[class.default]\nclassid=1:100\nweight=0\nfloor_kbps=5\nceil_kbps_max=500\nprio=4\nqdisc=pfifo\n"
+"\n[capacity]\nmodel=airtime\nnss=1\nsgi=0\nvht=0\nampdu=8\nmpdu_bytes=1400\nlearn_alpha=0.05\ncorr_min=0.5\ncorr_max=1.1\n"
+"\n[feedback]\nenable=1\ntarget_ms=20\nmd=0.85\nai=0.02\nmin_scale=0.4\nmax_scale=1.0\n"
+"\n[encoder]\nenable=0\ntarget=http://127.0.0.1/api/v1/set?video0.bitrate=%%d\nudp_fmt=bitrate=%%d\n"
+"fec_k=1\nfec_n=1\ndup=1\nmargin_pct=10\nmin_kbps=1024\nmax_kbps=20480\nhysteresis_pct=10\n"
+"down_interval_ms=200\nup_interval_ms=3000\n");
   fclose(f);
 }
 
+/* ---- event loop ----
+ * One epoll set: listener, shaping timerfd, telemetry (inotify + socket),
+ * the encoder hook and every client. Tags below 64 are fixed sources (link i
+ * telemetry is EV_LINK+2i inotify, +1 socket), any other value is a conn_t
+ * pointer.
+ */
+enum { EV_LISTEN=1, EV_TICK, EV_ENC, EV_LINK=8 };
+static int epfd=-1;
+static conn_t *clients[MAX_CLIENTS];
+static int nclients=0;
+static unsigned enc_gen_reg;
+
+static void ep_ctl(int op, int fd, uint64_t tag, uint32_t events){
+  struct epoll_event e; memset(&e,0,sizeof(e)); e.events=events; e.data.u64=tag;
+  if(epoll_ctl(epfd,op,fd,&e)<0 && op!=EPOLL_CTL_DEL) logln("epoll_ctl fd=%d: %s", fd, strerror(errno));
+}
+static void tick_arm(int tfd, uint64_t ms){
+  struct itimerspec its; memset(&its,0,sizeof(its));
+  its.it_interval.tv_sec=(time_t)(ms/1000); its.it_interval.tv_nsec=(long)(ms%1000)*1000000L;
+  its.it_value=its.it_interval;
+  timerfd_settime(tfd,0,&its,NULL);
+}
+/* fds are replaced on reload; closing the old ones already dropped them */
+static void telem_start(int i){
+  shaper_t *s=&links[i];
+  telem_events_open(&s->ts,&s->cfg);
+  if(s->ts.ino>=0){ logln("%s: telemetry: watching %s", s->cfg.wlan, s->cfg.telem_file); ep_ctl(EPOLL_CTL_ADD, s->ts.ino, EV_LINK+2*i, EPOLLIN); }
+  if(s->ts.sfd>=0){ logln("%s: telemetry: listening on %s", s->cfg.wlan, s->cfg.telem_listen); ep_ctl(EPOLL_CTL_ADD, s->ts.sfd, EV_LINK+2*i+1, EPOLLIN); }
+}
+/* (re)open every link's telemetry and shaper tree */
+static void links_start(void){
+  for(int i=0;i<nlinks;i++){
+    tc_setup(&links[i].cfg);
+    telem_start(i);
+    memset(links[i].qs_cur,0,sizeof(links[i].qs_cur));  /* new tree, counters restart */
+    links[i].last_applied_alloc=-1;          /* force re-apply */
+  }
+}
+/* API edits: links that keep their interface get tc_sync() instead of a new
+ * tree, and telemetry is only reopened when its source changed. A full
+ * reload (SIGHUP) rebuilds every tree. Either way an interface no link
+ * uses any more loses its tree. */
+static void links_apply(bool full){
+  static config_t old[MAX_SHAPERS];
+  char oname[MAX_SHAPERS][MAX_NAME]; int on=nlinks;
+  for(int i=0;i<on;i++){ old[i]=links[i].cfg; snprintf(oname[i],sizeof(oname[i]),"%s",links[i].name); }
+  links_load();
+  for(int i=0;i<on;i++){                     /* dropped, or moved to another interface */
+    bool used=false;
+    for(int j=0;j<nlinks;j++) if(strcmp(old[i].wlan,links[j].cfg.wlan)==0) used=true;
+    if(!used){ logln("%s: no longer shaped, deleting tc tree", old[i].wlan); tc_teardown(&old[i]); }
+  }
+  if(full){ links_start(); return; }
+  for(int i=0;i<nlinks;i++){
+    shaper_t *s=&links[i];
+    if(i>=on || strcmp(oname[i],s->name)!=0){ tc_setup(&s->cfg); telem_start(i); s->last_applied_alloc=-1; continue; }
+    const config_t *o=&old[i], *c=&s->cfg;
+    if(tc_sync(o,&s->cfg)<0){ logln("%s: rebuilding tc tree", c->wlan); tc_setup(&s->cfg); }
+    if(strcmp(o->telem_file,c->telem_file)!=0 || strcmp(o->telem_listen,c->telem_listen)!=0 ||
+       o->telem_watch!=c->telem_watch) telem_start(i);
+    memset(s->qs_cur,0,sizeof(s->qs_cur));   /* class indices may have moved */
+    s->last_applied_alloc=-1;
+  }
+}
+/* each push opens a fresh socket; edge-triggered so a connected, idle
+ * socket does not keep reporting EPOLLOUT */
+static void enc_ep_sync(void){
+  if(enc_fd>=0 && enc_gen!=enc_gen_reg){
+    ep_ctl(EPOLL_CTL_ADD, enc_fd, EV_ENC, EPOLLIN|EPOLLOUT|EPOLLET);
+    enc_gen_reg=enc_gen;
+  }
+}
+
+static void telem_got(shaper_t *s, const link_t *prev, uint64_t now){
+  s->last_telem_ms=now;
+  if(!link_same(prev,&s->last_link)) sse_dirty=true;
+}
+/* telemetry tick + shaping. With inotify the file is only re-read when the
+ * sample is half-way to stale, so an unchanged file stays valid. */
+static void on_tick(void){
+  uint64_t now=now_ms();
+  if(icache.dirty && now-icache.dirty_ms >= (uint64_t)ccfg.cfg_flush_ms) ini_flush();
+  for(int i=0;i<nlinks;i++){
+    shaper_t *s=&links[i];
+    bool poll = s->ts.ino<0 || s->last_telem_ms==0 || now-s->last_telem_ms > (uint64_t)s->cfg.stale_ms/2;
+    link_t prev=s->last_link;
+    if(poll && read_telem_file(&s->cfg, &s->last_link)==0) telem_got(s, &prev, now);
+    shape_tick(s, now, false);
+  }
+}
+/* pushed / rewritten telemetry: reshape that link right away */
+static void on_telem(int tag){
+  int i=(tag-EV_LINK)/2; if(i>=nlinks) return;
+  shaper_t *s=&links[i];
+  link_t prev=s->last_link;
+  bool got = (tag-EV_LINK)&1? telem_sock_read(&s->ts,&s->cfg,&s->last_link)
+                            : telem_watch_fired(&s->ts) && read_telem_file(&s->cfg,&s->last_link)==0;
+  if(!got) return;
+  telem_got(s, &prev, now_ms());
+  shape_tick(s, s->last_telem_ms, true);
+}
+
+static void route_request(conn_t *c){
+  bool handled=false;
+  if(is_get(c->method) && (is_path(c->path,"/api/v1/status") || is_path(c->path,"/status"))){
+    handle_status(c); handled=true;
+  } else if(is_get(c->method) && (is_path(c->path,"/api/v1/events") || is_path(c->path,"/events"))){
+    handle_events(c); handled=true;
+  } else if(is_get(c->method) && (is_path(c->path,"/api/v1/config") || is_path(c->path,"/config"))){
+    handle_get_config(c, ccfg.cfg_path); handled=true;
+  } else if(is_post(c->method) && (is_path(c->path,"/api/v1/config") || is_path(c->path,"/config"))){
+    handle_post_config(c, ccfg.cfg_path, c->body, c->content_len); handled=true;
+  } else if(is_get(c->method) && (is_path(c->path,"/api/v1/get") || is_path(c->path,"/get"))){
+    handle_get_kv(c, ccfg.cfg_path, c->query); handled=true;
+  } else if(is_post(c->method) && (is_path(c->path,"/api/v1/set") || is_path(c->path,"/set"))){
+    handle_set_kv(c, ccfg.cfg_path, c->query); handled=true;
+  } else if(is_post(c->method) && (is_path(c->path,"/api/v1/action/reload") || is_path(c->path,"/action/reload") || is_path(c->path,"/reload"))){
+    json_ok(c); want_reload_sig=1; handled=true;
+  } else if(is_get(c->method) && (is_path(c->path,"/api/v1/keys") || is_path(c->path,"/keys"))){
+    handle_keys(c, ccfg.cfg_path, c->query); handled=true;
+  }
+  if(!handled) http_err(c,404,"no route");
+}
+
+static void conn_close(conn_t *c){
+  if(c->sse) nsse--;
+  for(int i=0;i<nclients;i++) if(clients[i]==c){ clients[i]=clients[--nclients]; break; }
+  close(c->fd); free(c->out); free(c);
+}
+static void conn_accept(void){
+  for(;;){
+    int fd=accept4(lfd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if(fd<0) return;
+    int lim=ccfg.http_max_clients>0 && ccfg.http_max_clients<MAX_CLIENTS? ccfg.http_max_clients : MAX_CLIENTS;
+    conn_t *c = nclients<lim? malloc(sizeof(conn_t)) : NULL;
+    if(!c){ close(fd); continue; }
+    memset(c,0,offsetof(conn_t,req));
+    c->rlen=0; c->out=NULL; c->olen=c->ooff=c->ocap=0;
+    c->fd=fd; c->last_ms=now_ms();
+    int one=1; setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    clients[nclients++]=c;
+    ep_ctl(EPOLL_CTL_ADD, fd, (uint64_t)(uintptr_t)c, EPOLLIN);
+  }
+}
+/* answer every complete request in the buffer, in order */
+static void conn_serve(conn_t *c){
+  while(!c->sse && !c->closing && !c->dead && c->olen-c->ooff < OUT_HIWAT){
+    int pr=parse_request(c);
+    if(pr==0){
+      if(c->rlen>=sizeof(c->req)-1){ c->keep=false; http_err(c,413,"request too large"); c->closing=true; }
+      break;
+    }
+    if(pr<0){ c->keep=false; http_err(c,400,"bad request"); c->closing=true; break; }
+    route_request(c);
+    size_t used=c->head_len+c->content_len;
+    memmove(c->req,c->req+used,c->rlen-used); c->rlen-=used;
+    if(!c->keep) c->closing=true;
+  }
+  if(c->sse) c->rlen=0;                      /* subscribers have nothing more to say */
+}
+/* re-arm after I/O: EPOLLOUT while replies are pending, no EPOLLIN while
+ * the backlog is above OUT_HIWAT */
+static void conn_update(conn_t *c){
+  size_t pend=c->olen-c->ooff;
+  if(c->dead || (c->closing && !pend)){ conn_close(c); return; }
+  uint32_t ev=(pend>=OUT_HIWAT || c->closing? 0:EPOLLIN) | (pend? EPOLLOUT:0);
+  bool out=pend>0;
+  if(out!=c->want_out || pend>=OUT_HIWAT || c->closing){
+    c->want_out=out;
+    ep_ctl(EPOLL_CTL_MOD, c->fd, (uint64_t)(uintptr_t)c, ev);
+  }
+}
+static void conn_event(conn_t *c, uint32_t ev){
+  c->last_ms=now_ms();
+  if(ev&EPOLLERR) c->dead=true;
+  if(!c->dead && (ev&EPOLLOUT)){
+    int r=conn_drain(c);
+    if(r<0) c->dead=true;
+    else if(r>0){ conn_serve(c); if(c->sse_resync) sse_dirty=true; }   /* resume a stalled pipeline / stream */
+  }
+  if(!c->dead && (ev&(EPOLLIN|EPOLLHUP))){
+    bool eof=false;
+    while(c->rlen<sizeof(c->req)-1){
+      ssize_t rd=read(c->fd, c->req+c->rlen, sizeof(c->req)-1-c->rlen);
+      if(rd>0){ c->rlen+=(size_t)rd; continue; }
+      if(rd==0) eof=true;
+      else if(errno==EINTR) continue;
+      else if(errno!=EAGAIN && errno!=EWOULDBLOCK) c->dead=true;
+      break;
+    }
+    conn_serve(c);
+    if(eof) c->closing=true;
+  }
+  conn_update(c);
+}
+/* drop idle keep-alive clients and clients that stopped reading; keep
+ * /events subscribers alive with a comment line */
+static void conn_sweep(void){
+  uint64_t now=now_ms();
+  for(int i=nclients-1;i>=0;i--){
+    conn_t *c=clients[i];
+    if(c->sse){
+      if(now-c->last_ms < SSE_PING_MS) continue;
+      struct iovec iov={(void*)": ping\n\n",8};
+      c->last_ms=now; conn_send(c,&iov,1); conn_update(c);
+    }else if(now-c->last_ms > (uint64_t)ccfg.http_idle_ms) conn_close(c);
+  }
+}
+/* ms until the next /events push may go out, -1 when none is due */
+static int sse_wait_ms(uint64_t now){
+  if(!sse_dirty || !nsse) return -1;
+  uint64_t gap = ccfg.http_sse_max_hz>0? 1000/(uint64_t)ccfg.http_sse_max_hz : 0;
+  return now-sse_last_ms>=gap? 0 : (int)(gap-(now-sse_last_ms));
+}
+static void sse_push(void){
+  uint64_t now=now_ms();
+  if(sse_wait_ms(now)!=0) return;
+  sse_dirty=false; sse_last_ms=now;
+  sse_render(now);
+  unsigned changed=0; bool resync=false;
+  for(int i=0;i<ST_N;i++){
+    sbuf_t *a=&sse_cur[i], *b=&sse_prev[i];
+    if(a->len!=b->len || memcmp(a->p,b->p,a->len)){
+      changed|=1u<<i;
+      b->len=0; sb_put(b,a->p,a->len);
+    }
+  }
+  for(int i=0;i<nclients;i++) if(clients[i]->sse && clients[i]->sse_resync) resync=true;
+  sse_frame(&sse_delta,"delta",changed);
+  sse_frame(&sse_full,"status",resync? (1u<<ST_N)-1 : 0);
+  for(int i=nclients-1;i>=0;i--){
+    conn_t *c=clients[i];
+    if(!c->sse) continue;
+    if(c->olen-c->ooff >= OUT_HIWAT){ c->sse_resync=true; continue; }
+    sse_write(c, c->sse_resync? &sse_full : &sse_delta);
+    c->sse_resync=false;
+    conn_update(c);
+  }
+}
+
 /* ---- main serve loop ---- */
 int main(int argc, char **argv){
   cfg_defaults(&ccfg);
@@ -581,122 +2461,64 @@ int main(int argc, char **argv){
 
   signal(SIGPIPE, SIG_IGN);
   signal(SIGHUP, on_hup);
+  signal(SIGTERM, on_term);
+  signal(SIGINT, on_term);
+
+  if(argc>3 && strcmp(argv[2],"--bench-tc")==0){ tc_bench(&ccfg, atoi(argv[3])); return 0; }
+  if(argc>3 && strcmp(argv[2],"--replay")==0) return tlog_replay(argc-3, argv+3);
 
   lfd = tcp_listen(ccfg.http_addr, ccfg.http_max_clients);
   if(lfd<0){ fprintf(stderr,"bind %s failed\n", ccfg.http_addr); return 1; }
 
-  tc_setup(&ccfg);
+  links_load();
+  tlog_open(&ccfg);
 
   start_ms = now_ms();
   uint64_t tick_ms = (ccfg.sample_hz>0? (1000/ccfg.sample_hz):100);
   if(tick_ms<10) tick_ms=10;
 
-  conn_t clients[MAX_CLIENTS]; memset(clients,0,sizeof(clients));
-  int cuse[MAX_CLIENTS]; for(int i=0;i<MAX_CLIENTS;i++) cuse[i]=0;
+  epfd=epoll_create1(EPOLL_CLOEXEC);
+  int tfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+  if(epfd<0 || tfd<0){ fprintf(stderr,"epoll/timerfd: %s\n", strerror(errno)); return 1; }
+  tick_arm(tfd,tick_ms);
+  ep_ctl(EPOLL_CTL_ADD, lfd, EV_LISTEN, EPOLLIN);
+  ep_ctl(EPOLL_CTL_ADD, tfd, EV_TICK, EPOLLIN);
+  links_start();
+  on_tick();
 
-  while(1){
-    if(want_reload_sig){
-      want_reload_sig=0;
+  struct epoll_event evs[32];
+  while(!want_exit_sig){
+    if(want_reload_sig || want_apply){
+      bool full=want_reload_sig;
+      want_reload_sig=0; want_apply=false;
       cfg_load(&ccfg, ccfg.cfg_path);
-      tc_setup(&ccfg);
-      last_applied_alloc=-1; /* force re-apply */
-    }
-
-    /* telemetry tick + shaping */
-    static uint64_t last_tick=0;
-    uint64_t now=now_ms();
-    if(now - last_tick >= tick_ms){
-      last_tick = now;
-      int m=-1, w=-1;
-      if(read_telem_file(ccfg.telem_file, ccfg.key_mcs, ccfg.key_width, &m, &w)==0){
-        last_mcs=m; last_width=w; last_telem_ms=now;
-      }
-      int use_m = last_mcs, use_w = last_width;
-      if(use_m<0 || use_w<=0 || (now - last_telem_ms) > (uint64_t)ccfg.stale_ms){
-        use_m=0; use_w=20; /* fallback */
-      }
-      double phy = phy_for(use_w, use_m);
-      double eff = eff_for(&ccfg, use_w);
-      int usable_kbps = (int)(phy * 1000.0 * eff + 0.5);
-      int alloc_kbps = (int)(usable_kbps * (100 - ccfg.headroom_pct) / 100);
-      if(alloc_kbps<100) alloc_kbps=100;
-
-      if(sm_alloc_kbps<=0.1) sm_alloc_kbps = alloc_kbps;
-      else sm_alloc_kbps = ccfg.alpha*alloc_kbps + (1.0-ccfg.alpha)*sm_alloc_kbps;
-
-      static int hold_active=0;
-      static int last_target=-1;
-      int target = (int)(sm_alloc_kbps + 0.5);
-
-      int diff = (last_applied_alloc<0)? 100 : abs(target - last_applied_alloc);
-      int pct  = (last_applied_alloc<=0)? 100 : (diff*100)/(last_applied_alloc? last_applied_alloc:1);
-
-      if(pct >= ccfg.hysteresis_pct){
-        if(!hold_active){ hold_active=1; last_hold_start_ms=now; }
-        if(now - last_hold_start_ms >= (uint64_t)ccfg.hysteresis_hold_ms && now - last_tc_ms >= (uint64_t)ccfg.min_dwell_ms){
-          rates_t rr; allocate(&ccfg, target, &rr);
-          tc_apply_rates(&ccfg, &rr);
-          last_tc_ms = now;
-          last_applied_alloc = target;
-          hold_active=0;
-        }
-      } else { hold_active=0; last_target=target; }
-
-      /* keep some status ready: we can recompute when /status hits to avoid drift */
+      tlog_open(&ccfg);
+      links_apply(full);
+      tick_ms = (ccfg.sample_hz>0? (1000/ccfg.sample_hz):100);
+      if(tick_ms<10) tick_ms=10;
+      tick_arm(tfd,tick_ms);
     }
 
-    /* accept + serve */
-    fd_set rfds; FD_ZERO(&rfds);
-    int maxfd=lfd; FD_SET(lfd,&rfds);
-    for(int i=0;i<MAX_CLIENTS;i++){ if(cuse[i]){ FD_SET(clients[i].fd,&rfds); if(clients[i].fd>maxfd) maxfd=clients[i].fd; } }
-    struct timeval tv; tv.tv_sec=0; tv.tv_usec=10000; /* 10ms */
-    int rv=select(maxfd+1,&rfds,NULL,NULL,&tv);
-    if(rv<0){ if(errno==EINTR) continue; break; }
-
-    if(FD_ISSET(lfd,&rfds)){
-      int cfd=accept_client(lfd);
-      if(cfd>=0){
-        int slot=-1;
-        for(int i=0;i<MAX_CLIENTS;i++) if(!cuse[i]){ slot=i; break; }
-        if(slot<0){ close(cfd); } else { memset(&clients[slot],0,sizeof(conn_t)); clients[slot].fd=cfd; cuse[slot]=1; }
-      }
+    int n=epoll_wait(epfd,evs,32,sse_wait_ms(now_ms()));
+    if(n<0){ if(errno==EINTR) continue; break; }
+    bool ticked=false;
+    /* shaping first: a batch of client events never delays the tick */
+    for(int i=0;i<n;i++) if(evs[i].data.u64==EV_TICK){
+      uint64_t exp; (void)!read(tfd,&exp,sizeof(exp));
+      on_tick(); ticked=true;
     }
-    for(int i=0;i<MAX_CLIENTS;i++) if(cuse[i] && FD_ISSET(clients[i].fd,&rfds)){
-      conn_t *c=&clients[i];
-      ssize_t rd=read(c->fd, c->req+c->rlen, sizeof(c->req)-1-c->rlen);
-      if(rd<=0){ close(c->fd); cuse[i]=0; continue; }
-      c->rlen+= (size_t)rd; if(c->rlen>=sizeof(c->req)-1){ close(c->fd); cuse[i]=0; continue; }
-      int pr=parse_request(c); if(pr==0) continue; /* need more */
-      /* route */
-      bool handled=false;
-      if(is_get(c->method) && (is_path(c->path,"/api/v1/status") || is_path(c->path,"/status"))){
-        /* recompute status quickly from current smoothed/baseline */
-        int use_m = (last_mcs>=0)? last_mcs:0;
-        int use_w = (last_width>0)? last_width:20;
-        if((now_ms()-last_telem_ms) > (uint64_t)ccfg.stale_ms){ use_m=0; use_w=20; }
-        double phy=phy_for(use_w,use_m), eff=eff_for(&ccfg,use_w);
-        int usable_kbps=(int)(phy*1000.0*eff + 0.5);
-        int alloc_kbps=(int)(usable_kbps * (100 - ccfg.headroom_pct) / 100);
-        if(alloc_kbps<100) alloc_kbps=100;
-        rates_t rr; allocate(&ccfg, (int)(sm_alloc_kbps>0? sm_alloc_kbps:alloc_kbps), &rr);
-        handle_status(c->fd, use_m, use_w, rr.alloc_total, &rr, eff, phy, usable_kbps);
-        handled=true;
-      } else if(is_get(c->method) && (is_path(c->path,"/api/v1/config") || is_path(c->path,"/config"))){
-        handle_get_config(c->fd, ccfg.cfg_path); handled=true;
-      } else if(is_post(c->method) && (is_path(c->path,"/api/v1/config") || is_path(c->path,"/config"))){
-        handle_post_config(c->fd, ccfg.cfg_path, c->body, c->content_len); handled=true;
-      } else if(is_get(c->method) && (is_path(c->path,"/api/v1/get") || is_path(c->path,"/get"))){
-        handle_get_kv(c->fd, ccfg.cfg_path, c->query); handled=true;
-      } else if(is_post(c->method) && (is_path(c->path,"/api/v1/set") || is_path(c->path,"/set"))){
-        handle_set_kv(c->fd, ccfg.cfg_path, c->query); handled=true;
-      } else if(is_post(c->method) && (is_path(c->path,"/api/v1/action/reload") || is_path(c->path,"/action/reload") || is_path(c->path,"/reload"))){
-        json_ok(c->fd); want_reload_sig=1; handled=true;
-      } else if(is_get(c->method) && (is_path(c->path,"/api/v1/keys") || is_path(c->path,"/keys"))){
-        handle_keys(c->fd, ccfg.cfg_path, c->query); handled=true;
-      }
-      if(!handled) http_err(c->fd,404,"no route");
-      close(c->fd); cuse[i]=0;
+    for(int i=0;i<n;i++){
+      uint64_t tag=evs[i].data.u64;
+      if(tag==EV_TICK) continue;
+      else if(tag==EV_LISTEN) conn_accept();
+      else if(tag==EV_ENC) enc_io(evs[i].events&(EPOLLIN|EPOLLHUP|EPOLLERR), evs[i].events&EPOLLOUT);
+      else if(tag>=EV_LINK && tag<EV_LINK+2*MAX_SHAPERS) on_telem((int)tag);
+      else conn_event((conn_t*)(uintptr_t)tag, evs[i].events);
     }
+    if(ticked) conn_sweep();                 /* after the batch: may free conns */
+    sse_push();
+    enc_ep_sync();
   }
+  ini_flush();
   return 0;
 }